@@ -0,0 +1,246 @@
+// lua_ffi.hpp / lua_math.cpp regression checks
+//
+//   c++ -std=c++17 -O2 lua_regress.cpp ../lua_math.cpp -o lua_regress -llua
+//   ./lua_regress
+//
+// Each check runs a snippet that used to crash or misbehave; the program
+// prints what failed and exits non-zero if any did. Linux only (lua_async).
+#include "../lua_async.hpp"
+#include "../lua_ffi.hpp"
+#include "../lua_math.hpp"
+#include <chrono>
+#include <cstdio>
+#include <sys/socket.h>
+
+static int failures = 0;
+
+// runs code, which should succeed (or fail, when expect_error)
+static void check(lua_State *L, const char *what, const char *code,
+                  bool expect_error = false) {
+  bool failed = luaL_dostring(L, code) != LUA_OK;
+  if (failed != expect_error) {
+    printf("FAIL %s: %s\n", what,
+           failed ? lua_tostring(L, -1) : "no error raised");
+    failures++;
+  }
+  lua_settop(L, 0);
+}
+
+// ---- hand-written Type_new sharing a LUA_CLASS metatable
+// Foo is stored inline in the userdata, Bar as a bare Bar* box: neither has
+// a LuaUdHeader, so the shared __gc must leave them alone.
+struct Foo {
+  double a, b, c;
+};
+static int Foo_new(lua_State *L) {
+  auto *f = static_cast<Foo *>(lua_newuserdata(L, sizeof(Foo)));
+  *f = Foo{1e300, -1, 3}; // garbage as a header
+  luaL_setmetatable(L, "Foo");
+  return 1;
+}
+static int Foo_sum(lua_State *L) {
+  auto *f = static_cast<Foo *>(luaL_checkudata(L, 1, "Foo"));
+  lua_pushnumber(L, f->a + f->b + f->c);
+  return 1;
+}
+LUA_CLASS(Foo, "Foo", {"sum", Foo_sum})
+
+struct Bar {
+  int hits = 0;
+};
+static Bar bar; // not owned by Lua
+static int Bar_new(lua_State *L) {
+  *static_cast<Bar **>(lua_newuserdata(L, sizeof(Bar *))) = &bar;
+  luaL_setmetatable(L, "Bar");
+  return 1;
+}
+static int Bar_hits(lua_State *L) {
+  lua_pushinteger(L, (*static_cast<Bar **>(luaL_checkudata(L, 1, "Bar")))->hits);
+  return 1;
+}
+LUA_CLASS(Bar, "Bar", {"hits", Bar_hits})
+
+// a header userdata, so its metatable is reachable from scripts
+struct Baz {
+  std::string s = "baz";
+};
+static int Baz_new(lua_State *L) {
+  pushValueWithMeta<Baz>(L, "Baz");
+  return 1;
+}
+static int Baz_get(lua_State *L) {
+  lua_pushstring(L, checkValue<Baz>(L, 1, "Baz")->s.c_str());
+  return 1;
+}
+LUA_CLASS(Baz, "Baz", {"get", Baz_get})
+
+// LUA_CLASS's first argument is only a name prefix: no C++ type Player
+struct PlayerObj {
+  int hp = 100;
+};
+static int Player_new(lua_State *L) {
+  pushValueWithMeta<PlayerObj>(L, "Player");
+  return 1;
+}
+static int Player_hp(lua_State *L) {
+  lua_pushinteger(L, checkValue<PlayerObj>(L, 1, "Player")->hp);
+  return 1;
+}
+LUA_CLASS(Player, "Player", {"hp", Player_hp})
+
+// LUA_CLASS_BOUND binds the C++ type, for lua_ctor / lua_bind methods
+struct Counter {
+  int n = 0;
+  int add(int k) { return n += k; }
+};
+constexpr lua_CFunction Counter_new = lua_ctor<Counter>;
+LUA_CLASS_BOUND(Counter, "Counter", LUA_BIND_METHOD(Counter, add))
+
+// lua_bind with std::string parameters; a bad later argument must not leave
+// a half-built string behind (run under ASan/LSan to see one)
+static size_t joinedLength(std::string a, const std::string &b, int times) {
+  return (a + b).size() * static_cast<size_t>(times);
+}
+
+// ---- metatable names built in a reused buffer
+struct Apple {
+  int seeds = 5;
+};
+struct Brick {
+  double weight = 2.5;
+};
+static int pushFruitAndBrick(lua_State *L) {
+  char name[16];
+  snprintf(name, sizeof name, "Apple");
+  pushPtrWithMeta(L, new Apple, name);
+  snprintf(name, sizeof name, "Brick");
+  pushPtrWithMeta(L, new Brick, name);
+  return 2;
+}
+static int appleSeeds(lua_State *L) {
+  lua_pushinteger(L, getPtr<Apple>(L, 1, "Apple")->seeds);
+  return 1;
+}
+
+// ---- async.wait(fd, "rw") with both directions ready: one wake-up, and
+// the sleep after it really sleeps
+static void checkAsyncWaitRW() {
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 || write(sv[1], "x", 1) != 1)
+    return;
+  {
+    LuaEventLoop loop(L);
+    lua_pushinteger(L, sv[0]);
+    lua_setglobal(L, "FD");
+    luaL_loadstring(L, "async.wait(FD, 'rw') async.sleep(0.2) "
+                       "async.wait(FD, 'w') async.sleep(0.2)");
+    loop.spawn(0);
+    auto t0 = std::chrono::steady_clock::now();
+    loop.run();
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - t0)
+                      .count();
+    if (secs < 0.39) {
+      printf("FAIL async.wait rw: sleeps took %.3fs, expected 0.4s\n", secs);
+      failures++;
+    }
+  }
+  close(sv[0]);
+  close(sv[1]);
+  lua_close(L);
+}
+
+int main() {
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+  initFuncs(L);
+  register_Foo(L);
+  register_Bar(L);
+  register_Baz(L);
+  register_Player(L);
+  register_Counter(L);
+  register_buffers(L);
+  lua_register(L, "pushFruitAndBrick", pushFruitAndBrick);
+  lua_register(L, "appleSeeds", appleSeeds);
+  lua_register(L, "joinedLength", lua_bind<&joinedLength>);
+
+  check(L, "inline Type_new survives __gc",
+        "for i = 1, 1000 do local f = Foo.new() assert(f:sum() ~= 0) end "
+        "collectgarbage() collectgarbage()");
+  check(L, "boxed Type_new survives __gc",
+        "for i = 1, 1000 do assert(Bar.new():hits() == 0) end "
+        "collectgarbage() collectgarbage()");
+  check(L, "LUA_CLASS without a C++ type of that name",
+        "assert(Player.new():hp() == 100)");
+  check(L, "LUA_CLASS_BOUND", "local c = Counter.new() c:add(2) "
+                              "assert(c:add(3) == 5)");
+
+  check(L, "metanames from one buffer stay apart",
+        "local a, b = pushFruitAndBrick() assert(appleSeeds(a) == 5) "
+        "assert(getmetatable(a) ~= getmetatable(b))");
+  check(L, "getPtr by name rejects the other type",
+        "local a, b = pushFruitAndBrick() return appleSeeds(b)", true);
+
+  check(L, "lua_bind std::string arguments",
+        "assert(joinedLength(string.rep('a', 40), string.rep('b', 40), 2) == 160)");
+  check(L, "lua_bind std::string arguments, then a bad one",
+        "return joinedLength(string.rep('a', 40), string.rep('b', 40), 'x')",
+        true);
+
+  // ---- buffer metamethods called by hand on other values
+  check(L, "buffer __index on a number",
+        "return debug.getmetatable(buffer.f64(2)).__index(12345, 1)", true);
+  check(L, "f64 buffer __newindex on a u8 buffer",
+        "debug.getmetatable(buffer.f64(2)).__newindex(buffer.u8(1), 1, 1)", true);
+  check(L, "buffer __newindex on a Vec2",
+        "debug.getmetatable(buffer.i32(2)).__newindex(Vec2.new(1, 2), 1, 1)", true);
+  check(L, "buffer element used after a script-called __gc",
+        "local b = buffer.f64(4) debug.getmetatable(b).__gc(b) return b[1]", true);
+  check(L, "buffer elements",
+        "local b = buffer.f64(3) b[2] = 1.5 assert(b[2] == 1.5 and b[4] == nil) "
+        "assert(b:slice(2)[1] == 1.5)");
+  check(L, "object used after a script-called __gc",
+        "local b = Baz.new() getmetatable(b).__gc(b) return b:get()", true);
+
+  // ---- Vec2 / Vec3 metamethods
+  check(L, "Vec2 __newindex on a table",
+        "getmetatable(Vec2.new(1, 2)).__newindex({}, 'x', 1)", true);
+  check(L, "Vec3 __index on a buffer",
+        "return getmetatable(Vec3.new(1, 2, 3)).__index(buffer.f64(4), 'z')",
+        true);
+  check(L, "vector == other userdata is false",
+        "assert(Vec2.new(1, 2) ~= Vec3.new(1, 2, 3)) "
+        "assert(Vec3.new(1, 2, 3) ~= buffer.f64(3)) "
+        "assert(Vec2.new(1, 2) == Vec2.new(1, 2))");
+
+  // ---- Vec4 / Quat / Mat3 / Mat4 metamethods
+  check(L, "math type == other type is false",
+        "assert(Vec4.new() ~= Quat.new()) "
+        "local l = {Mat4.new(), Vec4.new(1, 2, 3, 4), Mat3.new()} local at "
+        "for i = 1, #l do if Vec4.new(1, 2, 3, 4) == l[i] then at = i end end "
+        "assert(at == 2)");
+  check(L, "Mat4 __newindex on a Mat3",
+        "getmetatable(Mat4.new()).__newindex(Mat3.new(), 16, 1)", true);
+  check(L, "Quat __index on a Vec2",
+        "return getmetatable(Quat.new()).__index(Vec2.new(1, 2), 'w')", true);
+
+  // ---- SpatialGrid / AABBTree
+  check(L, "SpatialGrid used after a script-called __gc",
+        "local g = SpatialGrid.new(1) g:insert(1, Vec2.new(0, 0)) "
+        "local gc = getmetatable(g).__gc gc(g) gc(g) g:insert(2, Vec2.new(1, 1))",
+        true);
+  check(L, "AABBTree __gc on another type",
+        "local v = Vec3.new(1, 2, 3) getmetatable(AABBTree.new()).__gc(v) "
+        "assert(v.z == 3)");
+  check(L, "collected indexes",
+        "for i = 1, 100 do local t = AABBTree.new() "
+        "t:insert(i, {x = 0, y = 0}, {x = 1, y = 1}) end collectgarbage()");
+
+  lua_close(L);
+  checkAsyncWaitRW();
+  if (failures == 0)
+    printf("all checks passed\n");
+  return failures != 0;
+}
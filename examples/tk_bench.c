@@ -0,0 +1,407 @@
+/* tokenizer.h throughput benchmark
+ *
+ *   cc -O2 -pthread tk_bench.c -o tk_bench
+ *   ./tk_bench [-s size] [-r reps] [-m modes] [--csv] [corpus...]
+ *
+ * corpus: ident, comment, string, number, program (generated), or the path
+ *         of a .sal file, repeated up to the size.  Default: every generated
+ *         kind.
+ * size:   bytes per corpus, with K/M/G suffixes (default 16M; 1M..1G).
+ * modes:  comma list of tokenize, soa, stream, parallel, cached (default all).
+ *
+ * Reports MB/s and million tokens/s for lexing, allocations per token, the
+ * peak heap while lexing, and the time tk_free_tokens (or the mode's free)
+ * takes.  Configurations compare side by side in the table; to compare
+ * builds (say -DTK_NO_SIMD against the default) run each with --csv and
+ * paste the outputs together.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+/* counting allocator: every tokenizer allocation goes through here.  The
+ * parallel mode allocates from several threads at once, so the counters are
+ * atomic (relaxed: they are only read between runs). */
+static atomic_size_t n_allocs, live_bytes, peak_bytes;
+
+typedef union { size_t size; max_align_t align; } AllocHeader;
+
+/* one more allocation, live grew by grow bytes (mod 2^n, so it may shrink) */
+static void count_alloc(size_t grow) {
+	atomic_fetch_add_explicit(&n_allocs, 1, memory_order_relaxed);
+	size_t live = atomic_fetch_add_explicit(&live_bytes, grow, memory_order_relaxed) + grow;
+	size_t peak = atomic_load_explicit(&peak_bytes, memory_order_relaxed);
+	while (live > peak && !atomic_compare_exchange_weak_explicit(&peak_bytes, &peak, live,
+			memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+static void *bench_malloc(size_t n) {
+	AllocHeader *h = malloc(sizeof *h + n);
+	if (!h) return NULL;
+	h->size = n;
+	count_alloc(n);
+	return h + 1;
+}
+static void bench_free(void *p) {
+	if (!p) return;
+	AllocHeader *h = (AllocHeader *)p - 1;
+	atomic_fetch_sub_explicit(&live_bytes, h->size, memory_order_relaxed);
+	free(h);
+}
+static void *bench_realloc(void *p, size_t n) {
+	if (!p) return bench_malloc(n);
+	AllocHeader *h = (AllocHeader *)p - 1;
+	size_t old = h->size;
+	h = realloc(h, sizeof *h + n);
+	if (!h) return NULL;
+	h->size = n;
+	count_alloc(n - old);
+	return h + 1;
+}
+
+#define TK_MALLOC(n)     bench_malloc(n)
+#define TK_REALLOC(p, n) bench_realloc(p, n)
+#define TK_FREE(p)       bench_free(p)
+#define CREATE_TOKENIZER
+#define TK_KEYWORDS_LIST {\
+	"reg","push","pop","add","sub","mult","div",\
+	"eq","lt","gt","print","set","get","load","save",\
+	"jmp","jz","jnz","label","concat","cast","dup",\
+	"read", "call", "loadShared"\
+}
+#define TK_OPERATORS_LIST {"==","!=","<=",">=","&&","||","+=","-=","*=","/=",\
+	"+","-","*","/","%","=","<",">","!","&","|"}
+#include "../tokenizer.h"
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* ─── corpora ─── */
+
+static unsigned long long rng = 88172645463325252ull;
+static unsigned rnd(unsigned n) {
+	rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+typedef struct { char *p; size_t len, cap; } Buf;
+
+static void put(Buf *b, const char *s, size_t n) {
+	if (b->len + n + 1 > b->cap) {
+		while (b->len + n + 1 > b->cap) b->cap = b->cap ? b->cap * 2 : 1 << 16;
+		b->p = realloc(b->p, b->cap);
+	}
+	memcpy(b->p + b->len, s, n);
+	b->len += n;
+	b->p[b->len] = 0;
+}
+static void puts_(Buf *b, const char *s) { put(b, s, strlen(s)); }
+static void putf(Buf *b, const char *fmt, ...) {
+	char tmp[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(tmp, sizeof tmp, fmt, ap);
+	va_end(ap);
+	put(b, tmp, (size_t)n);
+}
+
+static const char *kw[] = { "push", "pop", "add", "sub", "set", "get", "jmp", "jz", "call", "reg", "print" };
+#define NKW (sizeof kw / sizeof *kw)
+
+static void ident(Buf *b, int len) {
+	static const char al[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+	char s[64];
+	s[0] = al[rnd(53)];
+	for (int i = 1; i < len; i++) s[i] = al[rnd(63)];
+	put(b, s, (size_t)len);
+}
+
+static void gen_ident(Buf *b) {
+	for (int i = 0; i < 12; i++) {
+		if (rnd(4) == 0) puts_(b, kw[rnd(NKW)]);
+		else ident(b, 1 + (int)rnd(16));
+		puts_(b, i == 11 ? "\n" : " ");
+	}
+}
+
+static void gen_comment(Buf *b) {
+	if (rnd(2)) {
+		puts_(b, "/* ");
+		for (int l = 0, n = 1 + (int)rnd(4); l < n; l++) { ident(b, 40); puts_(b, " * / ** ///\n   "); }
+		puts_(b, "*/ ");
+	}
+	puts_(b, "push 1 // ");
+	ident(b, 50);
+	puts_(b, "\n");
+}
+
+static void gen_string(Buf *b) {
+	puts_(b, "set msg \"");
+	for (int i = 0, n = 2 + (int)rnd(6); i < n; i++) {
+		ident(b, 12);
+		puts_(b, rnd(3) ? " " : "\\\"\\n\\\\ ");
+	}
+	puts_(b, "\" 'a' '\\n'\n");
+}
+
+static void gen_number(Buf *b) {
+	for (int i = 0; i < 8; i++) {
+		switch (rnd(6)) {
+		case 0: putf(b, "%u", rnd(100000)); break;
+		case 1: putf(b, "-%u", rnd(1000)); break;
+		case 2: putf(b, "%u.%u", rnd(10000), rnd(1000000)); break;
+		case 3: putf(b, "%ue%d", 1 + rnd(9), (int)rnd(40) - 20); break;
+		case 4: putf(b, "0x%X", rnd(0xffffff)); break;
+		default: putf(b, "0b%u%u%u%u", rnd(2), rnd(2), rnd(2), rnd(2)); break;
+		}
+		puts_(b, i == 7 ? "\n" : ", ");
+	}
+}
+
+/* something shaped like the simple-assembly-language examples */
+static void gen_program(Buf *b) {
+	static int lbl;
+	switch (rnd(10)) {
+	case 0: putf(b, "label L%d:\n", lbl++); break;
+	case 1: putf(b, "    jnz L%u // loop back\n", rnd(lbl + 1)); break;
+	case 2: putf(b, "    set counter%u %u\n", rnd(50), rnd(1000)); break;
+	case 3: putf(b, "    print \"value of r%u: \" reg r%u\n", rnd(8), rnd(8)); break;
+	case 4: puts_(b, "    /* swap the top two */ dup pop\n"); break;
+	case 5: putf(b, "    call fn_%u\n", rnd(40)); break;
+	case 6: putf(b, "    push %d push %u.%u add\n", (int)rnd(200) - 100, rnd(100), rnd(100)); break;
+	case 7: puts_(b, "    get counter eq 0 jz done\n"); break;
+	case 8: putf(b, "    loadShared \"lib%u.so\"\n", rnd(9)); break;
+	default: puts_(b, "\n"); break;
+	}
+}
+
+static const struct { const char *name; void (*gen)(Buf *); } generators[] = {
+	{ "ident", gen_ident }, { "comment", gen_comment }, { "string", gen_string },
+	{ "number", gen_number }, { "program", gen_program },
+};
+#define NGEN (sizeof generators / sizeof *generators)
+
+static char *load_corpus(const char *name, size_t size, size_t *len) {
+	Buf b = { 0 };
+	for (size_t i = 0; i < NGEN; i++) {
+		if (strcmp(name, generators[i].name)) continue;
+		while (b.len < size) generators[i].gen(&b);
+		*len = b.len;
+		return b.p;
+	}
+	FILE *f = fopen(name, "rb");
+	if (!f) { perror(name); exit(1); }
+	fseek(f, 0, SEEK_END);
+	size_t n = (size_t)ftell(f);
+	rewind(f);
+	char *one = malloc(n + 1);
+	if (fread(one, 1, n, f) != n) { perror(name); exit(1); }
+	fclose(f);
+	if (!n) { *len = 0; return one; }
+	do { put(&b, one, n); put(&b, "\n", 1); } while (b.len < size);
+	free(one);
+	*len = b.len;
+	return b.p;
+}
+
+/* ─── modes ─── */
+
+typedef struct {
+	double lex, release; /* seconds */
+	size_t tokens;
+} Run;
+
+typedef struct { const char *p; size_t left; } MemReader;
+
+static size_t mem_read(void *user, char *buf, size_t cap) {
+	MemReader *m = user;
+	size_t n = m->left < cap ? m->left : cap;
+	memcpy(buf, m->p, n);
+	m->p += n; m->left -= n;
+	return n;
+}
+
+#ifndef TK_NO_CACHE
+static char cache_dir[64];
+#endif
+
+static int run_mode(const char *mode, const char *src, size_t len, Run *r) {
+	double t0 = now(), t1;
+	if (!strcmp(mode, "tokenize")) {
+		size_t n;
+		Token *t = tk_tokenize(src, "bench.sal", &n);
+		t1 = now();
+		tk_free_tokens(t, n);
+		r->tokens = n;
+	} else if (!strcmp(mode, "soa")) {
+		TkTokens t;
+		tk_tokenize_soa(src, "bench.sal", &t);
+		t1 = now();
+		r->tokens = t.count;
+		tk_free_soa(&t);
+	} else if (!strcmp(mode, "stream")) {
+		MemReader m = { src, len };
+		TkLexer *lx = tk_lexer_new(mem_read, &m, "bench.sal");
+		Token t;
+		size_t n = 0;
+		/* tokens are freed as they go, so release is folded into lex */
+		while (tk_next(lx, &t) > 0) { n++; tk_free_token(&t); }
+		t1 = now();
+		tk_lexer_free(lx);
+		r->tokens = n;
+#ifndef TK_NO_THREADS
+	} else if (!strcmp(mode, "parallel")) {
+		size_t n;
+		Token *t = tk_tokenize_parallel(src, "bench.sal", &n, 0);
+		t1 = now();
+		tk_free_tokens(t, n);
+		r->tokens = n;
+#endif
+#ifndef TK_NO_CACHE
+	} else if (!strcmp(mode, "cached")) {
+		/* the first call writes the entry; time the hit */
+		TkTokens t;
+		tk_tokenize_soa_cached(src, "bench.sal", &t, cache_dir);
+		tk_free_soa(&t);
+		t0 = now();
+		tk_tokenize_soa_cached(src, "bench.sal", &t, cache_dir);
+		t1 = now();
+		r->tokens = t.count;
+		tk_free_soa(&t);
+#endif
+	} else {
+		return 0;
+	}
+	r->lex = t1 - t0;
+	r->release = now() - t1;
+	return 1;
+}
+
+static size_t parse_size(const char *s) {
+	char *end;
+	double v = strtod(s, &end);
+	switch (*end | 0x20) {
+	case 'k': v *= 1 << 10; break;
+	case 'm': v *= 1 << 20; break;
+	case 'g': v *= 1 << 30; break;
+	}
+	return (size_t)v;
+}
+
+static const char *build_config(void) {
+	static char s[96];
+	snprintf(s, sizeof s, "simd=%s threads=%s cache=%s",
+#ifdef TK_SIMD
+		__builtin_cpu_supports("avx2") ? "avx2" : "sse2",
+#else
+		"off",
+#endif
+#ifndef TK_NO_THREADS
+		"on",
+#else
+		"off",
+#endif
+#ifndef TK_NO_CACHE
+		"on"
+#else
+		"off"
+#endif
+		);
+	return s;
+}
+
+int main(int argc, char **argv) {
+	size_t size = 16 << 20;
+	int reps = 3, csv = 0;
+	const char *modes = "tokenize,soa,stream,parallel,cached";
+	const char *corpora[64];
+	int ncorpora = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc) size = parse_size(argv[++i]);
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc) reps = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-m") && i + 1 < argc) modes = argv[++i];
+		else if (!strcmp(argv[i], "--csv")) csv = 1;
+		else if (argv[i][0] == '-') {
+			fprintf(stderr, "Usage: %s [-s size] [-r reps] [-m modes] [--csv] [corpus...]\n", argv[0]);
+			return 1;
+		}
+		else if (ncorpora < 64) corpora[ncorpora++] = argv[i];
+	}
+	if (!ncorpora)
+		for (size_t i = 0; i < NGEN; i++) corpora[ncorpora++] = generators[i].name;
+	if (reps < 1) reps = 1;
+
+#ifndef TK_NO_CACHE
+	strcpy(cache_dir, "/tmp/tk_bench.XXXXXX");
+	if (!mkdtemp(cache_dir)) { perror("mkdtemp"); return 1; }
+#endif
+
+	if (csv) printf("build,corpus,bytes,mode,tokens,mb_s,mtok_s,allocs_per_tok,peak_heap_mb,free_ms\n");
+	else printf("%s\n%-10s %8s %-9s %9s %9s %10s %10s %9s\n", build_config(),
+		"corpus", "MB", "mode", "MB/s", "Mtok/s", "allocs/tok", "peak MB", "free ms");
+
+	for (int c = 0; c < ncorpora; c++) {
+		size_t len;
+		char *src = load_corpus(corpora[c], size, &len);
+		char list[256];
+		snprintf(list, sizeof list, "%s", modes);
+		for (char *mode = strtok(list, ","); mode; mode = strtok(NULL, ",")) {
+			Run best = { 0 }, r;
+			size_t allocs = 0, peak = 0;
+			int k;
+			for (k = 0; k < reps; k++) {
+				n_allocs = 0;
+				peak_bytes = live_bytes;
+				size_t base = live_bytes;
+				if (!run_mode(mode, src, len, &r)) break;
+				if (!k || r.lex < best.lex) best = r;
+				allocs = n_allocs;
+				peak = peak_bytes - base;
+			}
+			if (!k) {
+				fprintf(stderr, "unknown or disabled mode '%s'\n", mode);
+				continue;
+			}
+			double mb = len / 1e6, tok = best.tokens ? (double)best.tokens : 1;
+			if (csv)
+				printf("\"%s\",%s,%zu,%s,%zu,%.1f,%.2f,%.3f,%.1f,%.1f\n", build_config(), corpora[c],
+					len, mode, best.tokens, mb / best.lex, best.tokens / 1e6 / best.lex,
+					allocs / tok, peak / 1e6, best.release * 1e3);
+			else
+				printf("%-10s %8.1f %-9s %9.1f %9.2f %10.3f %10.1f %9.1f\n", corpora[c], mb, mode,
+					mb / best.lex, best.tokens / 1e6 / best.lex, allocs / tok, peak / 1e6,
+					best.release * 1e3);
+			fflush(stdout);
+		}
+		free(src);
+	}
+
+#ifndef TK_NO_CACHE
+	DIR *d = opendir(cache_dir);
+	struct dirent *e;
+	while (d && (e = readdir(d))) {
+		char path[sizeof cache_dir + 256];
+		if (e->d_name[0] == '.') continue;
+		snprintf(path, sizeof path, "%s/%s", cache_dir, e->d_name);
+		unlink(path);
+	}
+	if (d) closedir(d);
+	rmdir(cache_dir);
+#endif
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	if (!csv) printf("peak RSS %.1f MB\n", ru.ru_maxrss / 1024.0);
+	return 0;
+}
@@ -0,0 +1,418 @@
+#pragma once
+// Yieldable bindings and a one-thread event loop for Lua coroutines (Linux,
+// epoll). Lua 5.3+.
+//
+// A C binding that has to wait is written as a continuation: it registers
+// what it waits for and returns lua_yieldk(..., k); when the loop resumes
+// the coroutine, k runs with the binding's stack as it was. luaCallThen /
+// luaPCallThen do the same for bindings that call back into Lua, so the
+// callee may yield through them.
+//
+// LuaEventLoop runs tasks (coroutines made by spawn / async.spawn) and
+// resumes each one when the fd it waits on is ready or its timer is due, so
+// thousands of scripted tasks share one thread:
+//
+//   newState(L);
+//   luaL_openlibs(L);
+//   LuaEventLoop loop(L); // also registers the `async` module
+//   luaL_loadstring(L, "local line = async.read(0) print(line)");
+//   loop.spawn(0);
+//   loop.run();           // until every task is done
+//
+// From Lua: async.spawn(fn, ...), async.sleep(seconds), async.wait(fd, "r"
+// | "w" | "rw"), async.read(fd [, max]) -> string | nil at EOF | nil, err,
+// async.write(fd, s) -> #s | nil, err. read/write put the fd in O_NONBLOCK.
+// They can only be called by the task itself, not from a coroutine the task
+// made (that coroutine would yield to its resumer, not to the loop).
+#include "lua_ffi.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <queue>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// ---------------- Continuation helpers ----------------
+// lua_callk, then k with LUA_OK if nothing yielded; the binding's tail is
+// written once, as k, and runs on either path
+inline int luaCallThen(lua_State *L, int nargs, int nresults, lua_KContext ctx,
+                       lua_KFunction k) {
+  lua_callk(L, nargs, nresults, ctx, k);
+  return k(L, LUA_OK, ctx);
+}
+
+// lua_pcallk, then k with the call's status if nothing yielded
+inline int luaPCallThen(lua_State *L, int nargs, int nresults, int msgh,
+                        lua_KContext ctx, lua_KFunction k) {
+  return k(L, lua_pcallk(L, nargs, nresults, msgh, ctx, k), ctx);
+}
+
+// lua_yieldk with a readable error when the caller cannot yield (main
+// thread, or a C boundary without a continuation below it)
+inline int luaYieldThen(lua_State *L, int nresults, lua_KContext ctx,
+                        lua_KFunction k) {
+  if (!lua_isyieldable(L))
+    luaL_error(L, "attempt to wait outside of an async task");
+  return lua_yieldk(L, nresults, ctx, k);
+}
+
+inline int luaResume(lua_State *co, lua_State *from, int nargs, int *nres) {
+#if LUA_VERSION_NUM >= 504
+  return lua_resume(co, from, nargs, nres);
+#else
+  int status = lua_resume(co, from, nargs);
+  *nres = lua_gettop(co);
+  return status;
+#endif
+}
+
+// ---------------- Event loop ----------------
+class LuaEventLoop {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // called with the task and its error message; prints by default
+  std::function<void(lua_State *, const char *)> on_error =
+      [](lua_State *, const char *msg) {
+        fprintf(stderr, "async task: %s\n", msg);
+      };
+
+  // the loop has to be destroyed before L is closed
+  explicit LuaEventLoop(lua_State *L, bool open_module = true) : L_(L) {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0)
+      PANIC("epoll_create1 failed");
+    lua_pushlightuserdata(L, this);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, key());
+    if (open_module)
+      openModule(L);
+  }
+  ~LuaEventLoop() {
+    for (auto &t : tasks_)
+      luaL_unref(L_, LUA_REGISTRYINDEX, t.second.ref);
+    lua_pushnil(L_);
+    lua_rawsetp(L_, LUA_REGISTRYINDEX, key());
+    close(epfd_);
+  }
+  LuaEventLoop(const LuaEventLoop &) = delete;
+  LuaEventLoop &operator=(const LuaEventLoop &) = delete;
+
+  // the loop a state (or any of its threads) belongs to, or nullptr
+  static LuaEventLoop *from(lua_State *L) {
+    lua_rawgetp(L, LUA_REGISTRYINDEX, key());
+    auto *loop = static_cast<LuaEventLoop *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return loop;
+  }
+
+  // makes a task of the function below nargs arguments on L's stack (pops
+  // them); it starts on the next loop turn
+  lua_State *spawn(lua_State *L, int nargs) {
+    lua_State *co = lua_newthread(L);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_xmove(L, co, nargs + 1);
+    tasks_[co] = Task{ref, nargs, false, 0};
+    ready_.push_back(Wake{co, 0});
+    return co;
+  }
+  lua_State *spawn(int nargs) { return spawn(L_, nargs); }
+
+  // runs until no task is left
+  void run() {
+    std::vector<epoll_event> events(64);
+    while (!tasks_.empty()) {
+      while (!ready_.empty()) {
+        Wake wake = ready_.front();
+        ready_.pop_front();
+        resume(wake);
+      }
+      if (tasks_.empty())
+        break;
+      if (waiting_fds_ == 0 && timers_.empty())
+        break; // everything left waits on nothing we can deliver
+      int timeout = -1;
+      if (!timers_.empty()) {
+        auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+            timers_.top().due - Clock::now());
+        timeout = wait.count() > 0 ? static_cast<int>(wait.count()) : 0;
+      }
+      // with only timers pending this is just the sleep until the next one
+      int n = epoll_wait(epfd_, events.data(), static_cast<int>(events.size()),
+                         timeout);
+      for (int i = 0; i < n; i++)
+        fdReady(events[i].data.fd, events[i].events);
+      for (auto now = Clock::now(); !timers_.empty() && timers_.top().due <= now;) {
+        ready_.push_back(Wake{timers_.top().co, timers_.top().gen});
+        timers_.pop();
+      }
+    }
+  }
+
+  size_t tasks() const { return tasks_.size(); }
+
+  // for bindings: suspend the running task until fd has any of events
+  // (EPOLLIN / EPOLLOUT), then continue in k
+  int awaitFd(lua_State *co, int fd, uint32_t events, lua_KContext ctx,
+              lua_KFunction k) {
+    Task &t = task(co);
+    if (!lua_isyieldable(co))
+      luaL_error(co, "attempt to wait outside of an async task");
+    FdWait &w = fds_[fd];
+    if (((events & EPOLLIN) && w.reader) || ((events & EPOLLOUT) && w.writer))
+      luaL_error(co, "fd %d already has a task waiting on it", fd);
+    if (events & EPOLLIN)
+      w.reader = co;
+    if (events & EPOLLOUT)
+      w.writer = co;
+    if (!updateFd(fd, w)) {
+      int err = errno;
+      if (events & EPOLLIN)
+        w.reader = nullptr;
+      if (events & EPOLLOUT)
+        w.writer = nullptr;
+      updateFd(fd, w);
+      luaL_error(co, "cannot wait on fd %d: %s", fd, strerror(err));
+    }
+    t.waiting = true;
+    waiting_fds_++; // once per task, even for "rw"
+    return luaYieldThen(co, 0, ctx, k);
+  }
+
+  // for bindings: suspend the running task for secs, then continue in k
+  int awaitTimer(lua_State *co, double secs, lua_KContext ctx,
+                 lua_KFunction k) {
+    Task &t = task(co);
+    if (!lua_isyieldable(co))
+      luaL_error(co, "attempt to wait outside of an async task");
+    t.waiting = true;
+    auto due = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                  std::chrono::duration<double>(secs));
+    timers_.push(Timer{due, seq_++, co, t.gen});
+    return luaYieldThen(co, 0, ctx, k);
+  }
+
+  static void openModule(lua_State *L);
+
+private:
+  struct Task {
+    int ref;      // anchors the thread in the registry
+    int nargs;    // arguments for the first resume
+    bool waiting; // on an fd or a timer (else a plain yield: next turn)
+    unsigned gen; // bumped on every resume; wakes for an older gen are stale
+  };
+  struct Wake {
+    lua_State *co;
+    unsigned gen; // the task's gen when it started waiting
+  };
+  struct FdWait {
+    lua_State *reader = nullptr, *writer = nullptr;
+    uint32_t registered = 0;
+  };
+  struct Timer {
+    Clock::time_point due;
+    size_t seq; // FIFO among equal deadlines
+    lua_State *co;
+    unsigned gen;
+    bool operator>(const Timer &o) const {
+      return due != o.due ? due > o.due : seq > o.seq;
+    }
+  };
+
+  static const void *key() {
+    static const char k = 0;
+    return &k;
+  }
+
+  Task &task(lua_State *co) {
+    auto it = tasks_.find(co);
+    if (it == tasks_.end())
+      luaL_error(co, "attempt to wait outside of an async task");
+    return it->second;
+  }
+
+  bool updateFd(int fd, FdWait &w) {
+    uint32_t want = (w.reader ? uint32_t(EPOLLIN) : 0u) |
+                    (w.writer ? uint32_t(EPOLLOUT) : 0u);
+    epoll_event ev{};
+    ev.events = want;
+    ev.data.fd = fd;
+    int r = 0;
+    if (!want)
+      r = epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    else
+      r = epoll_ctl(epfd_, w.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd,
+                    &ev);
+    w.registered = want;
+    return r == 0 || !want; // a closed fd is already gone from epoll
+  }
+
+  void fdReady(int fd, uint32_t ev) {
+    auto it = fds_.find(fd);
+    if (it == fds_.end())
+      return;
+    FdWait &w = it->second;
+    uint32_t err = EPOLLERR | EPOLLHUP;
+    lua_State *reader = (ev & (EPOLLIN | err)) ? w.reader : nullptr;
+    lua_State *writer = (ev & (EPOLLOUT | err)) ? w.writer : nullptr;
+    if (reader)
+      wakeFd(w, reader);
+    if (writer && writer != reader) // "rw" wakes once
+      wakeFd(w, writer);
+    updateFd(fd, w);
+    if (!w.registered)
+      fds_.erase(it);
+  }
+
+  // co's wait on w is over: it leaves both of w's slots (a task waiting
+  // "rw" holds both) and is queued
+  void wakeFd(FdWait &w, lua_State *co) {
+    if (w.reader == co)
+      w.reader = nullptr;
+    if (w.writer == co)
+      w.writer = nullptr;
+    waiting_fds_--;
+    auto it = tasks_.find(co);
+    if (it != tasks_.end())
+      ready_.push_back(Wake{co, it->second.gen});
+  }
+
+  void resume(Wake wake) {
+    lua_State *co = wake.co;
+    auto it = tasks_.find(co);
+    if (it == tasks_.end() || it->second.gen != wake.gen)
+      return; // finished, or already resumed for this wait
+    it->second.gen++;
+    int nargs = it->second.nargs, nres;
+    it->second.nargs = 0;
+    it->second.waiting = false;
+    int status = luaResume(co, L_, nargs, &nres);
+    if (status == LUA_YIELD) {
+      lua_pop(co, nres);
+      if (!it->second.waiting) // coroutine.yield(): just another turn
+        ready_.push_back(Wake{co, it->second.gen});
+      return;
+    }
+    if (status != LUA_OK) {
+      const char *msg = lua_tostring(co, -1);
+      on_error(co, msg ? msg : "error object is not a string");
+    }
+    luaL_unref(L_, LUA_REGISTRYINDEX, it->second.ref);
+    tasks_.erase(it);
+  }
+
+  lua_State *L_;
+  int epfd_;
+  std::unordered_map<lua_State *, Task> tasks_;
+  std::unordered_map<int, FdWait> fds_;
+  size_t waiting_fds_ = 0;
+  std::deque<Wake> ready_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+  size_t seq_ = 0;
+};
+
+// ---------------- async module ----------------
+inline LuaEventLoop *luaCheckLoop(lua_State *L) {
+  LuaEventLoop *loop = LuaEventLoop::from(L);
+  if (!loop)
+    luaL_error(L, "no event loop for this state");
+  return loop;
+}
+
+inline void luaSetNonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0 && !(flags & O_NONBLOCK))
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+inline int luaPushErrno(lua_State *L) {
+  lua_pushnil(L);
+  lua_pushstring(L, strerror(errno));
+  return 2;
+}
+
+lfn async_done(lua_State *, int, lua_KContext) { return 0; }
+
+lfn async_spawn(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  luaCheckLoop(L)->spawn(L, lua_gettop(L) - 1);
+  return 0;
+}
+
+lfn async_sleep(lua_State *L) {
+  double secs = luaL_checknumber(L, 1);
+  return luaCheckLoop(L)->awaitTimer(L, secs, 0, async_done);
+}
+
+lfn async_wait(lua_State *L) {
+  int fd = static_cast<int>(luaL_checkinteger(L, 1));
+  const char *mode = luaL_optstring(L, 2, "r");
+  uint32_t ev = (strchr(mode, 'r') ? uint32_t(EPOLLIN) : 0u) |
+                (strchr(mode, 'w') ? uint32_t(EPOLLOUT) : 0u);
+  if (!ev)
+    luaL_argerror(L, 2, "expected \"r\", \"w\" or \"rw\"");
+  return luaCheckLoop(L)->awaitFd(L, fd, ev, 0, async_done);
+}
+
+// async.read(fd [, max]): one read of up to max (default/cap 64 KiB) bytes
+lfn async_read_k(lua_State *L, int, lua_KContext) {
+  int fd = static_cast<int>(luaL_checkinteger(L, 1));
+  lua_Integer max = luaL_optinteger(L, 2, 65536);
+  char buf[65536];
+  size_t want = max <= 0 ? 0 : max > 65536 ? 65536 : static_cast<size_t>(max);
+  ssize_t n = read(fd, buf, want);
+  if (n < 0 && errno == EINTR)
+    return async_read_k(L, LUA_OK, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return luaCheckLoop(L)->awaitFd(L, fd, EPOLLIN, 0, async_read_k);
+  if (n < 0)
+    return luaPushErrno(L);
+  if (n == 0 && want > 0) {
+    lua_pushnil(L); // EOF
+    return 1;
+  }
+  lua_pushlstring(L, buf, static_cast<size_t>(n));
+  return 1;
+}
+lfn async_read(lua_State *L) {
+  luaSetNonblock(static_cast<int>(luaL_checkinteger(L, 1)));
+  return async_read_k(L, LUA_OK, 0);
+}
+
+// async.write(fd, s): all of s, waiting as needed; ctx is the bytes done
+lfn async_write_k(lua_State *L, int, lua_KContext done) {
+  int fd = static_cast<int>(luaL_checkinteger(L, 1));
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  size_t off = static_cast<size_t>(done);
+  while (off < len) {
+    ssize_t n = write(fd, s + off, len - off);
+    if (n >= 0) {
+      off += static_cast<size_t>(n);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return luaCheckLoop(L)->awaitFd(L, fd, EPOLLOUT,
+                                      static_cast<lua_KContext>(off),
+                                      async_write_k);
+    } else if (errno != EINTR) {
+      return luaPushErrno(L);
+    }
+  }
+  lua_pushinteger(L, static_cast<lua_Integer>(len));
+  return 1;
+}
+lfn async_write(lua_State *L) {
+  luaSetNonblock(static_cast<int>(luaL_checkinteger(L, 1)));
+  return async_write_k(L, LUA_OK, 0);
+}
+
+inline void LuaEventLoop::openModule(lua_State *L) {
+  static const luaL_Reg funcs[] = {
+      {"spawn", async_spawn}, {"sleep", async_sleep}, {"wait", async_wait},
+      {"read", async_read},   {"write", async_write}, {NULL, NULL}};
+  newModule("async", funcs, L);
+}
@@ -1,9 +1,17 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <lua.hpp>
+#include <new>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <type_traits>
 #include <typeinfo>
+#include <utility>
 #define FPANIC(fmt, ...)                                                       \
   do {                                                                         \
     fprintf(stderr, "%s:%i: " fmt "\n", __FILE__, __LINE__, __VA_ARGS__);      \
@@ -49,21 +57,658 @@ using lua_func = int (*)(lua_State *);
 #define LUA_DEF_N(name, value, L) LUA_DEF(name, number, value, L)
 #define LUA_DEF_B(name, value, L) LUA_DEF(name, boolean, value, L)
 
-// ----------------- GC wrapper for template types -----------------
+// ----------------- Pooled allocator -----------------
+// newPooledState makes a state whose lua_Alloc serves blocks up to
+// LUA_POOL_MAX_SMALL bytes (tables, short strings, closures, small arrays)
+// from per-size-class free lists carved out of 64 KiB chunks, and only sends
+// bigger blocks to malloc. Freed small blocks go back on their list and are
+// reused; chunks are returned when the state is closed (lua_close frees the
+// state's own block last, which tears the pool down too). One pool per
+// state, not thread-safe, same as the state itself.
+#ifndef LUA_POOL_MAX_SMALL
+#define LUA_POOL_MAX_SMALL 512
+#endif
+#define LUA_POOL_GRAIN 16
+#define LUA_POOL_CHUNK (64 * 1024)
+
+struct LuaPoolStats {
+  size_t in_use;   // bytes currently held by Lua
+  size_t peak;     // highest in_use
+  size_t limit;    // 0 = none; growing past it fails (Lua: "not enough memory")
+  size_t allocs;   // new blocks
+  size_t frees;    // freed blocks
+  size_t reallocs; // resized blocks (same size class: no copy)
+  size_t pooled;   // new/resized blocks served from the pools
+  size_t chunks;   // chunks taken from malloc
+  size_t failed;   // requests refused by the limit or by malloc
+};
+
+struct LuaPool {
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+  static constexpr size_t classes = LUA_POOL_MAX_SMALL / LUA_POOL_GRAIN;
+
+  FreeBlock *free_list[classes] = {};
+  char *cur = nullptr, *end = nullptr; // unused tail of the newest chunk
+  void *chunks = nullptr;              // linked through their first word
+  void *main_block = nullptr;          // the state itself
+  size_t strays = 0; // malloc'd blocks Lua now sizes as small (kept shrinks)
+  bool *destroyed = nullptr;           // set when the pool goes away
+  LuaPoolStats stats{};
+};
+
+inline size_t luaPoolClass(size_t size) {
+  return (size - 1) / LUA_POOL_GRAIN;
+}
+
+inline void *luaPoolTake(LuaPool *p, size_t cls) {
+  if (LuaPool::FreeBlock *b = p->free_list[cls]) {
+    p->free_list[cls] = b->next;
+    return b;
+  }
+  size_t size = (cls + 1) * LUA_POOL_GRAIN;
+  if (static_cast<size_t>(p->end - p->cur) < size) {
+    char *chunk = static_cast<char *>(malloc(LUA_POOL_CHUNK));
+    if (!chunk)
+      return nullptr;
+    *reinterpret_cast<void **>(chunk) = p->chunks;
+    p->chunks = chunk;
+    p->cur = chunk + LUA_POOL_GRAIN; // keep blocks 16-byte aligned
+    p->end = chunk + LUA_POOL_CHUNK;
+    p->stats.chunks++;
+  }
+  void *block = p->cur;
+  p->cur += size;
+  return block;
+}
+
+// whether block was carved from one of p's chunks
+inline bool luaPoolOwns(const LuaPool *p, const void *block) {
+  auto *b = static_cast<const char *>(block);
+  for (void *c = p->chunks; c; c = *static_cast<void **>(c))
+    if (b >= static_cast<char *>(c) && b < static_cast<char *>(c) + LUA_POOL_CHUNK)
+      return true;
+  return false;
+}
+
+inline void luaPoolGive(LuaPool *p, void *block, size_t size) {
+  if (size > LUA_POOL_MAX_SMALL) {
+    free(block);
+    return;
+  }
+  // only after a kept shrink (out of memory), so the walk is rare
+  if (p->strays && !luaPoolOwns(p, block)) {
+    p->strays--;
+    free(block);
+    return;
+  }
+  auto *b = static_cast<LuaPool::FreeBlock *>(block);
+  size_t cls = luaPoolClass(size);
+  b->next = p->free_list[cls];
+  p->free_list[cls] = b;
+}
+
+inline void luaPoolDestroy(LuaPool *p) {
+  for (void *c = p->chunks; c;) {
+    void *next = *static_cast<void **>(c);
+    free(c);
+    c = next;
+  }
+  if (p->destroyed)
+    *p->destroyed = true;
+  delete p;
+}
+
+// the lua_Alloc; ud is the LuaPool
+inline void *luaPoolAlloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  auto *p = static_cast<LuaPool *>(ud);
+  LuaPoolStats &st = p->stats;
+  if (!ptr)
+    osize = 0; // osize is the object type for new blocks
+  if (nsize == 0) {
+    if (ptr) {
+      st.in_use -= osize;
+      st.frees++;
+      luaPoolGive(p, ptr, osize);
+      if (ptr == p->main_block)
+        luaPoolDestroy(p); // lua_close is done with us
+    }
+    return nullptr;
+  }
+  if (nsize > osize && st.limit && st.in_use - osize + nsize > st.limit) {
+    st.failed++;
+    return nullptr;
+  }
+
+  void *block;
+  bool small = nsize <= LUA_POOL_MAX_SMALL;
+  if (ptr && osize <= LUA_POOL_MAX_SMALL && small &&
+      luaPoolClass(osize) == luaPoolClass(nsize)) {
+    block = ptr; // same size class: nothing to move
+    st.pooled++;
+  } else if (ptr && osize > LUA_POOL_MAX_SMALL && !small) {
+    block = realloc(ptr, nsize);
+  } else {
+    block = small ? luaPoolTake(p, luaPoolClass(nsize)) : malloc(nsize);
+    if (block && small)
+      st.pooled++;
+    if (block && ptr) {
+      memcpy(block, ptr, osize < nsize ? osize : nsize);
+      luaPoolGive(p, ptr, osize);
+    }
+  }
+  if (!block) {
+    // Lua expects a shrink never to fail: keep the old block, still
+    // counted as osize in in_use. Lua will hand it back as nsize, so a
+    // malloc'd block becomes a stray that luaPoolGive must free
+    if (ptr && nsize <= osize) {
+      if (osize > LUA_POOL_MAX_SMALL && small)
+        p->strays++;
+      st.reallocs++;
+      return ptr;
+    }
+    st.failed++;
+    return nullptr;
+  }
+  if (!p->main_block)
+    p->main_block = block; // lua_newstate allocates the state first
+  if (ptr)
+    st.reallocs++;
+  else
+    st.allocs++;
+  st.in_use += nsize - osize;
+  if (st.in_use > st.peak)
+    st.peak = st.in_use;
+  return block;
+}
+
+#if LUA_VERSION_NUM >= 504
+// luaL_newstate's warning functions: off until "@on", messages to stderr
+// as "Lua warning: ...", pieces joined while tocont is set
+inline void luaPoolWarnOff(void *ud, const char *msg, int tocont);
+inline void luaPoolWarnOn(void *ud, const char *msg, int tocont);
+
+inline bool luaPoolWarnControl(lua_State *L, const char *msg, int tocont) {
+  if (tocont || *msg != '@')
+    return false;
+  if (strcmp(msg + 1, "off") == 0)
+    lua_setwarnf(L, &luaPoolWarnOff, L);
+  else if (strcmp(msg + 1, "on") == 0)
+    lua_setwarnf(L, &luaPoolWarnOn, L);
+  return true;
+}
+
+inline void luaPoolWarnCont(void *ud, const char *msg, int tocont) {
+  auto *L = static_cast<lua_State *>(ud);
+  fprintf(stderr, "%s", msg);
+  if (tocont) {
+    lua_setwarnf(L, &luaPoolWarnCont, L);
+  } else {
+    fprintf(stderr, "\n");
+    lua_setwarnf(L, &luaPoolWarnOn, L);
+  }
+}
+
+inline void luaPoolWarnOff(void *ud, const char *msg, int tocont) {
+  luaPoolWarnControl(static_cast<lua_State *>(ud), msg, tocont);
+}
+
+inline void luaPoolWarnOn(void *ud, const char *msg, int tocont) {
+  if (luaPoolWarnControl(static_cast<lua_State *>(ud), msg, tocont))
+    return;
+  fprintf(stderr, "Lua warning: ");
+  luaPoolWarnCont(ud, msg, tocont);
+}
+#endif
+
+inline int luaPoolPanic(lua_State *L) {
+  const char *msg = lua_tostring(L, -1);
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+          msg ? msg : "error object is not a string");
+  return 0;
+}
+
+// a state on a fresh pool; limit (bytes, 0 = none) can be changed later
+// through luaPoolStats(L)->limit
+inline lua_State *newPooledLuaState(size_t limit = 0) {
+  auto *pool = new (std::nothrow) LuaPool;
+  if (!pool)
+    return nullptr;
+  pool->stats.limit = limit;
+  // a half-built state is closed by lua_newstate itself, taking the pool
+  bool destroyed = false;
+  pool->destroyed = &destroyed;
+  lua_State *L = lua_newstate(&luaPoolAlloc, pool);
+  if (!L) {
+    if (!destroyed)
+      luaPoolDestroy(pool);
+    return nullptr;
+  }
+  pool->destroyed = nullptr;
+  lua_atpanic(L, &luaPoolPanic);
+#if LUA_VERSION_NUM >= 504
+  lua_setwarnf(L, &luaPoolWarnOff, L);
+#endif
+  return L;
+}
+
+// the counters of a pooled state, nullptr for any other state
+inline LuaPoolStats *luaPoolStats(lua_State *L) {
+  void *ud;
+  if (lua_getallocf(L, &ud) != &luaPoolAlloc)
+    return nullptr;
+  return &static_cast<LuaPool *>(ud)->stats;
+}
+
+#define newPooledState(x, limit)                                               \
+  lua_State *x = newPooledLuaState(limit);                                     \
+  luaopen_base(x)
+
+// ----------------- Userdata layout -----------------
+// Every userdata made here starts with this header: the object pointer and
+// how to release it. One __gc (lua_ud_gc) then serves every type, and
+// ownership is per object rather than per metatable. The magic word marks
+// the header as ours: a metatable may also be shared with objects from a
+// hand-written Type_new (stored inline, or as a bare T* box), and those are
+// left alone by lua_ud_gc.
+#define LUA_UD_MAGIC 0x6c75615f75646864ull
+struct LuaUdHeader {
+  void *ptr;               // the object (boxed, or right after the header)
+  void (*release)(void *); // delete / destructor; nullptr when not owned
+  uint64_t magic;          // LUA_UD_MAGIC
+};
+
+// pushes a userdata of size bytes starting with an empty header
+inline LuaUdHeader *newUdHeader(lua_State *L, size_t size) {
+  auto *h = static_cast<LuaUdHeader *>(lua_newuserdata(L, size));
+  h->ptr = nullptr;
+  h->release = nullptr;
+  h->magic = LUA_UD_MAGIC;
+  return h;
+}
+
+// the header of the userdata at index, or nullptr if it has none
+inline LuaUdHeader *toUdHeader(lua_State *L, int index) {
+  auto *h = static_cast<LuaUdHeader *>(lua_touserdata(L, index));
+  if (!h || lua_rawlen(L, index) < sizeof(LuaUdHeader) ||
+      h->magic != LUA_UD_MAGIC)
+    return nullptr;
+  return h;
+}
+
+template <typename T> static void lua_delete_obj(void *p) {
+  delete static_cast<T *>(p);
+}
+template <typename T> static void lua_destroy_obj(void *p) {
+  static_cast<T *>(p)->~T();
+}
+
+static int lua_ud_gc(lua_State *L) {
+  LuaUdHeader *h = toUdHeader(L, 1);
+  if (h && h->ptr && h->release)
+    h->release(h->ptr);
+  if (h)
+    h->ptr = nullptr; // extra-safe in case GC runs weirdly
+  return 0;
+}
+
+// kept for code that installs it by hand; same as lua_ud_gc for T
 template <typename T> static int lua_gc_wrapper(lua_State *L) {
-  // userdata is at index 1
   void *ud = lua_touserdata(L, 1);
   if (!ud)
     return 0;
   T *p = *reinterpret_cast<T **>(ud);
   if (p) {
     delete p;
-    // set pointer to nullptr to be extra-safe in case GC runs weirdly
     *reinterpret_cast<T **>(ud) = nullptr;
   }
   return 0;
 }
 
+// ----------------- Metatable cache -----------------
+// Metatables are still registered under their names (so luaL_checkudata and
+// friends keep working). The ones for pushPtr/pushValue/checkValue<T> and
+// the automatic bindings are also stored in the registry under the address
+// of LuaTypeTag<T>::tag and found with lua_rawgetp: no string pushing or
+// hashing on those paths. Named metatables (pushPtrWithMeta, getPtr(L, i,
+// name), ...) are looked up by name, so the name may live in any buffer;
+// Lua's string cache makes that lookup cheap for a literal.
+template <typename T> struct LuaTypeTag {
+  static inline const char tag = 0;
+};
+template <typename T> inline const void *luaTypeKey() {
+  return &LuaTypeTag<T>::tag;
+}
+
+// marks (in the metatable itself) that __index and __gc have been seen to
+struct LuaMetaReady;
+
+// pushes the metatable for key (a luaTypeKey, or nullptr to go by name
+// alone), creating it on first use with __index and __gc. Only this and
+// register_metatable fill the cache, so a cache hit needs no further work.
+inline void pushCachedMeta(lua_State *L, const void *key, const char *name) {
+  if (key) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TTABLE)
+      return;
+    lua_pop(L, 1);
+  }
+  if (luaL_newmetatable(L, name)) {
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+  }
+  if (lua_rawgetp(L, -1, luaTypeKey<LuaMetaReady>()) == LUA_TNIL) {
+    if (lua_getfield(L, -2, "__gc") == LUA_TNIL) {
+      lua_pushcfunction(L, &lua_ud_gc);
+      lua_setfield(L, -4, "__gc");
+    }
+    lua_pop(L, 1);
+    lua_pushboolean(L, 1);
+    lua_rawsetp(L, -3, luaTypeKey<LuaMetaReady>());
+  }
+  lua_pop(L, 1);
+  if (key) {
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+  }
+}
+
+// the userdata at index if its metatable is the one for key/name (key
+// nullptr: by name alone), else null
+inline LuaUdHeader *testCachedUdata(lua_State *L, int index, const void *key,
+                                    const char *name) {
+  void *ud = lua_touserdata(L, index);
+  if (!ud || !lua_getmetatable(L, index))
+    return nullptr;
+  if (!key) {
+    luaL_getmetatable(L, name);
+  } else if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TNIL) {
+    // not made through here (yet): fall back to the name
+    lua_pop(L, 1);
+    luaL_getmetatable(L, name);
+  }
+  bool ok = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return ok ? static_cast<LuaUdHeader *>(ud) : nullptr;
+}
+
+inline LuaUdHeader *checkCachedUdata(lua_State *L, int index, const void *key,
+                                     const char *name) {
+  LuaUdHeader *h = testCachedUdata(L, index, key, name);
+  // a null ptr is only left by __gc, which a script can call by hand
+  // (getmetatable(x).__gc(x)): the object is gone
+  if (!h || !h->ptr) {
+    // prefer the registered name (e.g. from lua_bind_type) over typeid's
+    if (key && lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TTABLE &&
+        lua_getfield(L, -1, "__name") == LUA_TSTRING)
+      name = lua_tostring(L, -1);
+    luaL_argerror(L, index,
+                  h ? lua_pushfstring(L, "%s already released", name)
+                    : lua_pushfstring(L, "%s expected, got %s", name,
+                                      luaL_typename(L, index)));
+  }
+  return h;
+}
+
+// ----------------- Binding profiler -----------------
+// Build with -DLUA_FFI_PROFILE and every function registered through
+// push_funcs, register_metatable, create_class_table or newModule (so
+// LUA_CLASS too) is pushed wrapped: calls, total/max time and a log2 latency
+// histogram are kept per function ("Scope.name"), shared by all states and
+// threads. luaProfileSample(L, n) additionally samples the Lua stack every n
+// VM instructions (lua_sethook) into folded stacks ("outer;inner" -> count,
+// flamegraph input). luaProfileDump(path) writes both out (nullptr: stderr);
+// register_profiler(L) gives scripts profiler.report() / dump(path) /
+// reset() / sample(n). Calls that end in a Lua error or a yield are not
+// timed. Without the define, functions are pushed as they are and the
+// profiler calls do nothing.
+#ifdef LUA_FFI_PROFILE
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#define LUA_PROF_BUCKETS 40 // bucket b: [2^b, 2^(b+1)) ns
+
+struct LuaProfEntry {
+  std::string name;
+  lua_CFunction fn;
+  std::atomic<uint64_t> calls{0}, total_ns{0}, max_ns{0};
+  std::atomic<uint64_t> hist[LUA_PROF_BUCKETS] = {};
+};
+
+struct LuaProfiler {
+  std::mutex mu;
+  std::map<std::pair<std::string, lua_CFunction>,
+           std::unique_ptr<LuaProfEntry>>
+      entries;
+  std::unordered_map<std::string, uint64_t> stacks;
+
+  static LuaProfiler &get() {
+    static LuaProfiler p;
+    return p;
+  }
+  LuaProfEntry *entry(const char *scope, const char *name, lua_CFunction fn) {
+    std::string full = scope ? std::string(scope) + "." + name : name;
+    std::lock_guard<std::mutex> lk(mu);
+    auto &e = entries[{full, fn}];
+    if (!e) {
+      e = std::make_unique<LuaProfEntry>();
+      e->name = full;
+      e->fn = fn;
+    }
+    return e.get();
+  }
+};
+
+inline int luaProfiled(lua_State *L) {
+  auto *e = static_cast<LuaProfEntry *>(lua_touserdata(L, lua_upvalueindex(1)));
+  auto t0 = std::chrono::steady_clock::now();
+  int r = e->fn(L);
+  uint64_t ns = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - t0)
+          .count());
+  e->calls.fetch_add(1, std::memory_order_relaxed);
+  e->total_ns.fetch_add(ns, std::memory_order_relaxed);
+  uint64_t max = e->max_ns.load(std::memory_order_relaxed);
+  while (ns > max && !e->max_ns.compare_exchange_weak(max, ns))
+    ;
+  int b = ns ? 63 - __builtin_clzll(ns) : 0;
+  e->hist[b < LUA_PROF_BUCKETS ? b : LUA_PROF_BUCKETS - 1].fetch_add(
+      1, std::memory_order_relaxed);
+  return r;
+}
+
+inline void luaPushFunc(lua_State *L, const char *scope, const char *name,
+                        lua_CFunction fn) {
+  lua_pushlightuserdata(L, LuaProfiler::get().entry(scope, name, fn));
+  lua_pushcclosure(L, &luaProfiled, 1);
+}
+
+inline void luaProfileHook(lua_State *L, lua_Debug *) {
+  std::string folded;
+  lua_Debug ar;
+  char frame[128];
+  // level 0 is the innermost frame; folded stacks list the outermost first
+  for (int level = 0; level < 64 && lua_getstack(L, level, &ar); level++) {
+    lua_getinfo(L, "Sn", &ar);
+    snprintf(frame, sizeof frame, "%s@%s:%d", ar.name ? ar.name : "?",
+             ar.short_src, ar.linedefined);
+    folded = level ? std::string(frame) + ";" + folded : frame;
+  }
+  LuaProfiler &p = LuaProfiler::get();
+  std::lock_guard<std::mutex> lk(p.mu);
+  p.stacks[folded]++;
+}
+
+// samples L's stack every n VM instructions; 0 stops sampling
+inline void luaProfileSample(lua_State *L, int every) {
+  if (every > 0)
+    lua_sethook(L, &luaProfileHook, LUA_MASKCOUNT, every);
+  else
+    lua_sethook(L, nullptr, 0, 0);
+}
+
+inline void luaProfileReset() {
+  LuaProfiler &p = LuaProfiler::get();
+  std::lock_guard<std::mutex> lk(p.mu);
+  for (auto &kv : p.entries) {
+    LuaProfEntry &e = *kv.second;
+    e.calls = 0;
+    e.total_ns = 0;
+    e.max_ns = 0;
+    for (auto &h : e.hist)
+      h = 0;
+  }
+  p.stacks.clear();
+}
+
+struct LuaProfRow {
+  std::string name;
+  uint64_t calls, total_ns, max_ns, p50_ns, p99_ns;
+};
+
+// upper bound of the bucket holding quantile q
+inline uint64_t luaProfQuantile(const LuaProfEntry &e, uint64_t calls,
+                                double q) {
+  uint64_t want = static_cast<uint64_t>(q * static_cast<double>(calls)), seen = 0;
+  for (int b = 0; b < LUA_PROF_BUCKETS; b++) {
+    seen += e.hist[b].load(std::memory_order_relaxed);
+    if (seen > want)
+      return 2ull << b;
+  }
+  return e.max_ns.load(std::memory_order_relaxed);
+}
+
+// called functions, most total time first
+inline std::vector<LuaProfRow> luaProfileRows() {
+  LuaProfiler &p = LuaProfiler::get();
+  std::vector<LuaProfRow> rows;
+  std::lock_guard<std::mutex> lk(p.mu);
+  for (auto &kv : p.entries) {
+    const LuaProfEntry &e = *kv.second;
+    uint64_t calls = e.calls.load(std::memory_order_relaxed);
+    if (!calls)
+      continue;
+    rows.push_back({e.name, calls, e.total_ns.load(std::memory_order_relaxed),
+                    e.max_ns.load(std::memory_order_relaxed),
+                    luaProfQuantile(e, calls, 0.5),
+                    luaProfQuantile(e, calls, 0.99)});
+  }
+  std::sort(rows.begin(), rows.end(), [](const LuaProfRow &a, const LuaProfRow &b) {
+    return a.total_ns > b.total_ns;
+  });
+  return rows;
+}
+
+inline bool luaProfileDump(const char *path) {
+  FILE *f = path ? fopen(path, "w") : stderr;
+  if (!f)
+    return false;
+  fprintf(f, "# %10s %12s %10s %10s %10s %10s  function\n", "calls",
+          "total_ms", "mean_ns", "p50_ns", "p99_ns", "max_ns");
+  for (const LuaProfRow &r : luaProfileRows())
+    fprintf(f, "  %10llu %12.3f %10llu %10llu %10llu %10llu  %s\n",
+            (unsigned long long)r.calls, r.total_ns / 1e6,
+            (unsigned long long)(r.total_ns / r.calls),
+            (unsigned long long)r.p50_ns, (unsigned long long)r.p99_ns,
+            (unsigned long long)r.max_ns, r.name.c_str());
+  LuaProfiler &p = LuaProfiler::get();
+  {
+    std::lock_guard<std::mutex> lk(p.mu);
+    if (!p.stacks.empty())
+      fprintf(f, "# samples (folded stacks)\n");
+    for (auto &kv : p.stacks)
+      fprintf(f, "%s %llu\n", kv.first.c_str(), (unsigned long long)kv.second);
+  }
+  if (path)
+    fclose(f);
+  return true;
+}
+
+lfn luaProfReportL(lua_State *L) {
+  std::vector<LuaProfRow> rows = luaProfileRows();
+  lua_createtable(L, static_cast<int>(rows.size()), 0);
+  for (size_t i = 0; i < rows.size(); i++) {
+    const LuaProfRow &r = rows[i];
+    lua_createtable(L, 0, 6);
+    lua_pushlstring(L, r.name.data(), r.name.size());
+    lua_setfield(L, -2, "name");
+    LUA_DEF_I("calls", static_cast<lua_Integer>(r.calls), L);
+    LUA_DEF_I("total_ns", static_cast<lua_Integer>(r.total_ns), L);
+    LUA_DEF_I("max_ns", static_cast<lua_Integer>(r.max_ns), L);
+    LUA_DEF_I("p50_ns", static_cast<lua_Integer>(r.p50_ns), L);
+    LUA_DEF_I("p99_ns", static_cast<lua_Integer>(r.p99_ns), L);
+    lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+  }
+  return 1;
+}
+lfn luaProfDumpL(lua_State *L) {
+  lua_pushboolean(L, luaProfileDump(luaL_optstring(L, 1, nullptr)));
+  return 1;
+}
+lfn luaProfResetL(lua_State *) {
+  luaProfileReset();
+  return 0;
+}
+lfn luaProfSampleL(lua_State *L) {
+  luaProfileSample(L, static_cast<int>(luaL_optinteger(L, 1, 0)));
+  return 0;
+}
+#else
+inline void luaPushFunc(lua_State *L, const char *, const char *,
+                        lua_CFunction fn) {
+  lua_pushcfunction(L, fn);
+}
+inline void luaProfileSample(lua_State *, int) {}
+inline void luaProfileReset() {}
+inline bool luaProfileDump(const char *) { return false; }
+lfn luaProfReportL(lua_State *L) {
+  lua_newtable(L);
+  return 1;
+}
+lfn luaProfDumpL(lua_State *L) {
+  lua_pushboolean(L, 0);
+  return 1;
+}
+lfn luaProfResetL(lua_State *) { return 0; }
+lfn luaProfSampleL(lua_State *) { return 0; }
+#endif
+
+// sets funcs on the table at the top, through luaPushFunc; scope names them
+// in the profile
+inline void luaSetFuncs(lua_State *L, const char *scope,
+                        const luaL_Reg funcs[]) {
+  for (int i = 0; funcs[i].name != nullptr; i++) {
+    if (funcs[i].func)
+      luaPushFunc(L, scope, funcs[i].name, funcs[i].func);
+    else
+      lua_pushboolean(L, 0); // placeholder, as luaL_setfuncs does
+    lua_setfield(L, -2, funcs[i].name);
+  }
+}
+
+// the profiler's own functions are not wrapped
+inline void register_profiler(lua_State *L) {
+  static const luaL_Reg funcs[] = {{"report", luaProfReportL},
+                                   {"dump", luaProfDumpL},
+                                   {"reset", luaProfResetL},
+                                   {"sample", luaProfSampleL},
+                                   {NULL, NULL}};
+  lua_newtable(L);
+  for (int i = 0; funcs[i].name != nullptr; i++) {
+    lua_pushcfunction(L, funcs[i].func);
+    lua_setfield(L, -2, funcs[i].name);
+  }
+  lua_setglobal(L, "profiler");
+}
+
 // ----------------- register a metatable and methods once --------------
 inline void register_metatable(lua_State *L, const char *metaname,
                                const luaL_Reg funcs[]) {
@@ -88,23 +733,32 @@ inline void register_metatable(lua_State *L, const char *metaname,
   }
   // stack: metatable
 
+  // the shared __gc goes in first so funcs can still override it; it has to
+  // be there before any setmetatable for Lua to finalize the objects
+  lua_pushcfunction(L, &lua_ud_gc);
+  lua_setfield(L, -2, "__gc");
+
   // set functions on the metatable
-#if LUA_VERSION_NUM >= 502
-  luaL_setfuncs(L, funcs, 0);
-#else
-  for (int i = 0; funcs[i].name != nullptr; ++i) {
-    lua_pushcfunction(L, funcs[i].func);
-    lua_setfield(L, -2, funcs[i].name);
-  }
-#endif
+  luaSetFuncs(L, metaname, funcs);
 
   // metatable.__index = metatable
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
 
+  // __index and __gc are in place for pushCachedMeta
+  lua_pushboolean(L, 1);
+  lua_rawsetp(L, -2, luaTypeKey<LuaMetaReady>());
+
   lua_pop(L, 1); // pop metatable
 }
 
+// boxes ptr in a header-only userdata; gc decides whether Lua deletes it
+template <typename T> void pushBoxed(lua_State *L, T *ptr, bool gc) {
+  LuaUdHeader *h = newUdHeader(L, sizeof(LuaUdHeader));
+  h->ptr = ptr;
+  h->release = gc ? &lua_delete_obj<T> : nullptr;
+}
+
 // ---------- push userdata (pointer) and attach existing metatable ----------
 template <typename T>
 void pushPtrWithMeta(lua_State *L, T *ptr, const char *metaname,
@@ -113,33 +767,9 @@ void pushPtrWithMeta(lua_State *L, T *ptr, const char *metaname,
     lua_pushnil(L);
     return;
   }
-
-  // create userdata holding pointer (we store pointer value)
-  void **ud = reinterpret_cast<void **>(lua_newuserdata(L, sizeof(void *)));
-  *ud = ptr;
-  // now stack: userdata
-
-  // get metatable from registry (does not create)
-  luaL_getmetatable(L, metaname); // pushes metatable or nil
-  if (lua_isnil(L, -1)) {
-    // no existing metatable -> create one
-    lua_pop(L, 1);
-    luaL_newmetatable(L, metaname); // pushes new metatable
-    // make sure __index points to itself
-    lua_pushvalue(L, -1);
-    lua_setfield(L, -2, "__index");
-  }
-  // stack: userdata, metatable
-
-  if (gc) {
-    // attach GC function (overwrite if already present)
-    lua_pushcfunction(L, &lua_gc_wrapper<T>);
-    lua_setfield(L, -2, "__gc");
-  }
-
-  // set the metatable on userdata (this pops metatable)
-  lua_setmetatable(L, -2); // userdata now has metatable attached
-  // stack: userdata
+  pushBoxed(L, ptr, gc);
+  pushCachedMeta(L, nullptr, metaname);
+  lua_setmetatable(L, -2);
 }
 
 // overload that uses typeid(T).name() as metatable name (fallback)
@@ -148,30 +778,8 @@ template <typename T> void pushPtr(lua_State *L, T *ptr, bool gc = true) {
     lua_pushnil(L);
     return;
   }
-
-  void **userdata =
-      reinterpret_cast<void **>(lua_newuserdata(L, sizeof(void *)));
-  *userdata = ptr;
-
-  const char *metatype = typeid(T).name();
-  // luaL_newmetatable pushes the metatable on the stack and returns 1 if it
-  // was created
-  if (luaL_newmetatable(L, metatype)) {
-    // newly created metatable
-    lua_pushvalue(L, -1);
-    lua_setfield(L, -2, "__index");
-    if (gc) {
-      lua_pushcfunction(L, &lua_gc_wrapper<T>);
-      lua_setfield(L, -2, "__gc");
-    }
-  } else {
-    // metatable already existed; ensure __gc if requested
-    if (gc) {
-      lua_pushcfunction(L, &lua_gc_wrapper<T>);
-      lua_setfield(L, -2, "__gc");
-    }
-  }
-  // set metatable on userdata (pops metatable)
+  pushBoxed(L, ptr, gc);
+  pushCachedMeta(L, luaTypeKey<T>(), typeid(T).name());
   lua_setmetatable(L, -2);
 }
 
@@ -196,17 +804,10 @@ template <typename T> T *getPtr(lua_State *L, int index) {
   return static_cast<T *>(*reinterpret_cast<void **>(userdata));
 }
 
-// safer overload which checks metatable name (preferred when you have a stable
-// metatable name)
+// safer overload which checks the metatable (preferred when you have a stable
+// metatable name); compares against the cached metatable, no string lookup
 template <typename T> T *getPtr(lua_State *L, int index, const char *metaname) {
-  void **ud = reinterpret_cast<void **>(luaL_checkudata(L, index, metaname));
-  if (!ud) {
-    luaL_error(L,
-               "Invalid userdata or wrong metatable at index %d (expected %s)",
-               index, metaname);
-    return nullptr;
-  }
-  return static_cast<T *>(*ud);
+  return static_cast<T *>(checkCachedUdata(L, index, nullptr, metaname)->ptr);
 }
 
 // non-throwing variant: returns nullptr instead of luaL_error
@@ -219,6 +820,523 @@ template <typename T> T *getRawPtr(lua_State *L, int index) noexcept {
   return static_cast<T *>(*reinterpret_cast<void **>(userdata));
 }
 
+// ---------------- Values stored inline in the userdata ----------------
+// pushValue constructs T inside the userdata block itself, right after the
+// header: one allocation (Lua's) instead of userdata + new, and the object
+// sits next to its header. __gc runs the destructor only.
+
+// pushes a userdata with T constructed in it (no metatable yet)
+template <typename T, typename... Args>
+T *newValueUdata(lua_State *L, Args &&...args) {
+  static_assert(alignof(T) <= alignof(LuaUdHeader) ||
+                    alignof(T) <= alignof(double),
+                "over-aligned types must be boxed with pushPtr");
+  LuaUdHeader *h = newUdHeader(L, sizeof(LuaUdHeader) + sizeof(T));
+  T *obj = new (h + 1) T(std::forward<Args>(args)...);
+  h->ptr = obj;
+  if constexpr (!std::is_trivially_destructible_v<T>)
+    h->release = &lua_destroy_obj<T>;
+  return obj;
+}
+
+// construct T in a new userdata with the named metatable; returns the object
+// (owned by Lua, valid while the userdata is reachable)
+template <typename T, typename... Args>
+T *pushValueWithMeta(lua_State *L, const char *metaname, Args &&...args) {
+  T *obj = newValueUdata<T>(L, std::forward<Args>(args)...);
+  pushCachedMeta(L, nullptr, metaname);
+  lua_setmetatable(L, -2);
+  return obj;
+}
+
+// same, with typeid(T).name() as metatable name (like pushPtr)
+template <typename T, typename... Args>
+T *pushValue(lua_State *L, Args &&...args) {
+  T *obj = newValueUdata<T>(L, std::forward<Args>(args)...);
+  pushCachedMeta(L, luaTypeKey<T>(), typeid(T).name());
+  lua_setmetatable(L, -2);
+  return obj;
+}
+
+// the T at index (inline or boxed), raising a Lua error if it is not one
+template <typename T> T *checkValue(lua_State *L, int index, const char *metaname) {
+  return static_cast<T *>(checkCachedUdata(L, index, nullptr, metaname)->ptr);
+}
+
+template <typename T> T *checkValue(lua_State *L, int index) {
+  return static_cast<T *>(
+      checkCachedUdata(L, index, luaTypeKey<T>(), typeid(T).name())->ptr);
+}
+
+// ---------------- Automatic bindings ----------------
+// lua_bind<&f> / lua_bind<&Type::method> is a lua_CFunction generated from
+// the C++ signature: arguments are checked and converted in order, the call
+// is made directly and the result pushed, all resolved at compile time.
+//
+//   arguments: bool, integers/enums, floats, const char *, std::string_view,
+//     std::string by value or const reference (built at the call, once every
+//     argument has been checked), class types by value/reference/pointer (a pointer
+//     also accepts nil), and lua_State * (passed through, takes no slot)
+//   results: the same scalars and strings, std::pair/std::tuple (several
+//     results), class values and const references (copied into a pushValue),
+//     non-const references and pointers (pushed borrowed: the owner must
+//     outlive them)
+//
+// Methods take self at index 1. Class types are found through luaTypeKey<T>(),
+// so a class registered under its own name needs lua_bind_type
+// (LUA_CLASS_BOUND does it). Overloaded functions need a static_cast to pick
+// one.
+
+template <typename A>
+inline constexpr bool luaTakesSlot =
+    !std::is_same_v<std::remove_cv_t<std::remove_reference_t<A>>, lua_State *>;
+
+// stack index of each argument, starting at First
+template <int First, typename... A> constexpr auto luaArgSlots() {
+  std::array<int, sizeof...(A) + 1> idx{};
+  int n = First, k = 0;
+  ((idx[k++] = n, n += luaTakesSlot<A>), ...);
+  (void)n, (void)k;
+  return idx;
+}
+
+template <typename A> decltype(auto) luaGetArg(lua_State *L, int i) {
+  using T = std::remove_cv_t<std::remove_reference_t<A>>;
+  if constexpr (std::is_same_v<T, lua_State *>) {
+    return L;
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return static_cast<bool>(lua_toboolean(L, i));
+  } else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>) {
+    return static_cast<T>(luaL_checkinteger(L, i));
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return static_cast<T>(luaL_checknumber(L, i));
+  } else if constexpr (std::is_same_v<T, const char *>) {
+    return luaL_checkstring(L, i);
+  } else if constexpr (std::is_same_v<T, std::string_view> ||
+                       std::is_same_v<T, std::string>) {
+    // a view either way: a luaL_check* error raised for a later argument
+    // must not jump over a live std::string (see luaPassArg)
+    size_t len;
+    const char *str = luaL_checklstring(L, i, &len);
+    return std::string_view(str, len);
+  } else if constexpr (std::is_pointer_v<T> &&
+                       std::is_class_v<std::remove_pointer_t<T>>) {
+    using U = std::remove_cv_t<std::remove_pointer_t<T>>;
+    return lua_isnoneornil(L, i) ? static_cast<U *>(nullptr)
+                                 : checkValue<U>(L, i);
+  } else if constexpr (std::is_class_v<T>) {
+    return *checkValue<T>(L, i); // T&, copied only if taken by value
+  } else {
+    static_assert(sizeof(T) == 0, "Unsupported argument type for lua_bind");
+  }
+}
+
+// hands a converted argument to the call; only std::string parameters are
+// built here, from their view
+template <typename A, typename V> decltype(auto) luaPassArg(V &&v) {
+  if constexpr (std::is_same_v<std::remove_cv_t<std::remove_reference_t<A>>,
+                               std::string>) {
+    static_assert(!std::is_lvalue_reference_v<A> ||
+                      std::is_const_v<std::remove_reference_t<A>>,
+                  "lua_bind takes std::string by value or const reference");
+    return std::string(v);
+  } else {
+    return std::forward<V>(v);
+  }
+}
+
+template <typename R> void luaPushResult(lua_State *L, R &&v) {
+  using T = std::remove_cv_t<std::remove_reference_t<R>>;
+  if constexpr (std::is_same_v<T, bool>) {
+    lua_pushboolean(L, v);
+  } else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>) {
+    lua_pushinteger(L, static_cast<lua_Integer>(v));
+  } else if constexpr (std::is_floating_point_v<T>) {
+    lua_pushnumber(L, static_cast<lua_Number>(v));
+  } else if constexpr (std::is_same_v<T, const char *> ||
+                       std::is_same_v<T, char *>) {
+    lua_pushstring(L, v);
+  } else if constexpr (std::is_same_v<T, std::string_view> ||
+                       std::is_same_v<T, std::string>) {
+    lua_pushlstring(L, v.data(), v.size());
+  } else if constexpr (std::is_pointer_v<T> &&
+                       std::is_class_v<std::remove_pointer_t<T>>) {
+    using U = std::remove_cv_t<std::remove_pointer_t<T>>;
+    pushPtr<U>(L, const_cast<U *>(v), false);
+  } else if constexpr (std::is_class_v<T>) {
+    if constexpr (std::is_lvalue_reference_v<R> &&
+                  !std::is_const_v<std::remove_reference_t<R>>)
+      pushPtr<T>(L, &v, false);
+    else
+      pushValue<T>(L, std::forward<R>(v));
+  } else {
+    static_assert(sizeof(T) == 0, "Unsupported result type for lua_bind");
+  }
+}
+
+template <typename T> struct LuaIsTuple : std::false_type {};
+template <typename... T>
+struct LuaIsTuple<std::tuple<T...>> : std::true_type {};
+template <typename A, typename B>
+struct LuaIsTuple<std::pair<A, B>> : std::true_type {};
+
+// pushes a call's result, returning the number of Lua results
+template <typename R> int luaPushResults(lua_State *L, R &&v) {
+  using T = std::remove_cv_t<std::remove_reference_t<R>>;
+  if constexpr (LuaIsTuple<T>::value) {
+    std::apply([L](auto &&...e) { (luaPushResult(L, static_cast<decltype(e)>(e)), ...); },
+               std::forward<R>(v));
+    return static_cast<int>(std::tuple_size_v<T>);
+  } else {
+    luaPushResult<R>(L, std::forward<R>(v));
+    return 1;
+  }
+}
+
+// converts the arguments (braced init keeps them in stack order, so the
+// first bad one is the one reported) and calls fn with them. Nothing in
+// args owns memory, so a failed check leaves nothing behind
+template <int First, typename... A, typename Fn, size_t... I>
+decltype(auto) luaApplyArgs(lua_State *L, Fn &&fn, std::index_sequence<I...>) {
+  static constexpr auto idx = luaArgSlots<First, A...>();
+  std::tuple<decltype(luaGetArg<A>(L, 0))...> args{luaGetArg<A>(L, idx[I])...};
+  (void)idx;
+  return fn(luaPassArg<A>(std::get<I>(args))...);
+}
+
+template <typename R, int First, typename... A, typename Fn>
+int luaCallBound(lua_State *L, Fn &&fn) {
+  auto seq = std::index_sequence_for<A...>{};
+  if constexpr (std::is_void_v<R>) {
+    luaApplyArgs<First, A...>(L, fn, seq);
+    return 0;
+  } else {
+    return luaPushResults<R>(L, luaApplyArgs<First, A...>(L, fn, seq));
+  }
+}
+
+template <auto F, typename Sig = decltype(F)> struct LuaBind;
+
+template <auto F, typename R, typename... A, bool NE>
+struct LuaBind<F, R (*)(A...) noexcept(NE)> {
+  static int call(lua_State *L) {
+    return luaCallBound<R, 1, A...>(
+        L, [](auto &&...a) -> R { return F(static_cast<decltype(a)>(a)...); });
+  }
+};
+
+template <auto F, typename R, typename C, typename... A, bool NE>
+struct LuaBind<F, R (C::*)(A...) noexcept(NE)> {
+  static int call(lua_State *L) {
+    C *self = checkValue<C>(L, 1);
+    return luaCallBound<R, 2, A...>(L, [self](auto &&...a) -> R {
+      return (self->*F)(static_cast<decltype(a)>(a)...);
+    });
+  }
+};
+
+template <auto F, typename R, typename C, typename... A, bool NE>
+struct LuaBind<F, R (C::*)(A...) const noexcept(NE)> {
+  static int call(lua_State *L) {
+    const C *self = checkValue<C>(L, 1);
+    return luaCallBound<R, 2, A...>(L, [self](auto &&...a) -> R {
+      return (self->*F)(static_cast<decltype(a)>(a)...);
+    });
+  }
+};
+
+template <auto F> inline constexpr lua_CFunction lua_bind = &LuaBind<F>::call;
+
+// constructor binding: T(A...) built inline with pushValue, usable as the
+// Type##_new of LUA_CLASS_BOUND:
+//   constexpr lua_CFunction Vec_new = lua_ctor<Vec, double, double>;
+template <typename T, typename... A> int lua_ctor(lua_State *L) {
+  luaApplyArgs<1, A...>(
+      L, [L](auto &&...a) { pushValue<T>(L, static_cast<decltype(a)>(a)...); },
+      std::index_sequence_for<A...>{});
+  return 1;
+}
+
+// makes T's automatic bindings (and pushValue/checkValue<T>) use the
+// metatable registered as metaname
+template <typename T> void lua_bind_type(lua_State *L, const char *metaname) {
+  pushCachedMeta(L, nullptr, metaname);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, luaTypeKey<T>());
+}
+
+#define LUA_BIND_FN(fn) {#fn, lua_bind<&fn>}
+#define LUA_BIND_METHOD(Type, method) {#method, lua_bind<&Type::method>}
+
+// ---------------- Buffer views ----------------
+// A LuaBuffer<T> userdata is a typed view of contiguous memory (float,
+// double, int32_t, uint8_t) that scripts index directly, 1-based like a
+// table: b[i], b[i] = v, #b, b:slice(i [, j]) (shares the memory, keeps the
+// parent alive), b:tostring([i [, j]]) / b:fromstring(s [, i]) (bulk copy of
+// the raw bytes to/from a Lua string), b:fill(v). Nothing is copied per
+// element and no table is built.
+//
+//   pushBuffer<float>(L, ptr, n)        view of C++ memory, C++ keeps it alive
+//   pushBuffer<float>(L, ptr, n, true)  view that delete[]s ptr on __gc
+//   pushBuffer<float>(L, n)             zeroed memory inside the userdata
+//   checkBuffer<float>(L, i)            the LuaBuffer<float> at i (data, len)
+//
+// register_buffers adds buffer.f32/f64/i32/u8(n | string) for scripts.
+template <typename T> struct LuaBuffer {
+  T *data;
+  size_t len;
+  void (*free_data)(T *); // nullptr when not owned
+  LuaBuffer(T *data, size_t len, void (*free_data)(T *))
+      : data(data), len(len), free_data(free_data) {}
+  LuaBuffer(const LuaBuffer &) = delete;
+  LuaBuffer &operator=(const LuaBuffer &) = delete;
+  ~LuaBuffer() {
+    if (free_data)
+      free_data(data);
+  }
+  T *begin() const { return data; }
+  T *end() const { return data + len; }
+};
+
+template <typename T> struct LuaBufferName;
+template <> struct LuaBufferName<float> {
+  static constexpr const char *name = "f32buffer";
+};
+template <> struct LuaBufferName<double> {
+  static constexpr const char *name = "f64buffer";
+};
+template <> struct LuaBufferName<int32_t> {
+  static constexpr const char *name = "i32buffer";
+};
+template <> struct LuaBufferName<uint8_t> {
+  static constexpr const char *name = "u8buffer";
+};
+
+template <typename T> LuaBuffer<T> *checkBuffer(lua_State *L, int index) {
+  return static_cast<LuaBuffer<T> *>(
+      checkCachedUdata(L, index, luaTypeKey<LuaBuffer<T>>(),
+                       LuaBufferName<T>::name)
+          ->ptr);
+}
+
+template <typename T> void luaPushElem(lua_State *L, T v) {
+  if constexpr (std::is_floating_point_v<T>)
+    lua_pushnumber(L, static_cast<lua_Number>(v));
+  else
+    lua_pushinteger(L, static_cast<lua_Integer>(v));
+}
+
+template <typename T> T luaCheckElem(lua_State *L, int index) {
+  if constexpr (std::is_floating_point_v<T>)
+    return static_cast<T>(luaL_checknumber(L, index));
+  else
+    return static_cast<T>(luaL_checkinteger(L, index)); // wraps like C
+}
+
+// 1-based, negative from the end (as string.sub); 0 when out of range
+inline size_t luaBufferPos(lua_Integer i, size_t len) {
+  if (i < 0)
+    i += static_cast<lua_Integer>(len) + 1;
+  return i >= 1 && static_cast<size_t>(i) <= len ? static_cast<size_t>(i) : 0;
+}
+
+// arg 1 of __index / __newindex, which a script can call by hand on any
+// value: checked against the metatable in upvalue `up`, a raw compare with
+// no registry or string lookup; checkBuffer raises the error otherwise
+template <typename T> LuaBuffer<T> *selfBuffer(lua_State *L, int up) {
+  if (!lua_getmetatable(L, 1))
+    return checkBuffer<T>(L, 1);
+  bool same = lua_rawequal(L, -1, lua_upvalueindex(up));
+  lua_pop(L, 1);
+  void *b = same ? static_cast<LuaUdHeader *>(lua_touserdata(L, 1))->ptr
+                 : nullptr;
+  return b ? static_cast<LuaBuffer<T> *>(b) : checkBuffer<T>(L, 1);
+}
+
+template <typename T> int luaBufferIndex(lua_State *L) {
+  LuaBuffer<T> *b = selfBuffer<T>(L, 2);
+  int isnum;
+  lua_Integer i = lua_tointegerx(L, 2, &isnum);
+  if (isnum) {
+    if (i >= 1 && static_cast<size_t>(i) <= b->len)
+      luaPushElem(L, b->data[i - 1]);
+    else
+      lua_pushnil(L);
+    return 1;
+  }
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(1)); // methods
+  return 1;
+}
+
+template <typename T> int luaBufferNewIndex(lua_State *L) {
+  LuaBuffer<T> *b = selfBuffer<T>(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  if (i < 1 || static_cast<size_t>(i) > b->len)
+    luaL_error(L, "index %d out of range (1..%d)", static_cast<int>(i),
+               static_cast<int>(b->len));
+  b->data[i - 1] = luaCheckElem<T>(L, 3);
+  return 0;
+}
+
+template <typename T> int luaBufferLen(lua_State *L) {
+  lua_pushinteger(L, static_cast<lua_Integer>(checkBuffer<T>(L, 1)->len));
+  return 1;
+}
+
+template <typename T> void pushBufferMeta(lua_State *L);
+
+// b:slice(i [, j]): elements i..j (default: to the end) sharing b's memory
+template <typename T> int luaBufferSlice(lua_State *L) {
+  LuaBuffer<T> *b = checkBuffer<T>(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2), j = luaL_optinteger(L, 3, -1);
+  size_t from = luaBufferPos(i, b->len), to = luaBufferPos(j, b->len);
+  if (!from || !to || to < from)
+    luaL_error(L, "slice %d..%d out of range (1..%d)", static_cast<int>(i),
+               static_cast<int>(j), static_cast<int>(b->len));
+  newValueUdata<LuaBuffer<T>>(L, b->data + from - 1, to - from + 1, nullptr);
+  pushBufferMeta<T>(L);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 1);
+  lua_setuservalue(L, -2); // the parent owns the memory
+  return 1;
+}
+
+// b:tostring([i [, j]]): the raw bytes of elements i..j
+template <typename T> int luaBufferToString(lua_State *L) {
+  LuaBuffer<T> *b = checkBuffer<T>(L, 1);
+  if (b->len == 0) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  size_t from = luaBufferPos(luaL_optinteger(L, 2, 1), b->len),
+         to = luaBufferPos(luaL_optinteger(L, 3, -1), b->len);
+  if (!from || !to || to < from)
+    luaL_error(L, "range out of bounds");
+  lua_pushlstring(L, reinterpret_cast<const char *>(b->data + from - 1),
+                  (to - from + 1) * sizeof(T));
+  return 1;
+}
+
+// b:fromstring(s [, i]): copies s's bytes in from element i; returns the
+// number of elements written (whole elements, clipped to the buffer)
+template <typename T> int luaBufferFromString(lua_State *L) {
+  LuaBuffer<T> *b = checkBuffer<T>(L, 1);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  size_t at = luaBufferPos(luaL_optinteger(L, 3, 1), b->len);
+  if (!at)
+    luaL_error(L, "index out of range");
+  size_t n = len / sizeof(T), room = b->len - at + 1;
+  if (n > room)
+    n = room;
+  memcpy(b->data + at - 1, s, n * sizeof(T));
+  lua_pushinteger(L, static_cast<lua_Integer>(n));
+  return 1;
+}
+
+template <typename T> int luaBufferFill(lua_State *L) {
+  LuaBuffer<T> *b = checkBuffer<T>(L, 1);
+  T v = luaCheckElem<T>(L, 2);
+  for (T &e : *b)
+    e = v;
+  lua_settop(L, 1);
+  return 1;
+}
+
+template <typename T> int luaBufferToStr(lua_State *L) {
+  LuaBuffer<T> *b = checkBuffer<T>(L, 1);
+  lua_pushfstring(L, "%s(%d): %p", LuaBufferName<T>::name,
+                  static_cast<int>(b->len), static_cast<void *>(b->data));
+  return 1;
+}
+
+// pushes LuaBuffer<T>'s metatable, building it on first use
+template <typename T> void pushBufferMeta(lua_State *L) {
+  const void *key = luaTypeKey<LuaBuffer<T>>();
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TTABLE)
+    return;
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LuaBufferName<T>::name);
+  static const luaL_Reg methods[] = {
+      {"slice", luaBufferSlice<T>},       {"tostring", luaBufferToString<T>},
+      {"fromstring", luaBufferFromString<T>}, {"fill", luaBufferFill<T>},
+      {NULL, NULL}};
+  lua_newtable(L);
+  luaL_setfuncs(L, methods, 0);
+  lua_pushvalue(L, -2);
+  lua_pushcclosure(L, &luaBufferIndex<T>, 2); // methods, metatable
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -1);
+  lua_pushcclosure(L, &luaBufferNewIndex<T>, 1); // metatable
+  lua_setfield(L, -2, "__newindex");
+  lua_pushcfunction(L, &luaBufferLen<T>);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, &luaBufferToStr<T>);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushcfunction(L, &lua_ud_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushvalue(L, -1);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+}
+
+// a view of n elements at data; owned views delete[] data on __gc
+template <typename T>
+LuaBuffer<T> *pushBuffer(lua_State *L, T *data, size_t n, bool owned = false) {
+  void (*free_data)(T *) = nullptr;
+  if (owned)
+    free_data = [](T *p) { delete[] p; };
+  auto *b = newValueUdata<LuaBuffer<T>>(L, data, n, free_data);
+  pushBufferMeta<T>(L);
+  lua_setmetatable(L, -2);
+  return b;
+}
+
+// n zeroed elements stored in the userdata itself (one allocation)
+template <typename T> LuaBuffer<T> *pushBuffer(lua_State *L, size_t n) {
+  static_assert(alignof(T) <= alignof(LuaUdHeader),
+                "buffer element over-aligned");
+  constexpr size_t head = (sizeof(LuaUdHeader) + sizeof(LuaBuffer<T>) +
+                           alignof(LuaUdHeader) - 1) &
+                          ~(alignof(LuaUdHeader) - 1);
+  if (n > (static_cast<size_t>(-1) - head) / sizeof(T))
+    luaL_error(L, "buffer too large");
+  LuaUdHeader *h = newUdHeader(L, head + n * sizeof(T));
+  auto *b = new (h + 1) LuaBuffer<T>(
+      reinterpret_cast<T *>(reinterpret_cast<char *>(h) + head), n, nullptr);
+  memset(b->data, 0, n * sizeof(T));
+  h->ptr = b;
+  h->release = nullptr; // nothing to free: Lua owns the block
+  pushBufferMeta<T>(L);
+  lua_setmetatable(L, -2);
+  return b;
+}
+
+// buffer.<kind>(n | string): n zeroed elements, or a copy of string's bytes
+template <typename T> int luaNewBuffer(lua_State *L) {
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    size_t len;
+    const char *s = lua_tolstring(L, 1, &len);
+    LuaBuffer<T> *b = pushBuffer<T>(L, len / sizeof(T));
+    memcpy(b->data, s, b->len * sizeof(T));
+    return 1;
+  }
+  lua_Integer n = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, n >= 0, 1, "negative size");
+  pushBuffer<T>(L, static_cast<size_t>(n));
+  return 1;
+}
+
+inline void register_buffers(lua_State *L) {
+  static const luaL_Reg funcs[] = {{"f32", luaNewBuffer<float>},
+                                   {"f64", luaNewBuffer<double>},
+                                   {"i32", luaNewBuffer<int32_t>},
+                                   {"u8", luaNewBuffer<uint8_t>},
+                                   {NULL, NULL}};
+  lua_newtable(L);
+  luaL_setfuncs(L, funcs, 0);
+  lua_setglobal(L, "buffer");
+}
+
 // ---------------- Table argument parsing helpers ----------------
 // ---------------- Generic table argument parsing helpers ----------------
 
@@ -345,45 +1463,223 @@ template <typename T> T getGlobal(lua_State *L, const char *key) {
 #define getArgBoolean(L, key, index) getArgByName<bool>(L, key, index)
 #define getArgInteger(L, key, index) getArgByName<lua_Integer>(L, key, index)
 
+// ---------------- Struct descriptors ----------------
+// Declare a struct's fields once and decode a whole options table into it
+// (getStruct) or push it back as a table (pushStruct):
+//
+//   struct Opts { int width; double scale; bool vsync; std::string title; };
+//   LUA_FIELDS(Opts, LUA_FIELD(Opts, width), LUA_FIELD(Opts, scale),
+//              LUA_FIELD(Opts, vsync), LUA_FIELD(Opts, title))
+//
+// The field names are interned once per state into a name table kept in the
+// registry, so decoding is one raw lookup per field with an already-hashed
+// Lua string key (no C string to intern, no per-field type/pop calls), and
+// the whole field list unrolls at compile time. Absent fields keep their
+// value, unknown keys are ignored, access is raw (no __index). Fields may be
+// bool, integers/enums, floats, std::string, const char * (valid while the
+// table holds the string) or another struct with LUA_FIELDS.
+
+template <typename S, typename M> struct LuaField {
+  const char *name;
+  M S::*member;
+};
+template <typename S, typename M>
+constexpr LuaField<S, M> luaField(const char *name, M S::*member) {
+  return {name, member};
+}
+
+// specialised by LUA_FIELDS with `static constexpr auto fields` (a tuple)
+template <typename S> struct LuaFields {};
+
+template <typename S, typename = void> struct LuaHasFields : std::false_type {};
+template <typename S>
+struct LuaHasFields<S, std::void_t<decltype(LuaFields<S>::fields)>>
+    : std::true_type {};
+
+#define LUA_FIELD(Type, name) luaField(#name, &Type::name)
+#define LUA_FIELDS(Type, ...)                                                  \
+  template <> struct LuaFields<Type> {                                         \
+    static constexpr auto fields = std::make_tuple(__VA_ARGS__);               \
+  };
+
+template <typename S>
+inline constexpr size_t luaFieldCount =
+    std::tuple_size_v<std::remove_const_t<decltype(LuaFields<S>::fields)>>;
+
+// pushes S's name table: [i] = name and [name] = i for each field, built
+// once per state and cached under luaTypeKey<LuaFields<S>>()
+template <typename S> void pushFieldNames(lua_State *L) {
+  const void *key = luaTypeKey<LuaFields<S>>();
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TTABLE)
+    return;
+  lua_pop(L, 1);
+  constexpr size_t n = luaFieldCount<S>;
+  lua_createtable(L, static_cast<int>(n), static_cast<int>(n));
+  lua_Integer i = 0;
+  std::apply(
+      [&](const auto &...f) {
+        ((lua_pushstring(L, f.name), lua_pushvalue(L, -1),
+          lua_rawseti(L, -3, ++i), lua_pushinteger(L, i), lua_rawset(L, -3)),
+         ...);
+      },
+      LuaFields<S>::fields);
+  lua_pushvalue(L, -1);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+}
+
+template <typename S> int getStruct(lua_State *L, int index, S &out);
+template <typename S> void pushStruct(lua_State *L, const S &in);
+
+template <typename M>
+void luaReadField(lua_State *L, int i, M &out, const char *name) {
+  const char *want;
+  if constexpr (std::is_same_v<M, bool>) {
+    out = lua_toboolean(L, i);
+    return;
+  } else if constexpr (std::is_integral_v<M> || std::is_enum_v<M>) {
+    int ok;
+    lua_Integer v = lua_tointegerx(L, i, &ok);
+    if (ok) {
+      out = static_cast<M>(v);
+      return;
+    }
+    want = "integer";
+  } else if constexpr (std::is_floating_point_v<M>) {
+    int ok;
+    lua_Number v = lua_tonumberx(L, i, &ok);
+    if (ok) {
+      out = static_cast<M>(v);
+      return;
+    }
+    want = "number";
+  } else if constexpr (std::is_same_v<M, std::string> ||
+                       std::is_same_v<M, const char *>) {
+    if (lua_type(L, i) == LUA_TSTRING) {
+      size_t len;
+      const char *str = lua_tolstring(L, i, &len);
+      if constexpr (std::is_same_v<M, std::string>)
+        out.assign(str, len);
+      else
+        out = str;
+      return;
+    }
+    want = "string";
+  } else if constexpr (LuaHasFields<M>::value) {
+    if (lua_istable(L, i)) {
+      getStruct(L, i, out);
+      return;
+    }
+    want = "table";
+  } else {
+    static_assert(sizeof(M) == 0, "Unsupported field type for LUA_FIELDS");
+  }
+  luaL_error(L, "field '%s': %s expected, got %s", name, want,
+             luaL_typename(L, i));
+}
+
+template <typename M> void luaPushField(lua_State *L, const M &v) {
+  if constexpr (std::is_same_v<M, bool>)
+    lua_pushboolean(L, v);
+  else if constexpr (std::is_integral_v<M> || std::is_enum_v<M>)
+    lua_pushinteger(L, static_cast<lua_Integer>(v));
+  else if constexpr (std::is_floating_point_v<M>)
+    lua_pushnumber(L, static_cast<lua_Number>(v));
+  else if constexpr (std::is_same_v<M, std::string>)
+    lua_pushlstring(L, v.data(), v.size());
+  else if constexpr (std::is_same_v<M, const char *>)
+    lua_pushstring(L, v); // nil for nullptr
+  else if constexpr (LuaHasFields<M>::value)
+    pushStruct(L, v);
+  else
+    static_assert(sizeof(M) == 0, "Unsupported field type for LUA_FIELDS");
+}
+
+// decodes the table at index into out; returns how many fields were set
+template <typename S> int getStruct(lua_State *L, int index, S &out) {
+  constexpr int n = static_cast<int>(luaFieldCount<S>);
+  index = lua_absindex(L, index);
+  luaL_checktype(L, index, LUA_TTABLE);
+  luaL_checkstack(L, n + 1, "getStruct");
+  int top = lua_gettop(L);
+  pushFieldNames<S>(L);
+  int names = top + 1, set = 0;
+  lua_Integer i = 0;
+  // values are left on the stack and dropped together at the end
+  std::apply(
+      [&](const auto &...f) {
+        ((lua_rawgeti(L, names, ++i),
+          lua_rawget(L, index) != LUA_TNIL
+              ? (luaReadField(L, -1, out.*(f.member), f.name), set++)
+              : 0),
+         ...);
+      },
+      LuaFields<S>::fields);
+  lua_settop(L, top);
+  return set;
+}
+
+template <typename S> S getStruct(lua_State *L, int index) {
+  S out{};
+  getStruct(L, index, out);
+  return out;
+}
+
+// pushes in as a new table with one field per descriptor
+template <typename S> void pushStruct(lua_State *L, const S &in) {
+  constexpr int n = static_cast<int>(luaFieldCount<S>);
+  luaL_checkstack(L, 4, "pushStruct");
+  lua_createtable(L, 0, n);
+  pushFieldNames<S>(L);
+  lua_Integer i = 0;
+  std::apply(
+      [&](const auto &...f) {
+        ((lua_rawgeti(L, -1, ++i), luaPushField(L, in.*(f.member)),
+          lua_rawset(L, -4)),
+         ...);
+      },
+      LuaFields<S>::fields);
+  lua_pop(L, 1); // names
+}
+
 // ---------------- Lua module helpers ----------------
 
 inline void push_funcs(lua_State *L, const luaL_Reg funcs[]) {
-  for (int i = 0; funcs[i].name != nullptr; i++) {
-    lua_pushcfunction(L, funcs[i].func);
-    lua_setfield(L, -2, funcs[i].name);
-  }
+  luaSetFuncs(L, nullptr, funcs);
 }
 
 // ---------- Small helpers for class "table" creation ----------
 inline void create_class_table(lua_State *L, const char *luaName,
                                const luaL_Reg class_funcs[]) {
-#if LUA_VERSION_NUM >= 502
-  lua_createtable(L, 0, 0);         // push table
-  luaL_setfuncs(L, class_funcs, 0); // set fields
-#else
-  lua_newtable(L);
-  for (int i = 0; class_funcs[i].name != nullptr; ++i) {
-    lua_pushcfunction(L, class_funcs[i].func);
-    lua_setfield(L, -2, class_funcs[i].name);
-  }
-#endif
+  lua_createtable(L, 0, 0);             // push table
+  luaSetFuncs(L, luaName, class_funcs); // set fields
   lua_setglobal(L, luaName); // global LuaName = the table
 }
 
 // ---------- Primary macro (keeps your original convenience) ----------
+// Type is only a prefix for Type##_new / Type##_methods / register_##Type
 #define LUA_CLASS(Type, LuaName, METHOD_INITS...)                              \
+  LUA_CLASS_WITH(Type, LuaName, , METHOD_INITS)
+
+#define LUA_CLASS_AUTO(Type, METHOD_INITS...)                                  \
+  LUA_CLASS(Type, #Type, METHOD_INITS)
+
+// same, for a C++ class Type: also lua_bind_type<Type>, so lua_bind methods,
+// lua_ctor and pushValue/checkValue<Type> use this metatable
+#define LUA_CLASS_BOUND(Type, LuaName, METHOD_INITS...)                        \
+  LUA_CLASS_WITH(Type, LuaName, lua_bind_type<Type>(L, LuaName),               \
+                 METHOD_INITS)
+
+#define LUA_CLASS_WITH(Type, LuaName, EXTRA, METHOD_INITS...)                  \
   static const luaL_Reg Type##_methods[] = {METHOD_INITS, {NULL, NULL}};       \
   static const luaL_Reg Type##_class[] = {{"new", Type##_new}, {NULL, NULL}};  \
   inline void register_##Type(lua_State *L) {                                  \
     ATTACH_TYPE(L, LuaName, (const luaL_Reg *)Type##_methods);                 \
+    EXTRA;                                                                     \
     create_class_table(L, LuaName, (const luaL_Reg *)Type##_class);            \
   }
 
-#define LUA_CLASS_AUTO(Type, METHOD_INITS...)                                  \
-  LUA_CLASS(Type, #Type, METHOD_INITS)
-
 inline void newModule(const char *name, const luaL_Reg funcs[], lua_State *L) {
   lua_newtable(L);
-  push_funcs(L, funcs);
+  luaSetFuncs(L, name, funcs);
   lua_setglobal(L, name);
 }
@@ -1,276 +1,2385 @@
 // funcs.cpp - functions that are useful in game development
 #include "lua_math.hpp"
+#include "lua_ffi.hpp"
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <lua.hpp>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+// Vectors, matrices and quaternions are userdata holding the doubles
+// directly (see lua_math.hpp), one allocation per result and no string
+// keys. Every function below is a closure with the type's metatable as
+// upvalue 1, its class table (the global Vec2, Mat4, ...) as upvalue 2 and
+// the metatables of all the types after that (TYPE_META), so checking and
+// creating any of them needs no registry lookup. Vec2 / Vec3 operands may
+// still be plain {x=, y=(, z=)} tables.
+#define META lua_upvalueindex(1)
+#define CLASS lua_upvalueindex(2)
+
+enum MathType { VEC2_T, VEC3_T, VEC4_T, MAT3_T, MAT4_T, QUAT_T, VEC2ARRAY_T, VEC3ARRAY_T, SPATIALGRID_T, AABBTREE_T, MATH_TYPES };
+static const char* const mathTypeNames[MATH_TYPES] = {"Vec2", "Vec3", "Vec4", "Mat3", "Mat4", "Quat", "Vec2Array", "Vec3Array", "SpatialGrid", "AABBTree"};
+static const int mathTypeSizes[MATH_TYPES] = {2, 3, 4, 9, 16, 4, 0, 0, 0, 0}; // doubles
+#define TYPE_META(t) lua_upvalueindex(3 + (t))
+
+static void* newVecUdata(lua_State* ctx, size_t size, int meta = META) {
+#if LUA_VERSION_NUM >= 504
+    void* v = lua_newuserdatauv(ctx, size, 0);
+#else
+    void* v = lua_newuserdata(ctx, size);
+#endif
+    lua_pushvalue(ctx, meta);
+    lua_setmetatable(ctx, -2);
+    return v;
+}
+
+// the userdata at idx if its metatable is the one at meta
+static void* testVecUdata(lua_State* ctx, int idx, int meta = META) {
+    void* v = lua_touserdata(ctx, idx);
+    if (!v || !lua_getmetatable(ctx, idx))
+        return nullptr;
+    bool same = lua_rawequal(ctx, -1, meta);
+    lua_pop(ctx, 1);
+    return same ? v : nullptr;
+}
+
+static double tableField(lua_State* ctx, int idx, const char* key) {
+    lua_getfield(ctx, idx, key);
+    double value = luaL_checknumber(ctx, -1);
+    lua_pop(ctx, 1);
+    return value;
+}
+
+static void vecTypeError(lua_State* ctx, int idx, const char* expected) {
+    const char* got = luaL_getmetafield(ctx, idx, "__name") == LUA_TSTRING ? lua_tostring(ctx, -1) : luaL_typename(ctx, idx);
+    luaL_argerror(ctx, idx, lua_pushfstring(ctx, "%s expected, got %s", expected, got));
+}
+
+// self in __index / __newindex: scripts can call those by hand
+// (getmetatable(v).__newindex(x, "x", 1)) with anything as x
+static double* checkSelf(lua_State* ctx, const char* expected) {
+    double* v = (double*)testVecUdata(ctx, 1);
+    if (!v)
+        vecTypeError(ctx, 1, expected);
+    return v;
+}
+
+static Vec2 checkVec2(lua_State* ctx, int idx) {
+    if (Vec2* v = (Vec2*)testVecUdata(ctx, idx))
+        return *v;
+    if (lua_istable(ctx, idx))
+        return Vec2{tableField(ctx, idx, "x"), tableField(ctx, idx, "y")};
+    vecTypeError(ctx, idx, "Vec2");
+    return Vec2{0, 0};
+}
+
+static Vec3 checkVec3(lua_State* ctx, int idx, int meta = META) {
+    if (Vec3* v = (Vec3*)testVecUdata(ctx, idx, meta))
+        return *v;
+    if (lua_istable(ctx, idx))
+        return Vec3{tableField(ctx, idx, "x"), tableField(ctx, idx, "y"), tableField(ctx, idx, "z")};
+    vecTypeError(ctx, idx, "Vec3");
+    return Vec3{0, 0, 0};
+}
+
+// Results go to the vector at stack index out when one is passed there
+// (Vec3.add(a, b, out), v:addInPlace(w)), so steady-state code allocates
+// nothing; otherwise to a new vector. Either way the result is returned.
+static void* resultUdata(lua_State* ctx, int out, size_t size, const char* name, int meta = META) {
+    if (out == 0 || lua_isnoneornil(ctx, out))
+        return newVecUdata(ctx, size, meta);
+    void* v = testVecUdata(ctx, out, meta);
+    if (!v)
+        vecTypeError(ctx, out, name);
+    lua_pushvalue(ctx, out);
+    return v;
+}
+
+static int returnVec2(lua_State* ctx, int out, double x, double y) {
+    Vec2* v = (Vec2*)resultUdata(ctx, out, sizeof(Vec2), "Vec2");
+    v->x = x;
+    v->y = y;
+    return 1;
+}
+
+static int returnVec3(lua_State* ctx, int out, double x, double y, double z) {
+    Vec3* v = (Vec3*)resultUdata(ctx, out, sizeof(Vec3), "Vec3");
+    v->x = x;
+    v->y = y;
+    v->z = z;
+    return 1;
+}
+
+// index of a one-letter field name ("x" = 0, "y", "z", "w" = 3), or -1
+static int fieldIndex(lua_State* ctx, int idx, int count) {
+    size_t len;
+    const char* key = lua_type(ctx, idx) == LUA_TSTRING ? lua_tolstring(ctx, idx, &len) : nullptr;
+    if (!key || len != 1)
+        return -1;
+    int i = key[0] == 'w' ? 3 : key[0] - 'x';
+    return i >= 0 && i < count ? i : -1;
+}
+
+// v:opInPlace(w) is op(v, w, v)
+static int inPlace(lua_State* ctx, lua_CFunction op, const char* name) {
+    if (!testVecUdata(ctx, 1))
+        vecTypeError(ctx, 1, name);
+    lua_settop(ctx, 2);
+    lua_pushvalue(ctx, 1);
+    return op(ctx);
+}
 
 // Function to create a new 2D vector in Lua
 int newVec2(lua_State* ctx) {
-    lua_newtable(ctx);
-    lua_pushnumber(ctx, luaL_checknumber(ctx, 1)); // Ensure the first argument is a number
-    lua_setfield(ctx, -2, "x");
-    lua_pushnumber(ctx, luaL_checknumber(ctx, 2)); // Ensure the second argument is a number
-    lua_setfield(ctx, -2, "y");
-    return 1;
+    return returnVec2(ctx, 0, luaL_checknumber(ctx, 1), luaL_checknumber(ctx, 2));
 }
 
 // Function to add two 2D vectors in Lua
 int addVec2(lua_State* ctx) {
-    // Ensure we have two arguments, both of which are tables
-    luaL_checktype(ctx, 1, LUA_TTABLE);
-    luaL_checktype(ctx, 2, LUA_TTABLE);
+    Vec2 a = checkVec2(ctx, 1), b = checkVec2(ctx, 2);
+    return returnVec2(ctx, 3, a.x + b.x, a.y + b.y);
+}
 
-    // Get the x and y values from the first vector
-    lua_getfield(ctx, 1, "x");
-    double x1 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+int subVec2(lua_State* ctx) {
+    Vec2 a = checkVec2(ctx, 1), b = checkVec2(ctx, 2);
+    return returnVec2(ctx, 3, a.x - b.x, a.y - b.y);
+}
 
-    lua_getfield(ctx, 1, "y");
-    double y1 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+int fromVec2ToRadians(lua_State* ctx) {
+    Vec2 v = checkVec2(ctx, 1);
+    lua_pushnumber(ctx, atan2(v.y, v.x));
+    return 1;
+}
 
-    // Get the x and y values from the second vector
-    lua_getfield(ctx, 2, "x");
-    double x2 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+int fromRadiansToVec2(lua_State* ctx) {
+    // Ensure we have one argument, which is a number (angle in radians)
+    double radians = luaL_checknumber(ctx, 1);
+    return returnVec2(ctx, 2, cos(radians), sin(radians));
+}
 
-    lua_getfield(ctx, 2, "y");
-    double y2 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// v * k, k * v, or component-wise v * w
+static int mulVec2(lua_State* ctx) {
+    if (lua_type(ctx, 1) == LUA_TNUMBER) {
+        double k = lua_tonumber(ctx, 1);
+        Vec2 v = checkVec2(ctx, 2);
+        return returnVec2(ctx, 3, v.x * k, v.y * k);
+    }
+    Vec2 a = checkVec2(ctx, 1);
+    if (lua_type(ctx, 2) == LUA_TNUMBER) {
+        double k = lua_tonumber(ctx, 2);
+        return returnVec2(ctx, 3, a.x * k, a.y * k);
+    }
+    Vec2 b = checkVec2(ctx, 2);
+    return returnVec2(ctx, 3, a.x * b.x, a.y * b.y);
+}
 
-    // Create a new vector for the result
-    lua_newtable(ctx);
-    lua_pushnumber(ctx, x1 + x2);
-    lua_setfield(ctx, -2, "x");
-    lua_pushnumber(ctx, y1 + y2);
-    lua_setfield(ctx, -2, "y");
+static int divVec2(lua_State* ctx) {
+    Vec2 v = checkVec2(ctx, 1);
+    double k = luaL_checknumber(ctx, 2);
+    return returnVec2(ctx, 3, v.x / k, v.y / k);
+}
 
+static int unmVec2(lua_State* ctx) {
+    Vec2 v = checkVec2(ctx, 1);
+    return returnVec2(ctx, 0, -v.x, -v.y);
+}
+
+// false, not an error, when either side is something else (v == buf)
+static int eqVec2(lua_State* ctx) {
+    const Vec2 *a = (const Vec2*)testVecUdata(ctx, 1), *b = (const Vec2*)testVecUdata(ctx, 2);
+    lua_pushboolean(ctx, a && b && a->x == b->x && a->y == b->y);
     return 1;
 }
 
-int subVec2(lua_State* ctx) {
-	// Ensure we have two arguments, both of which are tables
-	luaL_checktype(ctx, 1, LUA_TTABLE);
-	luaL_checktype(ctx, 2, LUA_TTABLE);
+static int addInPlaceVec2(lua_State* ctx) { return inPlace(ctx, addVec2, "Vec2"); }
+static int subInPlaceVec2(lua_State* ctx) { return inPlace(ctx, subVec2, "Vec2"); }
+static int mulInPlaceVec2(lua_State* ctx) { return inPlace(ctx, mulVec2, "Vec2"); }
+static int divInPlaceVec2(lua_State* ctx) { return inPlace(ctx, divVec2, "Vec2"); }
+
+// v:set(x, y)
+static int setVec2(lua_State* ctx) {
+    return returnVec2(ctx, 1, luaL_checknumber(ctx, 2), luaL_checknumber(ctx, 3));
+}
+
+static int vec2Length(lua_State* ctx) {
+    Vec2 v = checkVec2(ctx, 1);
+    lua_pushnumber(ctx, sqrt(v.x * v.x + v.y * v.y));
+    return 1;
+}
 
-	// Get the x and y values from the first vector
-	lua_getfield(ctx, 1, "x");
-	double x1 = luaL_checknumber(ctx, -1);
-	lua_pop(ctx, 1);
+static int indexVec2(lua_State* ctx) {
+    int i = fieldIndex(ctx, 2, 2);
+    if (i >= 0) {
+        lua_pushnumber(ctx, checkSelf(ctx, "Vec2")[i]);
+        return 1;
+    }
+    lua_pushvalue(ctx, 2);
+    lua_rawget(ctx, CLASS); // methods: v:length() ...
+    return 1;
+}
 
-	lua_getfield(ctx, 1, "y");
-	double y1 = luaL_checknumber(ctx, -1);
-	lua_pop(ctx, 1);
+static int newindexVec2(lua_State* ctx) {
+    int i = fieldIndex(ctx, 2, 2);
+    if (i < 0)
+        return luaL_error(ctx, "Vec2 has no field '%s'", luaL_tolstring(ctx, 2, nullptr));
+    checkSelf(ctx, "Vec2")[i] = luaL_checknumber(ctx, 3);
+    return 0;
+}
 
-	// Get the x and y values from the second vector
-	lua_getfield(ctx, 2, "x");
-	double x2 = luaL_checknumber(ctx, -1);
-	lua_pop(ctx, 1);
+static int tostringVec2(lua_State* ctx) {
+    Vec2 v = checkVec2(ctx, 1);
+    lua_pushfstring(ctx, "Vec2(%f, %f)", v.x, v.y);
+    return 1;
+}
 
-	lua_getfield(ctx, 2, "y");
-	double y2 = luaL_checknumber(ctx, -1);
-	lua_pop(ctx, 1);
+int newVec3(lua_State* ctx) {
+    return returnVec3(ctx, 0, luaL_checknumber(ctx, 1), luaL_checknumber(ctx, 2), luaL_checknumber(ctx, 3));
+}
 
-	// Create a new vector for the result
-	lua_newtable(ctx);
-	lua_pushnumber(ctx, x1 - x2);
-	lua_setfield(ctx, -2, "x");
-	lua_pushnumber(ctx, y1 - y2);
-	lua_setfield(ctx, -2, "y");
-	return 1;
+int addVec3(lua_State* ctx) {
+    Vec3 a = checkVec3(ctx, 1), b = checkVec3(ctx, 2);
+    return returnVec3(ctx, 3, a.x + b.x, a.y + b.y, a.z + b.z);
 }
 
-int fromVec2ToRadians(lua_State* ctx) {
-    // Ensure we have one argument, which is a table
-    luaL_checktype(ctx, 1, LUA_TTABLE);
+int subVec3(lua_State* ctx) {
+    Vec3 a = checkVec3(ctx, 1), b = checkVec3(ctx, 2);
+    return returnVec3(ctx, 3, a.x - b.x, a.y - b.y, a.z - b.z);
+}
 
-    // Get the x and y values from the vector
-    lua_getfield(ctx, 1, "x");
-    double x = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// Function to get the length of a 3D vector
+int vec3Length(lua_State* ctx) {
+    Vec3 v = checkVec3(ctx, 1);
+    lua_pushnumber(ctx, sqrt(v.x * v.x + v.y * v.y + v.z * v.z));
+    return 1;
+}
 
-    lua_getfield(ctx, 1, "y");
-    double y = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+static int mulVec3(lua_State* ctx) {
+    if (lua_type(ctx, 1) == LUA_TNUMBER) {
+        double k = lua_tonumber(ctx, 1);
+        Vec3 v = checkVec3(ctx, 2);
+        return returnVec3(ctx, 3, v.x * k, v.y * k, v.z * k);
+    }
+    Vec3 a = checkVec3(ctx, 1);
+    if (lua_type(ctx, 2) == LUA_TNUMBER) {
+        double k = lua_tonumber(ctx, 2);
+        return returnVec3(ctx, 3, a.x * k, a.y * k, a.z * k);
+    }
+    Vec3 b = checkVec3(ctx, 2);
+    return returnVec3(ctx, 3, a.x * b.x, a.y * b.y, a.z * b.z);
+}
 
-    // Convert the vector to radians
+static int divVec3(lua_State* ctx) {
+    Vec3 v = checkVec3(ctx, 1);
+    double k = luaL_checknumber(ctx, 2);
+    return returnVec3(ctx, 3, v.x / k, v.y / k, v.z / k);
+}
 
-    lua_pushnumber(ctx, atan2(y, x));
+static int unmVec3(lua_State* ctx) {
+    Vec3 v = checkVec3(ctx, 1);
+    return returnVec3(ctx, 0, -v.x, -v.y, -v.z);
+}
+
+static int eqVec3(lua_State* ctx) {
+    const Vec3 *a = (const Vec3*)testVecUdata(ctx, 1), *b = (const Vec3*)testVecUdata(ctx, 2);
+    lua_pushboolean(ctx, a && b && a->x == b->x && a->y == b->y && a->z == b->z);
     return 1;
 }
 
-int fromRadiansToVec2(lua_State* ctx) {
-    // Ensure we have one argument, which is a number (angle in radians)
-    double radians = luaL_checknumber(ctx, 1);
+static int addInPlaceVec3(lua_State* ctx) { return inPlace(ctx, addVec3, "Vec3"); }
+static int subInPlaceVec3(lua_State* ctx) { return inPlace(ctx, subVec3, "Vec3"); }
+static int mulInPlaceVec3(lua_State* ctx) { return inPlace(ctx, mulVec3, "Vec3"); }
+static int divInPlaceVec3(lua_State* ctx) { return inPlace(ctx, divVec3, "Vec3"); }
 
-    // Convert the radians to a vector
-    double x = cos(radians);
-    double y = sin(radians);
+static int setVec3(lua_State* ctx) {
+    return returnVec3(ctx, 1, luaL_checknumber(ctx, 2), luaL_checknumber(ctx, 3), luaL_checknumber(ctx, 4));
+}
 
-    // Create a new vector for the result
-    lua_newtable(ctx);
-    lua_pushnumber(ctx, x);
-    lua_setfield(ctx, -2, "x");
-    lua_pushnumber(ctx, y);
-    lua_setfield(ctx, -2, "y");
+static int indexVec3(lua_State* ctx) {
+    int i = fieldIndex(ctx, 2, 3);
+    if (i >= 0) {
+        lua_pushnumber(ctx, checkSelf(ctx, "Vec3")[i]);
+        return 1;
+    }
+    lua_pushvalue(ctx, 2);
+    lua_rawget(ctx, CLASS);
+    return 1;
+}
+
+static int newindexVec3(lua_State* ctx) {
+    int i = fieldIndex(ctx, 2, 3);
+    if (i < 0)
+        return luaL_error(ctx, "Vec3 has no field '%s'", luaL_tolstring(ctx, 2, nullptr));
+    checkSelf(ctx, "Vec3")[i] = luaL_checknumber(ctx, 3);
+    return 0;
+}
 
+static int tostringVec3(lua_State* ctx) {
+    Vec3 v = checkVec3(ctx, 1);
+    lua_pushfstring(ctx, "Vec3(%f, %f, %f)", v.x, v.y, v.z);
     return 1;
 }
 
+// ---------------- Vec2Array / Vec3Array ----------------
+// Fixed-size arrays of n vectors kept as structure-of-arrays: one 32-byte
+// aligned run of doubles per component, all inside the userdata (no __gc).
+// The bulk kernels work VEC_LANES doubles at a time; with GCC/clang on
+// x86-64 Linux each kernel is compiled for AVX and for the SSE2 baseline
+// and the right one is picked when the library loads (target_clones).
+#define ELEM_META(a) TYPE_META((a)->dims == 2 ? VEC2_T : VEC3_T)
+#define VEC_LANES 4
 
-int newVec3(lua_State* ctx) {
-    lua_newtable(ctx);
-    lua_pushnumber(ctx, luaL_checknumber(ctx, 1)); // Ensure the first argument is a number
-    lua_setfield(ctx, -2, "x");
-    lua_pushnumber(ctx, luaL_checknumber(ctx, 2)); // Ensure the second argument is a number
-    lua_setfield(ctx, -2, "y");
-    lua_pushnumber(ctx, luaL_checknumber(ctx, 3)); // Ensure the third argument is a number
-    lua_setfield(ctx, -2, "z");
+#if defined(__GNUC__)
+typedef double Lanes __attribute__((vector_size(VEC_LANES * sizeof(double)), aligned(sizeof(double))));
+#define LANES(p) (*(Lanes*)(p))
+#define lanesMin(a, b) ((a) < (b) ? (a) : (b))
+#define lanesMax(a, b) ((a) > (b) ? (a) : (b))
+#else
+struct Lanes {
+    double v[VEC_LANES];
+    double& operator[](int i) { return v[i]; }
+    double operator[](int i) const { return v[i]; }
+};
+#define LANES_OP(op)                                              \
+    static inline Lanes operator op(Lanes a, Lanes b) {          \
+        for (int j = 0; j < VEC_LANES; j++) a.v[j] = a.v[j] op b.v[j]; \
+        return a;                                                 \
+    }                                                             \
+    static inline Lanes operator op(Lanes a, double k) {         \
+        for (int j = 0; j < VEC_LANES; j++) a.v[j] = a.v[j] op k; \
+        return a;                                                 \
+    }
+LANES_OP(+)
+LANES_OP(-)
+LANES_OP(*)
+#undef LANES_OP
+#define LANES(p) (*(Lanes*)(p))
+static inline Lanes lanesMin(Lanes a, Lanes b) {
+    for (int j = 0; j < VEC_LANES; j++) a.v[j] = b.v[j] < a.v[j] ? b.v[j] : a.v[j];
+    return a;
+}
+static inline Lanes lanesMax(Lanes a, Lanes b) {
+    for (int j = 0; j < VEC_LANES; j++) a.v[j] = b.v[j] > a.v[j] ? b.v[j] : a.v[j];
+    return a;
+}
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define VEC_KERNEL __attribute__((target_clones("avx", "default")))
+#else
+#define VEC_KERNEL
+#endif
+
+// d = a + b
+VEC_KERNEL static void kAdd(double* d, const double* a, const double* b, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES)
+        LANES(d + i) = LANES(a + i) + LANES(b + i);
+    for (; i < n; i++)
+        d[i] = a[i] + b[i];
+}
+
+// d = a - b
+VEC_KERNEL static void kSub(double* d, const double* a, const double* b, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES)
+        LANES(d + i) = LANES(a + i) - LANES(b + i);
+    for (; i < n; i++)
+        d[i] = a[i] - b[i];
+}
+
+// d = a * k
+VEC_KERNEL static void kScale(double* d, const double* a, double k, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES)
+        LANES(d + i) = LANES(a + i) * k;
+    for (; i < n; i++)
+        d[i] = a[i] * k;
+}
+
+// d += a * k
+VEC_KERNEL static void kAxpy(double* d, const double* a, double k, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES)
+        LANES(d + i) = LANES(d + i) + LANES(a + i) * k;
+    for (; i < n; i++)
+        d[i] += a[i] * k;
+}
+
+// d = a . b per element (az/bz null for 2D); d may be unaligned
+VEC_KERNEL static void kDot(double* d, const double* const* a, const double* const* b, int dims, size_t n) {
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        Lanes s = LANES(a[0] + i) * LANES(b[0] + i) + LANES(a[1] + i) * LANES(b[1] + i);
+        if (dims == 3)
+            s = s + LANES(a[2] + i) * LANES(b[2] + i);
+        LANES(d + i) = s;
+    }
+    for (; i < n; i++)
+        d[i] = a[0][i] * b[0][i] + a[1][i] * b[1][i] + (dims == 3 ? a[2][i] * b[2][i] : 0);
+}
+
+// d = sqrt(d)
+VEC_KERNEL static void kSqrt(double* d, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        d[i] = sqrt(d[i]);
+}
+
+// d = a / |a| per element, zero vectors stay zero; len is n doubles of scratch
+VEC_KERNEL static void kNormalize(double* const* d, const double* const* a, double* len, int dims, size_t n) {
+    kDot(len, a, a, dims, n);
+    kSqrt(len, n);
+    for (size_t i = 0; i < n; i++)
+        len[i] = len[i] > 0 ? 1 / len[i] : 0;
+    for (int k = 0; k < dims; k++) {
+        size_t i = 0;
+        for (; i + VEC_LANES <= n; i += VEC_LANES)
+            LANES(d[k] + i) = LANES(a[k] + i) * LANES(len + i);
+        for (; i < n; i++)
+            d[k][i] = a[k][i] * len[i];
+    }
+}
+
+// smallest (or largest) of a[0..n), n > 0
+VEC_KERNEL static double kReduce(const double* a, size_t n, bool largest) {
+    size_t i = 0;
+    double r = a[0];
+    if (n >= VEC_LANES) {
+        Lanes m = LANES(a);
+        for (i = VEC_LANES; i + VEC_LANES <= n; i += VEC_LANES)
+            m = largest ? lanesMax(m, LANES(a + i)) : lanesMin(m, LANES(a + i));
+        for (int j = 0; j < VEC_LANES; j++)
+            r = largest ? (m[j] > r ? m[j] : r) : (m[j] < r ? m[j] : r);
+    }
+    for (; i < n; i++)
+        r = largest ? (a[i] > r ? a[i] : r) : (a[i] < r ? a[i] : r);
+    return r;
+}
+
+struct VecArray {
+    size_t n;
+    int dims;
+    double* c[3]; // c[k][i]: component k of element i
+};
+
+static int newVecArray(lua_State* ctx, int dims) {
+    lua_Integer n = luaL_checkinteger(ctx, 1);
+    luaL_argcheck(ctx, n >= 0 && (lua_Unsigned)n < ((size_t)-1 - 64) / (3 * sizeof(double)), 1, "bad array size");
+    size_t stride = ((size_t)n + VEC_LANES - 1) / VEC_LANES * VEC_LANES;
+    VecArray* a = (VecArray*)newVecUdata(ctx, sizeof(VecArray) + 31 + dims * stride * sizeof(double));
+    double* data = (double*)(((uintptr_t)(a + 1) + 31) & ~(uintptr_t)31);
+    memset(data, 0, dims * stride * sizeof(double));
+    a->n = (size_t)n;
+    a->dims = dims;
+    for (int k = 0; k < 3; k++)
+        a->c[k] = k < dims ? data + k * stride : nullptr;
     return 1;
 }
-int addVec3(lua_State* ctx) {
-    // Ensure we have two arguments, both of which are tables
-    luaL_checktype(ctx, 1, LUA_TTABLE);
-    luaL_checktype(ctx, 2, LUA_TTABLE);
 
-    // Get the x, y, and z values from the first vector
-    lua_getfield(ctx, 1, "x");
-    double x1 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+static int newVec2Array(lua_State* ctx) {
+    return newVecArray(ctx, 2);
+}
 
-    lua_getfield(ctx, 1, "y");
-    double y1 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+static int newVec3Array(lua_State* ctx) {
+    return newVecArray(ctx, 3);
+}
 
-    lua_getfield(ctx, 1, "z");
-    double z1 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+static VecArray* checkVecArray(lua_State* ctx, int idx) {
+    VecArray* a = (VecArray*)testVecUdata(ctx, idx);
+    if (!a) {
+        lua_getfield(ctx, META, "__name");
+        vecTypeError(ctx, idx, lua_tostring(ctx, -1));
+    }
+    return a;
+}
 
-    // Get the x, y, and z values from the second vector
-    lua_getfield(ctx, 2, "x");
-    double x2 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// the array at idx, which must have as many elements as a
+static VecArray* checkSameSize(lua_State* ctx, int idx, VecArray* a) {
+    VecArray* b = checkVecArray(ctx, idx);
+    if (b->n != a->n)
+        luaL_argerror(ctx, idx, lua_pushfstring(ctx, "%d elements expected, got %d", (int)a->n, (int)b->n));
+    return b;
+}
 
-    lua_getfield(ctx, 2, "y");
-    double y2 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// optional output array at idx (default: the array at 1); pushed
+static VecArray* arrayResult(lua_State* ctx, int idx, VecArray* a) {
+    if (lua_isnoneornil(ctx, idx))
+        idx = 1;
+    VecArray* out = checkSameSize(ctx, idx, a);
+    lua_pushvalue(ctx, idx);
+    return out;
+}
 
-    lua_getfield(ctx, 2, "z");
-    double z2 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// optional f64buffer of at least n elements at idx, or a new one; pushed
+static double* bufferResult(lua_State* ctx, int idx, size_t n) {
+    if (lua_isnoneornil(ctx, idx))
+        return pushBuffer<double>(ctx, n)->data;
+    LuaBuffer<double>* b = checkBuffer<double>(ctx, idx);
+    luaL_argcheck(ctx, b->len >= n, idx, "buffer too small");
+    lua_pushvalue(ctx, idx);
+    return b->data;
+}
 
-    // Create a new vector for the result
-    lua_newtable(ctx);
-    lua_pushnumber(ctx, x1 + x2);
-    lua_setfield(ctx, -2, "x");
-    lua_pushnumber(ctx, y1 + y2);
-    lua_setfield(ctx, -2, "y");
-    lua_pushnumber(ctx, z1 + z2);
-    lua_setfield(ctx, -2, "z");
+static size_t checkElement(lua_State* ctx, int idx, VecArray* a) {
+    lua_Integer i = luaL_checkinteger(ctx, idx);
+    if (i < 1 || (lua_Unsigned)i > a->n)
+        luaL_argerror(ctx, idx, lua_pushfstring(ctx, "index out of range (1..%d)", (int)a->n));
+    return (size_t)i - 1;
+}
 
+static const char* elementName(VecArray* a) {
+    return a->dims == 2 ? "Vec2" : "Vec3";
+}
+
+// methods from the class table (arrays and spatial indexes have no fields)
+static int indexClass(lua_State* ctx) {
+    lua_pushvalue(ctx, 2);
+    lua_rawget(ctx, CLASS);
     return 1;
 }
 
-int subVec3(lua_State* ctx) {
-    // Ensure we have two arguments, both of which are tables
-    luaL_checktype(ctx, 1, LUA_TTABLE);
-    luaL_checktype(ctx, 2, LUA_TTABLE);
+static int lenVecArray(lua_State* ctx) {
+    lua_pushinteger(ctx, (lua_Integer)checkVecArray(ctx, 1)->n);
+    return 1;
+}
 
-    // Get the x, y, and z values from the first vector
-    lua_getfield(ctx, 1, "x");
-    double x1 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+static int tostringVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    lua_pushfstring(ctx, "%sArray(%d)", elementName(a), (int)a->n);
+    return 1;
+}
 
-    lua_getfield(ctx, 1, "y");
-    double y1 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// a:get(i) -> x, y[, z]; a:get(i, out) copies element i into the vector out
+static int getVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    size_t i = checkElement(ctx, 2, a);
+    if (lua_isnoneornil(ctx, 3)) {
+        for (int k = 0; k < a->dims; k++)
+            lua_pushnumber(ctx, a->c[k][i]);
+        return a->dims;
+    }
+    double* v = (double*)resultUdata(ctx, 3, a->dims * sizeof(double), elementName(a), ELEM_META(a));
+    for (int k = 0; k < a->dims; k++)
+        v[k] = a->c[k][i];
+    return 1;
+}
 
-    lua_getfield(ctx, 1, "z");
-    double z1 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// a:set(i, x, y[, z]) or a:set(i, v)
+static int setVecArray(lua_State* ctx) {
+    static const char* const keys[] = {"x", "y", "z"};
+    VecArray* a = checkVecArray(ctx, 1);
+    size_t i = checkElement(ctx, 2, a);
+    if (lua_type(ctx, 3) == LUA_TNUMBER) {
+        for (int k = 0; k < a->dims; k++)
+            a->c[k][i] = luaL_checknumber(ctx, 3 + k);
+    } else if (double* v = (double*)testVecUdata(ctx, 3, ELEM_META(a))) {
+        for (int k = 0; k < a->dims; k++)
+            a->c[k][i] = v[k];
+    } else if (lua_istable(ctx, 3)) {
+        for (int k = 0; k < a->dims; k++)
+            a->c[k][i] = tableField(ctx, 3, keys[k]);
+    } else {
+        vecTypeError(ctx, 3, elementName(a));
+    }
+    lua_settop(ctx, 1);
+    return 1;
+}
 
-    // Get the x, y, and z values from the second vector
-    lua_getfield(ctx, 2, "x");
-    double x2 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// a:add(b [, out]): out = a + b per element (default out: a)
+static int addVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    VecArray* b = checkSameSize(ctx, 2, a);
+    VecArray* out = arrayResult(ctx, 3, a);
+    for (int k = 0; k < a->dims; k++)
+        kAdd(out->c[k], a->c[k], b->c[k], a->n);
+    return 1;
+}
 
-    lua_getfield(ctx, 2, "y");
-    double y2 = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+static int subVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    VecArray* b = checkSameSize(ctx, 2, a);
+    VecArray* out = arrayResult(ctx, 3, a);
+    for (int k = 0; k < a->dims; k++)
+        kSub(out->c[k], a->c[k], b->c[k], a->n);
+    return 1;
+}
+
+// a:scale(k [, out]): out = a * k
+static int scaleVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    double s = luaL_checknumber(ctx, 2);
+    VecArray* out = arrayResult(ctx, 3, a);
+    for (int k = 0; k < a->dims; k++)
+        kScale(out->c[k], a->c[k], s, a->n);
+    return 1;
+}
+
+// a:axpy(k, x): a += k * x
+static int axpyVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    double s = luaL_checknumber(ctx, 2);
+    VecArray* x = checkSameSize(ctx, 3, a);
+    for (int k = 0; k < a->dims; k++)
+        kAxpy(a->c[k], x->c[k], s, a->n);
+    lua_settop(ctx, 1);
+    return 1;
+}
 
-    lua_getfield(ctx, 2, "z");
-    double z2 = luaL_checknumber(ctx, -1);
+// pos:integrate(vel, dt): pos += vel * dt
+static int integrateVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    VecArray* v = checkSameSize(ctx, 2, a);
+    double dt = luaL_checknumber(ctx, 3);
+    for (int k = 0; k < a->dims; k++)
+        kAxpy(a->c[k], v->c[k], dt, a->n);
+    lua_settop(ctx, 1);
+    return 1;
+}
+
+// a:normalize([out]): every element scaled to length 1 (zero stays zero)
+static int normalizeVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    VecArray* out = arrayResult(ctx, 2, a);
+    double* len = pushBuffer<double>(ctx, a->n)->data; // scratch
+    kNormalize(out->c, a->c, len, a->dims, a->n);
     lua_pop(ctx, 1);
+    return 1;
+}
 
-    // Create a new vector for the result
-    lua_newtable(ctx);
-    lua_pushnumber(ctx, x1 - x2);
-    lua_setfield(ctx, -2, "x");
-    lua_pushnumber(ctx, y1 - y2);
-    lua_setfield(ctx, -2, "y");
-    lua_pushnumber(ctx, z1 - z2);
-    lua_setfield(ctx, -2, "z");
+// a:lengths([buf]) -> f64buffer of the element lengths
+static int lengthsVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    double* d = bufferResult(ctx, 2, a->n);
+    kDot(d, a->c, a->c, a->dims, a->n);
+    kSqrt(d, a->n);
+    return 1;
+}
 
+// a:dot(b [, buf]) -> f64buffer of the per-element dot products
+static int dotVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    VecArray* b = checkSameSize(ctx, 2, a);
+    double* d = bufferResult(ctx, 3, a->n);
+    kDot(d, a->c, b->c, a->dims, a->n);
     return 1;
 }
 
-// Function to get the length of a 3D vector
-int vec3Length(lua_State* ctx) {
-    // Ensure we have one argument, which is a table
-    luaL_checktype(ctx, 1, LUA_TTABLE);
+// component-wise min / max over the elements as a vector (nil when empty)
+static int reduceVecArray(lua_State* ctx, bool largest) {
+    VecArray* a = checkVecArray(ctx, 1);
+    if (a->n == 0) {
+        lua_pushnil(ctx);
+        return 1;
+    }
+    double* v = (double*)resultUdata(ctx, 2, a->dims * sizeof(double), elementName(a), ELEM_META(a));
+    for (int k = 0; k < a->dims; k++)
+        v[k] = kReduce(a->c[k], a->n, largest);
+    return 1;
+}
 
-    // Get the x, y, and z values from the vector
-    lua_getfield(ctx, 1, "x");
-    double x = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+static int minVecArray(lua_State* ctx) {
+    return reduceVecArray(ctx, false);
+}
 
-    lua_getfield(ctx, 1, "y");
-    double y = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+static int maxVecArray(lua_State* ctx) {
+    return reduceVecArray(ctx, true);
+}
 
-    lua_getfield(ctx, 1, "z");
-    double z = luaL_checknumber(ctx, -1);
-    lua_pop(ctx, 1);
+// a:view("x") -> f64buffer over that component, sharing the array's memory
+static int viewVecArray(lua_State* ctx) {
+    VecArray* a = checkVecArray(ctx, 1);
+    int k = fieldIndex(ctx, 2, a->dims);
+    luaL_argcheck(ctx, k >= 0, 2, "component name expected");
+    pushBuffer<double>(ctx, a->c[k], a->n);
+    lua_pushvalue(ctx, 1);
+    lua_setuservalue(ctx, -2); // keeps the array alive
+    return 1;
+}
 
-    // Calculate the length of the vector
-    double length = sqrt(x * x + y * y + z * z);
+// ---------------- Vec4 / Quat / Mat3 / Mat4 ----------------
+// Plain runs of doubles in the userdata: Vec4 and Quat are x, y, z, w;
+// matrices are column-major (m[col * n + row], as OpenGL expects), indexed
+// 1-based from Lua (m[13] is the x translation of a Mat4). Like Vec2 /
+// Vec3, results go to an optional trailing out argument when one is given.
+// Projection helpers follow the OpenGL conventions (right-handed, clip z in
+// -1..1).
 
-    // Push the length onto the Lua stack
-    lua_pushnumber(ctx, length);
+// the type at idx, or an argument error
+static double* checkMath(lua_State* ctx, int idx, int type) {
+    double* v = (double*)testVecUdata(ctx, idx, TYPE_META(type));
+    if (!v)
+        vecTypeError(ctx, idx, mathTypeNames[type]);
+    return v;
+}
 
+// copies r (computed first, so out may alias an operand) into the result
+static int returnMath(lua_State* ctx, int out, int type, const double* r) {
+    double* v = (double*)resultUdata(ctx, out, mathTypeSizes[type] * sizeof(double), mathTypeNames[type], TYPE_META(type));
+    memcpy(v, r, mathTypeSizes[type] * sizeof(double));
     return 1;
 }
 
-void initVec3(lua_State* L) {
+// new(): identity (matrices) / zero; new(a, b, ...): all the doubles
+static int newMath(lua_State* ctx, int type, int identity) {
+    double r[16] = {0};
+    int n = mathTypeSizes[type];
+    if (lua_gettop(ctx) == 0) {
+        for (int i = 0; identity && i < n; i += identity + 1)
+            r[i] = 1;
+    } else {
+        for (int i = 0; i < n; i++)
+            r[i] = luaL_checknumber(ctx, i + 1);
+    }
+    return returnMath(ctx, 0, type, r);
+}
+
+// v.x / m[i] reads, or a method from the class table
+static int indexMath(lua_State* ctx, int type) {
+    int isnum, n = mathTypeSizes[type];
+    lua_Integer i = lua_tointegerx(ctx, 2, &isnum);
+    if (!isnum && n <= 4)
+        i = fieldIndex(ctx, 2, n) + 1;
+    if (i >= 1 && i <= n) {
+        lua_pushnumber(ctx, checkMath(ctx, 1, type)[i - 1]);
+        return 1;
+    }
+    lua_pushvalue(ctx, 2);
+    lua_rawget(ctx, CLASS);
+    return 1;
+}
+
+static int newindexMath(lua_State* ctx, int type) {
+    int isnum, n = mathTypeSizes[type];
+    lua_Integer i = lua_tointegerx(ctx, 2, &isnum);
+    if (!isnum)
+        i = n <= 4 ? fieldIndex(ctx, 2, n) + 1 : 0;
+    if (i < 1 || i > n)
+        return luaL_error(ctx, "%s has no field '%s'", mathTypeNames[type], luaL_tolstring(ctx, 2, nullptr));
+    checkMath(ctx, 1, type)[i - 1] = luaL_checknumber(ctx, 3);
+    return 0;
+}
+
+// false, not an error, when either side is another type (Vec4 == Quat)
+static int eqMath(lua_State* ctx, int type) {
+    const double* a = (const double*)testVecUdata(ctx, 1, TYPE_META(type));
+    const double* b = (const double*)testVecUdata(ctx, 2, TYPE_META(type));
+    bool same = a && b;
+    for (int i = 0; same && i < mathTypeSizes[type]; i++)
+        same = a[i] == b[i];
+    lua_pushboolean(ctx, same);
+    return 1;
+}
+
+static int tostringMath(lua_State* ctx, int type) {
+    const double* v = checkMath(ctx, 1, type);
+    lua_pushstring(ctx, mathTypeNames[type]);
+    for (int i = 0; i < mathTypeSizes[type]; i++) {
+        lua_pushfstring(ctx, i ? ", %f" : "(%f", v[i]);
+        lua_concat(ctx, 2);
+    }
+    lua_pushliteral(ctx, ")");
+    lua_concat(ctx, 2);
+    return 1;
+}
+
+// k * a, for every double of a
+static int scaleMath(lua_State* ctx, int out, int type, const double* a, double k) {
+    double r[16];
+    for (int i = 0; i < mathTypeSizes[type]; i++)
+        r[i] = a[i] * k;
+    return returnMath(ctx, out, type, r);
+}
+
+static double dot3(const double* a, const double* b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void cross3(double* r, const double* a, const double* b) {
+    double x = a[1] * b[2] - a[2] * b[1], y = a[2] * b[0] - a[0] * b[2], z = a[0] * b[1] - a[1] * b[0];
+    r[0] = x;
+    r[1] = y;
+    r[2] = z;
+}
+
+static void normalize3(double* v) {
+    double len = sqrt(dot3(v, v));
+    for (int k = 0; len > 0 && k < 3; k++)
+        v[k] /= len;
+}
+
+// a Vec3 operand (userdata or {x=, y=, z=}) as 3 doubles; expected is what
+// the error message asks for
+static void checkPoint(lua_State* ctx, int idx, double* p, const char* expected = "Vec3") {
+    if (!testVecUdata(ctx, idx, TYPE_META(VEC3_T)) && !lua_istable(ctx, idx))
+        vecTypeError(ctx, idx, expected);
+    Vec3 v = checkVec3(ctx, idx, TYPE_META(VEC3_T));
+    p[0] = v.x;
+    p[1] = v.y;
+    p[2] = v.z;
+}
+
+// ---- Vec4
+
+static int newVec4(lua_State* ctx) {
+    return newMath(ctx, VEC4_T, 0);
+}
+
+static int addVec4(lua_State* ctx) {
+    const double *a = checkMath(ctx, 1, VEC4_T), *b = checkMath(ctx, 2, VEC4_T);
+    double r[4] = {a[0] + b[0], a[1] + b[1], a[2] + b[2], a[3] + b[3]};
+    return returnMath(ctx, 3, VEC4_T, r);
+}
+
+static int subVec4(lua_State* ctx) {
+    const double *a = checkMath(ctx, 1, VEC4_T), *b = checkMath(ctx, 2, VEC4_T);
+    double r[4] = {a[0] - b[0], a[1] - b[1], a[2] - b[2], a[3] - b[3]};
+    return returnMath(ctx, 3, VEC4_T, r);
+}
+
+// v * k, k * v, or component-wise v * w
+static int mulVec4(lua_State* ctx) {
+    if (lua_type(ctx, 1) == LUA_TNUMBER)
+        return scaleMath(ctx, 3, VEC4_T, checkMath(ctx, 2, VEC4_T), lua_tonumber(ctx, 1));
+    const double* a = checkMath(ctx, 1, VEC4_T);
+    if (lua_type(ctx, 2) == LUA_TNUMBER)
+        return scaleMath(ctx, 3, VEC4_T, a, lua_tonumber(ctx, 2));
+    const double* b = checkMath(ctx, 2, VEC4_T);
+    double r[4] = {a[0] * b[0], a[1] * b[1], a[2] * b[2], a[3] * b[3]};
+    return returnMath(ctx, 3, VEC4_T, r);
+}
+
+static int divVec4(lua_State* ctx) {
+    const double* v = checkMath(ctx, 1, VEC4_T);
+    return scaleMath(ctx, 3, VEC4_T, v, 1 / luaL_checknumber(ctx, 2));
+}
+
+static int unmVec4(lua_State* ctx) {
+    return scaleMath(ctx, 0, VEC4_T, checkMath(ctx, 1, VEC4_T), -1);
+}
+
+static double dot4(const double* a, const double* b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+}
+
+static int dotVec4(lua_State* ctx) {
+    lua_pushnumber(ctx, dot4(checkMath(ctx, 1, VEC4_T), checkMath(ctx, 2, VEC4_T)));
+    return 1;
+}
+
+static int lengthVec4(lua_State* ctx) {
+    const double* v = checkMath(ctx, 1, VEC4_T);
+    lua_pushnumber(ctx, sqrt(dot4(v, v)));
+    return 1;
+}
+
+static int normalizeVec4(lua_State* ctx) {
+    const double* v = checkMath(ctx, 1, VEC4_T);
+    double len = sqrt(dot4(v, v));
+    return scaleMath(ctx, 2, VEC4_T, v, len > 0 ? 1 / len : 0);
+}
+
+static int setVec4(lua_State* ctx) {
+    double r[4] = {luaL_checknumber(ctx, 2), luaL_checknumber(ctx, 3), luaL_checknumber(ctx, 4), luaL_checknumber(ctx, 5)};
+    return returnMath(ctx, 1, VEC4_T, r);
+}
+
+static int addInPlaceVec4(lua_State* ctx) { return inPlace(ctx, addVec4, "Vec4"); }
+static int subInPlaceVec4(lua_State* ctx) { return inPlace(ctx, subVec4, "Vec4"); }
+static int mulInPlaceVec4(lua_State* ctx) { return inPlace(ctx, mulVec4, "Vec4"); }
+static int divInPlaceVec4(lua_State* ctx) { return inPlace(ctx, divVec4, "Vec4"); }
+static int eqVec4(lua_State* ctx) { return eqMath(ctx, VEC4_T); }
+static int indexVec4(lua_State* ctx) { return indexMath(ctx, VEC4_T); }
+static int newindexVec4(lua_State* ctx) { return newindexMath(ctx, VEC4_T); }
+static int tostringVec4(lua_State* ctx) { return tostringMath(ctx, VEC4_T); }
+
+// ---- Quat (x, y, z, w; unit quaternions are rotations)
+
+static int newQuat(lua_State* ctx) {
+    if (lua_gettop(ctx) == 0) {
+        double r[4] = {0, 0, 0, 1};
+        return returnMath(ctx, 0, QUAT_T, r);
+    }
+    return newMath(ctx, QUAT_T, 0);
+}
+
+static int identityQuat(lua_State* ctx) {
+    double r[4] = {0, 0, 0, 1};
+    return returnMath(ctx, 1, QUAT_T, r);
+}
+
+// Quat.fromAxisAngle(axis, radians [, out])
+static int fromAxisAngleQuat(lua_State* ctx) {
+    double axis[3];
+    checkPoint(ctx, 1, axis);
+    normalize3(axis);
+    double half = luaL_checknumber(ctx, 2) / 2, s = sin(half);
+    double r[4] = {axis[0] * s, axis[1] * s, axis[2] * s, cos(half)};
+    return returnMath(ctx, 3, QUAT_T, r);
+}
+
+// v rotated by q
+static void rotate3(double* r, const double* q, const double* v) {
+    double uv[3], uuv[3];
+    cross3(uv, q, v);
+    cross3(uuv, q, uv);
+    for (int k = 0; k < 3; k++)
+        r[k] = v[k] + 2 * (q[3] * uv[k] + uuv[k]);
+}
+
+// q * p (p applied first), or q * v: v rotated by q
+static int mulQuat(lua_State* ctx) {
+    const double* a = checkMath(ctx, 1, QUAT_T);
+    if (const double* b = (const double*)testVecUdata(ctx, 2, TYPE_META(QUAT_T))) {
+        double r[4] = {
+            a[0] * b[3] + a[3] * b[0] + a[1] * b[2] - a[2] * b[1],
+            a[1] * b[3] + a[3] * b[1] + a[2] * b[0] - a[0] * b[2],
+            a[2] * b[3] + a[3] * b[2] + a[0] * b[1] - a[1] * b[0],
+            a[3] * b[3] - a[0] * b[0] - a[1] * b[1] - a[2] * b[2],
+        };
+        return returnMath(ctx, 3, QUAT_T, r);
+    }
+    double v[3], r[3];
+    checkPoint(ctx, 2, v, "Quat or Vec3");
+    rotate3(r, a, v);
+    return returnMath(ctx, 3, VEC3_T, r);
+}
+
+// q:rotate(v [, out]) -> Vec3
+static int rotateQuat(lua_State* ctx) {
+    const double* q = checkMath(ctx, 1, QUAT_T);
+    double v[3], r[3];
+    checkPoint(ctx, 2, v);
+    rotate3(r, q, v);
+    return returnMath(ctx, 3, VEC3_T, r);
+}
+
+static int conjugateQuat(lua_State* ctx) {
+    const double* q = checkMath(ctx, 1, QUAT_T);
+    double r[4] = {-q[0], -q[1], -q[2], q[3]};
+    return returnMath(ctx, 2, QUAT_T, r);
+}
+
+// nil for the zero quaternion
+static int inverseQuat(lua_State* ctx) {
+    const double* q = checkMath(ctx, 1, QUAT_T);
+    double d = dot4(q, q);
+    if (d == 0) {
+        lua_pushnil(ctx);
+        return 1;
+    }
+    double r[4] = {-q[0] / d, -q[1] / d, -q[2] / d, q[3] / d};
+    return returnMath(ctx, 2, QUAT_T, r);
+}
+
+static int normalizeQuat(lua_State* ctx) {
+    const double* q = checkMath(ctx, 1, QUAT_T);
+    double len = sqrt(dot4(q, q));
+    return scaleMath(ctx, 2, QUAT_T, q, len > 0 ? 1 / len : 0);
+}
+
+static int lengthQuat(lua_State* ctx) {
+    const double* q = checkMath(ctx, 1, QUAT_T);
+    lua_pushnumber(ctx, sqrt(dot4(q, q)));
+    return 1;
+}
+
+static int dotQuat(lua_State* ctx) {
+    lua_pushnumber(ctx, dot4(checkMath(ctx, 1, QUAT_T), checkMath(ctx, 2, QUAT_T)));
+    return 1;
+}
+
+// Quat.slerp(a, b, t [, out]): shortest-path spherical interpolation
+static int slerpQuat(lua_State* ctx) {
+    const double *a = checkMath(ctx, 1, QUAT_T), *b = checkMath(ctx, 2, QUAT_T);
+    double t = luaL_checknumber(ctx, 3);
+    double cosom = dot4(a, b), sign = 1;
+    if (cosom < 0) {
+        cosom = -cosom;
+        sign = -1;
+    }
+    double s0 = 1 - t, s1 = t;
+    if (1 - cosom > 1e-6) {
+        double omega = acos(cosom), sinom = sin(omega);
+        s0 = sin((1 - t) * omega) / sinom;
+        s1 = sin(t * omega) / sinom;
+    }
+    s1 *= sign;
+    double r[4] = {s0 * a[0] + s1 * b[0], s0 * a[1] + s1 * b[1], s0 * a[2] + s1 * b[2], s0 * a[3] + s1 * b[3]};
+    return returnMath(ctx, 4, QUAT_T, r);
+}
+
+static int eqQuat(lua_State* ctx) { return eqMath(ctx, QUAT_T); }
+static int indexQuat(lua_State* ctx) { return indexMath(ctx, QUAT_T); }
+static int newindexQuat(lua_State* ctx) { return newindexMath(ctx, QUAT_T); }
+static int tostringQuat(lua_State* ctx) { return tostringMath(ctx, QUAT_T); }
+
+// ---- Mat3
+
+// rotation part of the unit quaternion q, as n x n columns (n = 3 or 4)
+static void quatToMatrix(double* m, int n, const double* q) {
+    double x = q[0], y = q[1], z = q[2], w = q[3];
+    double xx = x * x * 2, yy = y * y * 2, zz = z * z * 2;
+    double xy = x * y * 2, xz = x * z * 2, yz = y * z * 2;
+    double wx = w * x * 2, wy = w * y * 2, wz = w * z * 2;
+    double cols[3][3] = {
+        {1 - yy - zz, xy + wz, xz - wy},
+        {xy - wz, 1 - xx - zz, yz + wx},
+        {xz + wy, yz - wx, 1 - xx - yy},
+    };
+    for (int c = 0; c < 3; c++)
+        for (int r = 0; r < 3; r++)
+            m[c * n + r] = cols[c][r];
+}
+
+static int newMat3(lua_State* ctx) {
+    return newMath(ctx, MAT3_T, 3);
+}
+
+static int identityMat3(lua_State* ctx) {
+    double r[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+    return returnMath(ctx, 1, MAT3_T, r);
+}
+
+// a * b, a * v, a * k (and k * a)
+static int mulMat3(lua_State* ctx) {
+    if (lua_type(ctx, 1) == LUA_TNUMBER)
+        return scaleMath(ctx, 3, MAT3_T, checkMath(ctx, 2, MAT3_T), lua_tonumber(ctx, 1));
+    const double* a = checkMath(ctx, 1, MAT3_T);
+    if (lua_type(ctx, 2) == LUA_TNUMBER)
+        return scaleMath(ctx, 3, MAT3_T, a, lua_tonumber(ctx, 2));
+    if (const double* b = (const double*)testVecUdata(ctx, 2, TYPE_META(MAT3_T))) {
+        double r[9];
+        for (int c = 0; c < 3; c++)
+            for (int row = 0; row < 3; row++)
+                r[c * 3 + row] = a[row] * b[c * 3] + a[3 + row] * b[c * 3 + 1] + a[6 + row] * b[c * 3 + 2];
+        return returnMath(ctx, 3, MAT3_T, r);
+    }
+    double v[3], r[3];
+    checkPoint(ctx, 2, v, "Mat3, Vec3 or number");
+    for (int row = 0; row < 3; row++)
+        r[row] = a[row] * v[0] + a[3 + row] * v[1] + a[6 + row] * v[2];
+    return returnMath(ctx, 3, VEC3_T, r);
+}
+
+static int transposeMat3(lua_State* ctx) {
+    const double* m = checkMath(ctx, 1, MAT3_T);
+    double r[9] = {m[0], m[3], m[6], m[1], m[4], m[7], m[2], m[5], m[8]};
+    return returnMath(ctx, 2, MAT3_T, r);
+}
+
+static double det3(const double* m) {
+    return m[0] * (m[8] * m[4] - m[5] * m[7]) + m[1] * (-m[8] * m[3] + m[5] * m[6]) + m[2] * (m[7] * m[3] - m[4] * m[6]);
+}
+
+static int determinantMat3(lua_State* ctx) {
+    lua_pushnumber(ctx, det3(checkMath(ctx, 1, MAT3_T)));
+    return 1;
+}
+
+// nil when singular
+static int inverseMat3(lua_State* ctx) {
+    const double* m = checkMath(ctx, 1, MAT3_T);
+    double det = det3(m);
+    if (det == 0) {
+        lua_pushnil(ctx);
+        return 1;
+    }
+    double a00 = m[0], a01 = m[1], a02 = m[2], a10 = m[3], a11 = m[4], a12 = m[5], a20 = m[6], a21 = m[7], a22 = m[8];
+    double r[9] = {
+        (a22 * a11 - a12 * a21) / det, (-a22 * a01 + a02 * a21) / det, (a12 * a01 - a02 * a11) / det,
+        (-a22 * a10 + a12 * a20) / det, (a22 * a00 - a02 * a20) / det, (-a12 * a00 + a02 * a10) / det,
+        (a21 * a10 - a11 * a20) / det, (-a21 * a00 + a01 * a20) / det, (a11 * a00 - a01 * a10) / det,
+    };
+    return returnMath(ctx, 2, MAT3_T, r);
+}
+
+static int fromQuatMat3(lua_State* ctx) {
+    double r[9];
+    quatToMatrix(r, 3, checkMath(ctx, 1, QUAT_T));
+    return returnMath(ctx, 2, MAT3_T, r);
+}
+
+// upper-left 3x3 of a Mat4 (Mat3.fromMat4(model):inverse():transpose() is
+// the normal matrix)
+static int fromMat4Mat3(lua_State* ctx) {
+    const double* m = checkMath(ctx, 1, MAT4_T);
+    double r[9] = {m[0], m[1], m[2], m[4], m[5], m[6], m[8], m[9], m[10]};
+    return returnMath(ctx, 2, MAT3_T, r);
+}
+
+static int eqMat3(lua_State* ctx) { return eqMath(ctx, MAT3_T); }
+static int indexMat3(lua_State* ctx) { return indexMath(ctx, MAT3_T); }
+static int newindexMat3(lua_State* ctx) { return newindexMath(ctx, MAT3_T); }
+static int tostringMat3(lua_State* ctx) { return tostringMath(ctx, MAT3_T); }
+
+// ---- Mat4
+
+// d = a * b, one column of 4 lanes at a time (d must not alias a or b)
+VEC_KERNEL static void kMat4Mul(double* d, const double* a, const double* b) {
+    for (int c = 0; c < 4; c++)
+        LANES(d + c * 4) = LANES(a) * b[c * 4] + LANES(a + 4) * b[c * 4 + 1] + LANES(a + 8) * b[c * 4 + 2] + LANES(a + 12) * b[c * 4 + 3];
+}
+
+// the points p[k][0..n) transformed by m into d[k] (d may be p); divides by
+// w when m is projective (w = 0 is taken as 1)
+VEC_KERNEL static void kTransformPoints(double* const* d, const double* const* p, const double* m, size_t n) {
+    bool projective = m[3] != 0 || m[7] != 0 || m[11] != 0 || m[15] != 1;
+    size_t i = 0;
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        Lanes x = LANES(p[0] + i), y = LANES(p[1] + i), z = LANES(p[2] + i);
+        Lanes rx = x * m[0] + y * m[4] + z * m[8] + m[12];
+        Lanes ry = x * m[1] + y * m[5] + z * m[9] + m[13];
+        Lanes rz = x * m[2] + y * m[6] + z * m[10] + m[14];
+        if (projective) {
+            Lanes w = x * m[3] + y * m[7] + z * m[11] + m[15];
+            for (int j = 0; j < VEC_LANES; j++)
+                w[j] = w[j] != 0 ? 1 / w[j] : 1;
+            rx = rx * w;
+            ry = ry * w;
+            rz = rz * w;
+        }
+        LANES(d[0] + i) = rx;
+        LANES(d[1] + i) = ry;
+        LANES(d[2] + i) = rz;
+    }
+    for (; i < n; i++) {
+        double x = p[0][i], y = p[1][i], z = p[2][i];
+        double w = projective ? x * m[3] + y * m[7] + z * m[11] + m[15] : 1;
+        w = w != 0 ? 1 / w : 1;
+        d[0][i] = (x * m[0] + y * m[4] + z * m[8] + m[12]) * w;
+        d[1][i] = (x * m[1] + y * m[5] + z * m[9] + m[13]) * w;
+        d[2][i] = (x * m[2] + y * m[6] + z * m[10] + m[14]) * w;
+    }
+}
+
+static int newMat4(lua_State* ctx) {
+    return newMath(ctx, MAT4_T, 4);
+}
+
+static int identityMat4(lua_State* ctx) {
+    double r[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    return returnMath(ctx, 1, MAT4_T, r);
+}
+
+// p (w = 1) transformed by m, divided by w unless w is 0
+static void transformPoint(double* r, const double* m, const double* p) {
+    double* d[3] = {r, r + 1, r + 2};
+    const double* s[3] = {p, p + 1, p + 2};
+    kTransformPoints(d, s, m, 1);
+}
+
+// a * b (Mat4), a * v (Vec4), a * p (Vec3 point), a * k (and k * a)
+static int mulMat4(lua_State* ctx) {
+    if (lua_type(ctx, 1) == LUA_TNUMBER)
+        return scaleMath(ctx, 3, MAT4_T, checkMath(ctx, 2, MAT4_T), lua_tonumber(ctx, 1));
+    const double* a = checkMath(ctx, 1, MAT4_T);
+    if (lua_type(ctx, 2) == LUA_TNUMBER)
+        return scaleMath(ctx, 3, MAT4_T, a, lua_tonumber(ctx, 2));
+    if (const double* b = (const double*)testVecUdata(ctx, 2, TYPE_META(MAT4_T))) {
+        double r[16];
+        kMat4Mul(r, a, b);
+        return returnMath(ctx, 3, MAT4_T, r);
+    }
+    if (const double* v = (const double*)testVecUdata(ctx, 2, TYPE_META(VEC4_T))) {
+        double r[4];
+        for (int row = 0; row < 4; row++)
+            r[row] = a[row] * v[0] + a[4 + row] * v[1] + a[8 + row] * v[2] + a[12 + row] * v[3];
+        return returnMath(ctx, 3, VEC4_T, r);
+    }
+    double p[3], r[3];
+    checkPoint(ctx, 2, p, "Mat4, Vec4, Vec3 or number");
+    transformPoint(r, a, p);
+    return returnMath(ctx, 3, VEC3_T, r);
+}
+
+// m:transformPoint(p [, out]) -> Vec3 (w = 1, divided by the result's w)
+static int transformPointMat4(lua_State* ctx) {
+    const double* m = checkMath(ctx, 1, MAT4_T);
+    double p[3], r[3];
+    checkPoint(ctx, 2, p);
+    transformPoint(r, m, p);
+    return returnMath(ctx, 3, VEC3_T, r);
+}
+
+// m:transformDirection(v [, out]) -> Vec3 (w = 0: no translation)
+static int transformDirectionMat4(lua_State* ctx) {
+    const double* m = checkMath(ctx, 1, MAT4_T);
+    double v[3], r[3];
+    checkPoint(ctx, 2, v);
+    for (int row = 0; row < 3; row++)
+        r[row] = m[row] * v[0] + m[4 + row] * v[1] + m[8 + row] * v[2];
+    return returnMath(ctx, 3, VEC3_T, r);
+}
+
+// m:transformPoints(points [, out]): every point of a Vec3Array (out
+// defaults to points itself)
+static int transformPointsMat4(lua_State* ctx) {
+    const double* m = checkMath(ctx, 1, MAT4_T);
+    VecArray* p = (VecArray*)testVecUdata(ctx, 2, TYPE_META(VEC3ARRAY_T));
+    if (!p)
+        vecTypeError(ctx, 2, "Vec3Array");
+    int out = lua_isnoneornil(ctx, 3) ? 2 : 3;
+    VecArray* d = (VecArray*)testVecUdata(ctx, out, TYPE_META(VEC3ARRAY_T));
+    if (!d)
+        vecTypeError(ctx, out, "Vec3Array");
+    if (d->n != p->n)
+        luaL_argerror(ctx, out, lua_pushfstring(ctx, "%d elements expected, got %d", (int)p->n, (int)d->n));
+    kTransformPoints(d->c, p->c, m, p->n);
+    lua_pushvalue(ctx, out);
+    return 1;
+}
+
+static int transposeMat4(lua_State* ctx) {
+    const double* m = checkMath(ctx, 1, MAT4_T);
+    double r[16];
+    for (int c = 0; c < 4; c++)
+        for (int row = 0; row < 4; row++)
+            r[c * 4 + row] = m[row * 4 + c];
+    return returnMath(ctx, 2, MAT4_T, r);
+}
+
+// the 2x2 sub-determinants shared by det4 and inverseMat4
+struct Mat4Minors {
+    double b[12];
+    explicit Mat4Minors(const double* a) {
+        b[0] = a[0] * a[5] - a[1] * a[4];
+        b[1] = a[0] * a[6] - a[2] * a[4];
+        b[2] = a[0] * a[7] - a[3] * a[4];
+        b[3] = a[1] * a[6] - a[2] * a[5];
+        b[4] = a[1] * a[7] - a[3] * a[5];
+        b[5] = a[2] * a[7] - a[3] * a[6];
+        b[6] = a[8] * a[13] - a[9] * a[12];
+        b[7] = a[8] * a[14] - a[10] * a[12];
+        b[8] = a[8] * a[15] - a[11] * a[12];
+        b[9] = a[9] * a[14] - a[10] * a[13];
+        b[10] = a[9] * a[15] - a[11] * a[13];
+        b[11] = a[10] * a[15] - a[11] * a[14];
+    }
+    double det() const {
+        return b[0] * b[11] - b[1] * b[10] + b[2] * b[9] + b[3] * b[8] - b[4] * b[7] + b[5] * b[6];
+    }
+};
+
+static int determinantMat4(lua_State* ctx) {
+    lua_pushnumber(ctx, Mat4Minors(checkMath(ctx, 1, MAT4_T)).det());
+    return 1;
+}
+
+// nil when singular
+static int inverseMat4(lua_State* ctx) {
+    const double* a = checkMath(ctx, 1, MAT4_T);
+    Mat4Minors mi(a);
+    const double* b = mi.b;
+    double det = mi.det();
+    if (det == 0) {
+        lua_pushnil(ctx);
+        return 1;
+    }
+    double r[16] = {
+        a[5] * b[11] - a[6] * b[10] + a[7] * b[9],
+        a[2] * b[10] - a[1] * b[11] - a[3] * b[9],
+        a[13] * b[5] - a[14] * b[4] + a[15] * b[3],
+        a[10] * b[4] - a[9] * b[5] - a[11] * b[3],
+        a[6] * b[8] - a[4] * b[11] - a[7] * b[7],
+        a[0] * b[11] - a[2] * b[8] + a[3] * b[7],
+        a[14] * b[2] - a[12] * b[5] - a[15] * b[1],
+        a[8] * b[5] - a[10] * b[2] + a[11] * b[1],
+        a[4] * b[10] - a[5] * b[8] + a[7] * b[6],
+        a[1] * b[8] - a[0] * b[10] - a[3] * b[6],
+        a[12] * b[4] - a[13] * b[2] + a[15] * b[0],
+        a[9] * b[2] - a[8] * b[4] - a[11] * b[0],
+        a[5] * b[7] - a[4] * b[9] - a[6] * b[6],
+        a[0] * b[9] - a[1] * b[7] + a[2] * b[6],
+        a[13] * b[1] - a[12] * b[3] - a[14] * b[0],
+        a[8] * b[3] - a[9] * b[1] + a[10] * b[0],
+    };
+    return scaleMath(ctx, 2, MAT4_T, r, 1 / det);
+}
+
+// x, y, z as numbers or one Vec3 at idx; the index after them
+static int checkXYZ(lua_State* ctx, int idx, double* v) {
+    if (lua_type(ctx, idx) == LUA_TNUMBER) {
+        for (int k = 0; k < 3; k++)
+            v[k] = luaL_checknumber(ctx, idx + k);
+        return idx + 3;
+    }
+    checkPoint(ctx, idx, v);
+    return idx + 1;
+}
+
+// Mat4.translation(x, y, z | v [, out])
+static int translationMat4(lua_State* ctx) {
+    double v[3];
+    int out = checkXYZ(ctx, 1, v);
+    double r[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, v[0], v[1], v[2], 1};
+    return returnMath(ctx, out, MAT4_T, r);
+}
+
+// Mat4.scaling(x, y, z | v [, out])
+static int scalingMat4(lua_State* ctx) {
+    double v[3];
+    int out = checkXYZ(ctx, 1, v);
+    double r[16] = {v[0], 0, 0, 0, 0, v[1], 0, 0, 0, 0, v[2], 0, 0, 0, 0, 1};
+    return returnMath(ctx, out, MAT4_T, r);
+}
+
+// Mat4.fromQuat(q [, out]): the rotation q
+static int fromQuatMat4(lua_State* ctx) {
+    double r[16] = {0};
+    quatToMatrix(r, 4, checkMath(ctx, 1, QUAT_T));
+    r[15] = 1;
+    return returnMath(ctx, 2, MAT4_T, r);
+}
+
+// Mat4.lookAt(eye, target, up [, out]): view matrix of a camera at eye
+// looking at target
+static int lookAtMat4(lua_State* ctx) {
+    double eye[3], target[3], up[3], x[3], y[3], z[3];
+    checkPoint(ctx, 1, eye);
+    checkPoint(ctx, 2, target);
+    checkPoint(ctx, 3, up);
+    for (int k = 0; k < 3; k++)
+        z[k] = eye[k] - target[k];
+    normalize3(z);
+    cross3(x, up, z);
+    normalize3(x);
+    cross3(y, z, x);
+    double r[16] = {
+        x[0], y[0], z[0], 0,
+        x[1], y[1], z[1], 0,
+        x[2], y[2], z[2], 0,
+        -dot3(x, eye), -dot3(y, eye), -dot3(z, eye), 1,
+    };
+    return returnMath(ctx, 4, MAT4_T, r);
+}
+
+// Mat4.perspective(fovy, aspect, near, far [, out]), fovy in radians
+static int perspectiveMat4(lua_State* ctx) {
+    double fovy = luaL_checknumber(ctx, 1), aspect = luaL_checknumber(ctx, 2);
+    double n = luaL_checknumber(ctx, 3), f = luaL_checknumber(ctx, 4);
+    double t = 1 / tan(fovy / 2), nf = 1 / (n - f);
+    double r[16] = {t / aspect, 0, 0, 0, 0, t, 0, 0, 0, 0, (f + n) * nf, -1, 0, 0, 2 * f * n * nf, 0};
+    return returnMath(ctx, 5, MAT4_T, r);
+}
+
+// Mat4.ortho(left, right, bottom, top, near, far [, out])
+static int orthoMat4(lua_State* ctx) {
+    double l = luaL_checknumber(ctx, 1), rt = luaL_checknumber(ctx, 2), b = luaL_checknumber(ctx, 3);
+    double t = luaL_checknumber(ctx, 4), n = luaL_checknumber(ctx, 5), f = luaL_checknumber(ctx, 6);
+    double lr = 1 / (l - rt), bt = 1 / (b - t), nf = 1 / (n - f);
+    double r[16] = {-2 * lr, 0, 0, 0, 0, -2 * bt, 0, 0, 0, 0, 2 * nf, 0, (l + rt) * lr, (t + b) * bt, (f + n) * nf, 1};
+    return returnMath(ctx, 7, MAT4_T, r);
+}
+
+static int eqMat4(lua_State* ctx) { return eqMath(ctx, MAT4_T); }
+static int indexMat4(lua_State* ctx) { return indexMath(ctx, MAT4_T); }
+static int newindexMat4(lua_State* ctx) { return newindexMath(ctx, MAT4_T); }
+static int tostringMat4(lua_State* ctx) { return tostringMath(ctx, MAT4_T); }
+
+// ---------------- SpatialGrid / AABBTree ----------------
+// Broadphase indexes over integer ids, for "what is near this" without
+// comparing every pair of entities from Lua:
+//
+//   SpatialGrid.new(cellSize)  points hashed into uniform cells; best when
+//                              entities are small and spread out
+//   AABBTree.new([margin])     dynamic bounding-volume tree of boxes (fat
+//                              by margin so small moves skip the reinsert);
+//                              best for entities of varied sizes
+//
+// Positions are Vec3, Vec2 (z = 0) or {x=, y=[, z=]}. Queries return an
+// i32buffer of ids and the hit count: `local ids, n = grid:queryRadius(p,
+// r, ids)` reuses the buffer passed last when it is big enough, so a
+// steady-state query allocates nothing. pairs() fills the buffer with
+// a1, b1, a2, b2, ... and returns the pair count.
+
+// p from a Vec3, Vec2 or {x=, y=[, z=]} at idx
+static void checkPos(lua_State* ctx, int idx, double* p) {
+    if (const double* v = (const double*)testVecUdata(ctx, idx, TYPE_META(VEC3_T))) {
+        memcpy(p, v, 3 * sizeof(double));
+    } else if (const double* v2 = (const double*)testVecUdata(ctx, idx, TYPE_META(VEC2_T))) {
+        p[0] = v2[0];
+        p[1] = v2[1];
+        p[2] = 0;
+    } else if (lua_istable(ctx, idx)) {
+        p[0] = tableField(ctx, idx, "x");
+        p[1] = tableField(ctx, idx, "y");
+        lua_getfield(ctx, idx, "z");
+        p[2] = luaL_optnumber(ctx, -1, 0);
+        lua_pop(ctx, 1);
+    } else {
+        vecTypeError(ctx, idx, "Vec3 or Vec2");
+    }
+}
+
+static int32_t checkId(lua_State* ctx, int idx) {
+    lua_Integer id = luaL_checkinteger(ctx, idx);
+    luaL_argcheck(ctx, id >= INT32_MIN && id <= INT32_MAX, idx, "id out of 32-bit range");
+    return (int32_t)id;
+}
+
+// pushes ids (in the i32buffer at buf when it has room, else a new one) and
+// count
+static int returnIds(lua_State* ctx, const std::vector<int32_t>& ids, size_t count, int buf) {
+    LuaBuffer<int32_t>* b = nullptr;
+    if (!lua_isnoneornil(ctx, buf)) {
+        b = checkBuffer<int32_t>(ctx, buf);
+        if (b->len >= ids.size())
+            lua_pushvalue(ctx, buf);
+        else
+            b = nullptr;
+    }
+    if (!b)
+        b = pushBuffer<int32_t>(ctx, ids.size());
+    if (!ids.empty())
+        memcpy(b->data, ids.data(), ids.size() * sizeof(int32_t));
+    lua_pushinteger(ctx, (lua_Integer)count);
+    return 2;
+}
+
+static double dist2(const double* a, const double* b) {
+    double dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// ---- SpatialGrid
+
+struct GridEntry {
+    int32_t id;
+    uint32_t slot; // position in its cell's list
+    uint64_t cell;
+    double p[3];
+};
+
+struct SpatialGrid {
+    double inv; // 1 / cell size
+    std::vector<GridEntry> entries;
+    std::vector<uint32_t> unused; // free entries
+    std::unordered_map<int32_t, uint32_t> byId;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> cells;
+    int64_t used[2][3] = {{0, 0, 0}, {-1, -1, -1}}; // cell coordinates ever occupied (empty when lo > hi)
+    std::vector<int32_t> hits;
+
+    // cell coordinate along one axis, kept in 21 bits
+    int64_t coord(double v) const {
+        double c = floor(v * inv);
+        return c < -(1 << 20) ? -(1 << 20) : c > (1 << 20) - 1 ? (1 << 20) - 1 : (int64_t)c;
+    }
+    static uint64_t key(int64_t x, int64_t y, int64_t z) {
+        const uint64_t mask = (1 << 21) - 1;
+        return ((uint64_t)x & mask) << 42 | ((uint64_t)y & mask) << 21 | ((uint64_t)z & mask);
+    }
+    uint64_t keyOf(const double* p) {
+        int64_t c[3];
+        for (int k = 0; k < 3; k++) {
+            c[k] = coord(p[k]);
+            if (used[0][k] > used[1][k]) {
+                used[0][k] = used[1][k] = c[k];
+            } else {
+                used[0][k] = c[k] < used[0][k] ? c[k] : used[0][k];
+                used[1][k] = c[k] > used[1][k] ? c[k] : used[1][k];
+            }
+        }
+        return key(c[0], c[1], c[2]);
+    }
+
+    void link(uint32_t e) {
+        std::vector<uint32_t>& list = cells[entries[e].cell];
+        entries[e].slot = (uint32_t)list.size();
+        list.push_back(e);
+    }
+    void unlink(uint32_t e) {
+        auto cell = cells.find(entries[e].cell);
+        std::vector<uint32_t>& list = cell->second;
+        uint32_t slot = entries[e].slot;
+        list[slot] = list.back();
+        entries[list[slot]].slot = slot;
+        list.pop_back();
+        if (list.empty())
+            cells.erase(cell);
+    }
+
+    void insert(int32_t id, const double* p) {
+        auto found = byId.find(id);
+        if (found != byId.end()) {
+            move(found->second, p);
+            return;
+        }
+        uint32_t e;
+        if (unused.empty()) {
+            e = (uint32_t)entries.size();
+            entries.emplace_back();
+        } else {
+            e = unused.back();
+            unused.pop_back();
+        }
+        entries[e].id = id;
+        memcpy(entries[e].p, p, sizeof(entries[e].p));
+        entries[e].cell = keyOf(p);
+        link(e);
+        byId[id] = e;
+    }
+    void move(uint32_t e, const double* p) {
+        memcpy(entries[e].p, p, sizeof(entries[e].p));
+        uint64_t cell = keyOf(p);
+        if (cell == entries[e].cell)
+            return;
+        unlink(e);
+        entries[e].cell = cell;
+        link(e);
+    }
+    bool remove(int32_t id) {
+        auto found = byId.find(id);
+        if (found == byId.end())
+            return false;
+        unlink(found->second);
+        unused.push_back(found->second);
+        byId.erase(found);
+        return true;
+    }
+    void clear() {
+        entries.clear();
+        unused.clear();
+        byId.clear();
+        cells.clear();
+        used[0][0] = used[0][1] = used[0][2] = 0;
+        used[1][0] = used[1][1] = used[1][2] = -1;
+    }
+
+    // fn(entry) for every entry in the cells overlapping lo..hi
+    template <typename Fn> void forEachIn(const double* lo, const double* hi, Fn&& fn) const {
+        int64_t c0[3], c1[3];
+        double span = 1;
+        for (int k = 0; k < 3; k++) { // only the occupied range, so 2D data probes one z
+            c0[k] = coord(lo[k]) > used[0][k] ? coord(lo[k]) : used[0][k];
+            c1[k] = coord(hi[k]) < used[1][k] ? coord(hi[k]) : used[1][k];
+            if (c0[k] > c1[k])
+                return;
+            span *= (double)(c1[k] - c0[k] + 1);
+        }
+        if (span > (double)cells.size()) { // cheaper to walk every cell
+            for (const auto& cell : cells)
+                for (uint32_t e : cell.second)
+                    fn(entries[e]);
+            return;
+        }
+        for (int64_t x = c0[0]; x <= c1[0]; x++)
+            for (int64_t y = c0[1]; y <= c1[1]; y++)
+                for (int64_t z = c0[2]; z <= c1[2]; z++) {
+                    auto cell = cells.find(key(x, y, z));
+                    if (cell != cells.end())
+                        for (uint32_t e : cell->second)
+                            fn(entries[e]);
+                }
+    }
+};
+
+static SpatialGrid* checkGrid(lua_State* ctx, int idx) {
+    SpatialGrid* g = (SpatialGrid*)testVecUdata(ctx, idx, TYPE_META(SPATIALGRID_T));
+    if (!g)
+        vecTypeError(ctx, idx, "SpatialGrid");
+    return g;
+}
+
+// SpatialGrid.new(cellSize)
+static int newSpatialGrid(lua_State* ctx) {
+    double size = luaL_checknumber(ctx, 1);
+    luaL_argcheck(ctx, size > 0, 1, "cell size must be positive");
+    SpatialGrid* g = new (newVecUdata(ctx, sizeof(SpatialGrid))) SpatialGrid();
+    g->inv = 1 / size;
+    return 1;
+}
+
+// scripts can call __gc by hand (getmetatable(g).__gc(g)): the metatable
+// goes with the object, so later calls see a plain userdata
+static int gcSpatialGrid(lua_State* ctx) {
+    if (SpatialGrid* g = (SpatialGrid*)testVecUdata(ctx, 1)) {
+        g->~SpatialGrid();
+        lua_pushnil(ctx);
+        lua_setmetatable(ctx, 1);
+    }
+    return 0;
+}
+
+// grid:insert(id, pos): adds id, or moves it when already present
+static int insertSpatialGrid(lua_State* ctx) {
+    SpatialGrid* g = checkGrid(ctx, 1);
+    int32_t id = checkId(ctx, 2);
+    double p[3];
+    checkPos(ctx, 3, p);
+    g->insert(id, p);
+    return 0;
+}
+
+// grid:move(id, pos) -> false when id is not in the grid
+static int moveSpatialGrid(lua_State* ctx) {
+    SpatialGrid* g = checkGrid(ctx, 1);
+    int32_t id = checkId(ctx, 2);
+    double p[3];
+    checkPos(ctx, 3, p);
+    auto found = g->byId.find(id);
+    if (found != g->byId.end())
+        g->move(found->second, p);
+    lua_pushboolean(ctx, found != g->byId.end());
+    return 1;
+}
+
+static int removeSpatialGrid(lua_State* ctx) {
+    SpatialGrid* g = checkGrid(ctx, 1);
+    lua_pushboolean(ctx, g->remove(checkId(ctx, 2)));
+    return 1;
+}
+
+// grid:build(points): clears the grid, then inserts the elements of a
+// Vec2Array / Vec3Array with ids 1..n
+static int buildSpatialGrid(lua_State* ctx) {
+    SpatialGrid* g = checkGrid(ctx, 1);
+    VecArray* a = (VecArray*)testVecUdata(ctx, 2, TYPE_META(VEC3ARRAY_T));
+    if (!a)
+        a = (VecArray*)testVecUdata(ctx, 2, TYPE_META(VEC2ARRAY_T));
+    if (!a)
+        vecTypeError(ctx, 2, "Vec3Array or Vec2Array");
+    g->clear();
+    g->entries.reserve(a->n);
+    for (size_t i = 0; i < a->n; i++) {
+        double p[3] = {a->c[0][i], a->c[1][i], a->dims == 3 ? a->c[2][i] : 0};
+        g->insert((int32_t)(i + 1), p);
+    }
+    lua_settop(ctx, 1);
+    return 1;
+}
+
+// grid:queryRadius(pos, r [, buf]) -> ids, n
+static int queryRadiusSpatialGrid(lua_State* ctx) {
+    SpatialGrid* g = checkGrid(ctx, 1);
+    double p[3], lo[3], hi[3];
+    checkPos(ctx, 2, p);
+    double r = luaL_checknumber(ctx, 3);
+    for (int k = 0; k < 3; k++) {
+        lo[k] = p[k] - r;
+        hi[k] = p[k] + r;
+    }
+    g->hits.clear();
+    g->forEachIn(lo, hi, [&](const GridEntry& e) {
+        if (dist2(e.p, p) <= r * r)
+            g->hits.push_back(e.id);
+    });
+    return returnIds(ctx, g->hits, g->hits.size(), 4);
+}
+
+// grid:queryBox(min, max [, buf]) -> ids, n
+static int queryBoxSpatialGrid(lua_State* ctx) {
+    SpatialGrid* g = checkGrid(ctx, 1);
+    double lo[3], hi[3];
+    checkPos(ctx, 2, lo);
+    checkPos(ctx, 3, hi);
+    g->hits.clear();
+    g->forEachIn(lo, hi, [&](const GridEntry& e) {
+        if (e.p[0] >= lo[0] && e.p[0] <= hi[0] && e.p[1] >= lo[1] && e.p[1] <= hi[1] && e.p[2] >= lo[2] && e.p[2] <= hi[2])
+            g->hits.push_back(e.id);
+    });
+    return returnIds(ctx, g->hits, g->hits.size(), 4);
+}
+
+// grid:pairs(d [, buf]) -> a1, b1, a2, b2, ..., n: every pair within d
+static int pairsSpatialGrid(lua_State* ctx) {
+    SpatialGrid* g = checkGrid(ctx, 1);
+    double d = luaL_checknumber(ctx, 2);
+    g->hits.clear();
+    for (const auto& cell : g->cells) {
+        for (uint32_t a : cell.second) {
+            const GridEntry& ea = g->entries[a];
+            double lo[3], hi[3];
+            for (int k = 0; k < 3; k++) {
+                lo[k] = ea.p[k] - d;
+                hi[k] = ea.p[k] + d;
+            }
+            g->forEachIn(lo, hi, [&](const GridEntry& eb) {
+                if (&eb > &ea && dist2(ea.p, eb.p) <= d * d) {
+                    g->hits.push_back(ea.id);
+                    g->hits.push_back(eb.id);
+                }
+            });
+        }
+    }
+    return returnIds(ctx, g->hits, g->hits.size() / 2, 3);
+}
+
+static int countSpatialGrid(lua_State* ctx) {
+    lua_pushinteger(ctx, (lua_Integer)checkGrid(ctx, 1)->byId.size());
+    return 1;
+}
+
+static int clearSpatialGrid(lua_State* ctx) {
+    checkGrid(ctx, 1)->clear();
+    return 0;
+}
+
+static int tostringSpatialGrid(lua_State* ctx) {
+    SpatialGrid* g = checkGrid(ctx, 1);
+    lua_pushfstring(ctx, "SpatialGrid(%d ids, %d cells)", (int)g->byId.size(), (int)g->cells.size());
+    return 1;
+}
+
+// ---- AABBTree
+
+struct TreeNode {
+    double lo[3], hi[3];   // fat box (leaves) / union of the children
+    double tlo[3], thi[3]; // the box as inserted (leaves)
+    int32_t parent;        // next free node while unused
+    int32_t left, right;   // -1 for leaves
+    int32_t height;        // 0 for leaves, -1 while unused
+    int32_t id;
+};
+
+struct AABBTree {
+    std::vector<TreeNode> nodes;
+    int32_t root = -1, unused = -1;
+    double margin = 0;
+    std::unordered_map<int32_t, int32_t> leaves; // id -> node
+    std::vector<int32_t> hits, stack;
+
+    bool isLeaf(int32_t n) const {
+        return nodes[n].left == -1;
+    }
+    static double area(const double* lo, const double* hi) {
+        double dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+        return dx * dy + dy * dz + dz * dx;
+    }
+    // area of the union of node n's box and lo..hi
+    double unionArea(int32_t n, const double* lo, const double* hi) const {
+        double ulo[3], uhi[3];
+        for (int k = 0; k < 3; k++) {
+            ulo[k] = fmin(nodes[n].lo[k], lo[k]);
+            uhi[k] = fmax(nodes[n].hi[k], hi[k]);
+        }
+        return area(ulo, uhi);
+    }
+    void fit(int32_t n) {
+        TreeNode &p = nodes[n], &a = nodes[p.left], &b = nodes[p.right];
+        for (int k = 0; k < 3; k++) {
+            p.lo[k] = fmin(a.lo[k], b.lo[k]);
+            p.hi[k] = fmax(a.hi[k], b.hi[k]);
+        }
+        p.height = 1 + (a.height > b.height ? a.height : b.height);
+    }
+
+    int32_t allocate() {
+        int32_t n = unused;
+        if (n == -1) {
+            n = (int32_t)nodes.size();
+            nodes.emplace_back();
+        } else {
+            unused = nodes[n].parent;
+        }
+        nodes[n].parent = nodes[n].left = nodes[n].right = -1;
+        nodes[n].height = 0;
+        return n;
+    }
+    void release(int32_t n) {
+        nodes[n].parent = unused;
+        nodes[n].height = -1;
+        unused = n;
+    }
+    void replaceChild(int32_t parent, int32_t from, int32_t to) {
+        if (parent == -1)
+            root = to;
+        else if (nodes[parent].left == from)
+            nodes[parent].left = to;
+        else
+            nodes[parent].right = to;
+    }
+
+    // AVL-style rotation at a when its subtrees differ in height by more
+    // than one; returns the node now in a's place
+    int32_t balance(int32_t a) {
+        TreeNode& A = nodes[a];
+        if (isLeaf(a) || A.height < 2)
+            return a;
+        int32_t b = A.left, c = A.right;
+        int32_t diff = nodes[c].height - nodes[b].height;
+        if (diff > 1 || diff < -1) {
+            // lift the taller child u; a keeps the other child and takes
+            // u's shorter grandchild, u keeps its taller one
+            bool liftRight = diff > 1;
+            int32_t u = liftRight ? c : b;
+            TreeNode& U = nodes[u];
+            int32_t f = U.left, g = U.right;
+            if (nodes[f].height < nodes[g].height) {
+                int32_t t = f;
+                f = g;
+                g = t;
+            }
+            U.left = a;
+            U.right = f;
+            U.parent = A.parent;
+            A.parent = u;
+            replaceChild(U.parent, a, u);
+            if (liftRight)
+                A.right = g;
+            else
+                A.left = g;
+            nodes[g].parent = a;
+            fit(a);
+            fit(u);
+            return u;
+        }
+        return a;
+    }
+
+    void insertLeaf(int32_t leaf) {
+        if (root == -1) {
+            root = leaf;
+            nodes[leaf].parent = -1;
+            return;
+        }
+        const double *lo = nodes[leaf].lo, *hi = nodes[leaf].hi;
+        // walk down to the sibling that grows the total area the least
+        int32_t n = root;
+        while (!isLeaf(n)) {
+            double combined = unionArea(n, lo, hi);
+            double cost = 2 * combined, inherit = 2 * (combined - area(nodes[n].lo, nodes[n].hi));
+            double childCost[2];
+            int32_t child[2] = {nodes[n].left, nodes[n].right};
+            for (int i = 0; i < 2; i++) {
+                childCost[i] = unionArea(child[i], lo, hi) + inherit;
+                if (!isLeaf(child[i]))
+                    childCost[i] -= area(nodes[child[i]].lo, nodes[child[i]].hi);
+            }
+            if (cost < childCost[0] && cost < childCost[1])
+                break;
+            n = childCost[0] < childCost[1] ? child[0] : child[1];
+        }
+        int32_t sibling = n, oldParent = nodes[sibling].parent;
+        int32_t parent = allocate(); // may move nodes
+        nodes[parent].parent = oldParent;
+        nodes[parent].left = sibling;
+        nodes[parent].right = leaf;
+        nodes[sibling].parent = parent;
+        nodes[leaf].parent = parent;
+        replaceChild(oldParent, sibling, parent);
+        refit(parent);
+    }
+
+    void removeLeaf(int32_t leaf) {
+        if (leaf == root) {
+            root = -1;
+            return;
+        }
+        int32_t parent = nodes[leaf].parent, grand = nodes[parent].parent;
+        int32_t sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+        replaceChild(grand, parent, sibling);
+        nodes[sibling].parent = grand;
+        release(parent);
+        refit(grand);
+    }
+
+    // boxes and heights from n up to the root, rebalancing on the way
+    void refit(int32_t n) {
+        while (n != -1) {
+            n = balance(n);
+            fit(n);
+            n = nodes[n].parent;
+        }
+    }
+
+    void insert(int32_t id, const double* lo, const double* hi) {
+        auto found = leaves.find(id);
+        if (found != leaves.end()) {
+            move(found->second, lo, hi);
+            return;
+        }
+        int32_t leaf = allocate();
+        nodes[leaf].id = id;
+        setBox(leaf, lo, hi);
+        insertLeaf(leaf);
+        leaves[id] = leaf;
+    }
+    void setBox(int32_t leaf, const double* lo, const double* hi) {
+        TreeNode& l = nodes[leaf];
+        for (int k = 0; k < 3; k++) {
+            l.tlo[k] = lo[k];
+            l.thi[k] = hi[k];
+            l.lo[k] = lo[k] - margin;
+            l.hi[k] = hi[k] + margin;
+        }
+    }
+    // true when the leaf had to be reinserted
+    bool move(int32_t leaf, const double* lo, const double* hi) {
+        TreeNode& l = nodes[leaf];
+        bool inside = true;
+        for (int k = 0; k < 3; k++)
+            inside = inside && lo[k] >= l.lo[k] && hi[k] <= l.hi[k];
+        if (inside) {
+            memcpy(l.tlo, lo, sizeof(l.tlo));
+            memcpy(l.thi, hi, sizeof(l.thi));
+            return false;
+        }
+        removeLeaf(leaf);
+        setBox(leaf, lo, hi);
+        insertLeaf(leaf);
+        return true;
+    }
+    bool remove(int32_t id) {
+        auto found = leaves.find(id);
+        if (found == leaves.end())
+            return false;
+        removeLeaf(found->second);
+        release(found->second);
+        leaves.erase(found);
+        return true;
+    }
+    void clear() {
+        nodes.clear();
+        leaves.clear();
+        root = unused = -1;
+    }
+
+    // fn(leaf) for the leaves whose box passes test(lo, hi); internal nodes
+    // are tested with their (fat) bounds
+    template <typename Test, typename Fn> void query(Test&& test, Fn&& fn) {
+        if (root == -1)
+            return;
+        stack.clear();
+        stack.push_back(root);
+        while (!stack.empty()) {
+            int32_t n = stack.back();
+            stack.pop_back();
+            const TreeNode& node = nodes[n];
+            if (isLeaf(n)) {
+                if (test(node.tlo, node.thi))
+                    fn(n);
+            } else if (test(node.lo, node.hi)) {
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        }
+    }
+};
+
+static bool boxesOverlap(const double* alo, const double* ahi, const double* blo, const double* bhi) {
+    return alo[0] <= bhi[0] && blo[0] <= ahi[0] && alo[1] <= bhi[1] && blo[1] <= ahi[1] && alo[2] <= bhi[2] && blo[2] <= ahi[2];
+}
+
+static AABBTree* checkTree(lua_State* ctx, int idx) {
+    AABBTree* t = (AABBTree*)testVecUdata(ctx, idx, TYPE_META(AABBTREE_T));
+    if (!t)
+        vecTypeError(ctx, idx, "AABBTree");
+    return t;
+}
+
+// AABBTree.new([margin])
+static int newAABBTree(lua_State* ctx) {
+    double margin = luaL_optnumber(ctx, 1, 0);
+    luaL_argcheck(ctx, margin >= 0, 1, "negative margin");
+    AABBTree* t = new (newVecUdata(ctx, sizeof(AABBTree))) AABBTree();
+    t->margin = margin;
+    return 1;
+}
+
+// as gcSpatialGrid
+static int gcAABBTree(lua_State* ctx) {
+    if (AABBTree* t = (AABBTree*)testVecUdata(ctx, 1)) {
+        t->~AABBTree();
+        lua_pushnil(ctx);
+        lua_setmetatable(ctx, 1);
+    }
+    return 0;
+}
+
+// lo..hi from the positions at idx and idx + 1 (in any corner order)
+static void checkBox(lua_State* ctx, int idx, double* lo, double* hi) {
+    double a[3], b[3];
+    checkPos(ctx, idx, a);
+    checkPos(ctx, idx + 1, b);
+    for (int k = 0; k < 3; k++) {
+        lo[k] = fmin(a[k], b[k]);
+        hi[k] = fmax(a[k], b[k]);
+    }
+}
+
+// tree:insert(id, min, max): adds id, or moves it when already present
+static int insertAABBTree(lua_State* ctx) {
+    AABBTree* t = checkTree(ctx, 1);
+    int32_t id = checkId(ctx, 2);
+    double lo[3], hi[3];
+    checkBox(ctx, 3, lo, hi);
+    t->insert(id, lo, hi);
+    return 0;
+}
+
+// tree:move(id, min, max) -> nil when id is not in the tree, else whether
+// the box left its margin (and was reinserted)
+static int moveAABBTree(lua_State* ctx) {
+    AABBTree* t = checkTree(ctx, 1);
+    int32_t id = checkId(ctx, 2);
+    double lo[3], hi[3];
+    checkBox(ctx, 3, lo, hi);
+    auto found = t->leaves.find(id);
+    if (found == t->leaves.end())
+        lua_pushnil(ctx);
+    else
+        lua_pushboolean(ctx, t->move(found->second, lo, hi));
+    return 1;
+}
+
+static int removeAABBTree(lua_State* ctx) {
+    AABBTree* t = checkTree(ctx, 1);
+    lua_pushboolean(ctx, t->remove(checkId(ctx, 2)));
+    return 1;
+}
+
+// tree:queryBox(min, max [, buf]) -> ids, n
+static int queryBoxAABBTree(lua_State* ctx) {
+    AABBTree* t = checkTree(ctx, 1);
+    double lo[3], hi[3];
+    checkBox(ctx, 2, lo, hi);
+    t->hits.clear();
+    t->query([&](const double* blo, const double* bhi) { return boxesOverlap(lo, hi, blo, bhi); },
+             [&](int32_t n) { t->hits.push_back(t->nodes[n].id); });
+    return returnIds(ctx, t->hits, t->hits.size(), 4);
+}
+
+// tree:queryRadius(center, r [, buf]) -> ids, n
+static int queryRadiusAABBTree(lua_State* ctx) {
+    AABBTree* t = checkTree(ctx, 1);
+    double c[3];
+    checkPos(ctx, 2, c);
+    double r = luaL_checknumber(ctx, 3);
+    t->hits.clear();
+    t->query(
+        [&](const double* lo, const double* hi) {
+            double closest[3];
+            for (int k = 0; k < 3; k++)
+                closest[k] = fmin(fmax(c[k], lo[k]), hi[k]);
+            return dist2(closest, c) <= r * r;
+        },
+        [&](int32_t n) { t->hits.push_back(t->nodes[n].id); });
+    return returnIds(ctx, t->hits, t->hits.size(), 4);
+}
+
+// tree:pairs([buf]) -> a1, b1, a2, b2, ..., n: every pair of overlapping boxes
+static int pairsAABBTree(lua_State* ctx) {
+    AABBTree* t = checkTree(ctx, 1);
+    t->hits.clear();
+    for (const auto& leaf : t->leaves) {
+        const TreeNode& a = t->nodes[leaf.second];
+        t->query([&](const double* lo, const double* hi) { return boxesOverlap(a.tlo, a.thi, lo, hi); },
+                 [&](int32_t n) {
+                     if (n > leaf.second) {
+                         t->hits.push_back(leaf.first);
+                         t->hits.push_back(t->nodes[n].id);
+                     }
+                 });
+    }
+    return returnIds(ctx, t->hits, t->hits.size() / 2, 2);
+}
+
+static int countAABBTree(lua_State* ctx) {
+    lua_pushinteger(ctx, (lua_Integer)checkTree(ctx, 1)->leaves.size());
+    return 1;
+}
+
+static int clearAABBTree(lua_State* ctx) {
+    checkTree(ctx, 1)->clear();
+    return 0;
+}
+
+// tree:height(): 0 for a single box, about log2(n) when balanced
+static int heightAABBTree(lua_State* ctx) {
+    AABBTree* t = checkTree(ctx, 1);
+    lua_pushinteger(ctx, t->root == -1 ? 0 : t->nodes[t->root].height);
+    return 1;
+}
+
+static int tostringAABBTree(lua_State* ctx) {
+    AABBTree* t = checkTree(ctx, 1);
+    lua_pushfstring(ctx, "AABBTree(%d ids)", (int)t->leaves.size());
+    return 1;
+}
+
+// Creates the metatable `name` and the global class table `name`, and
+// registers funcs in the class table and metamethods in the metatable, all
+// with (metatable, class table, every type's metatable) as upvalues
+static void registerMathType(lua_State* L, const char* name, const luaL_Reg* funcs, const luaL_Reg* metamethods) {
+    luaL_newmetatable(L, name);
+    int meta = lua_gettop(L);
     lua_newtable(L);
-    lua_pushcfunction(L, newVec3);
-    lua_setfield(L, -2, "new");
-    lua_pushcfunction(L, addVec3);
-    lua_setfield(L, -2, "add");
-    lua_pushcfunction(L, subVec3);
-    lua_setfield(L, -2, "sub");
-    lua_pushcfunction(L, vec3Length);
-    lua_setfield(L, -2, "length");
-    lua_setglobal(L, "Vec3");
+
+    for (int target = meta + 1; target >= meta; target--) {
+        lua_pushvalue(L, target);
+        lua_pushvalue(L, meta);
+        lua_pushvalue(L, meta + 1);
+        for (int t = 0; t < MATH_TYPES; t++)
+            luaL_newmetatable(L, mathTypeNames[t]); // the existing one if already made
+        luaL_setfuncs(L, target == meta ? metamethods : funcs, 2 + MATH_TYPES);
+        lua_pop(L, 1);
+    }
+
+    lua_setglobal(L, name);
+    lua_pop(L, 1);
+}
+
+void initVec3(lua_State* L) {
+    static const luaL_Reg funcs[] = {
+        {"new", newVec3},
+        {"add", addVec3},
+        {"sub", subVec3},
+        {"mul", mulVec3},
+        {"div", divVec3},
+        {"length", vec3Length},
+        {"set", setVec3},
+        {"addInPlace", addInPlaceVec3},
+        {"subInPlace", subInPlaceVec3},
+        {"mulInPlace", mulInPlaceVec3},
+        {"divInPlace", divInPlaceVec3},
+        {NULL, NULL},
+    };
+    static const luaL_Reg metamethods[] = {
+        {"__add", addVec3},
+        {"__sub", subVec3},
+        {"__mul", mulVec3},
+        {"__div", divVec3},
+        {"__unm", unmVec3},
+        {"__eq", eqVec3},
+        {"__index", indexVec3},
+        {"__newindex", newindexVec3},
+        {"__tostring", tostringVec3},
+        {NULL, NULL},
+    };
+    registerMathType(L, "Vec3", funcs, metamethods);
 }
 
 // Function to register the C++ functions in Lua
 void initVec2(lua_State* L) {
-    lua_newtable(L);
-    lua_pushcfunction(L, newVec2);
-    lua_setfield(L, -2, "new");
-    lua_pushcfunction(L, addVec2);
-    lua_setfield(L, -2, "add");
-    lua_pushcfunction(L, subVec2);
-    lua_setfield(L, -2, "sub");
-    lua_pushcfunction(L, fromVec2ToRadians);
-    lua_setfield(L, -2, "fromVec2ToRadians");
-    lua_pushcfunction(L, fromRadiansToVec2);
-    lua_setfield(L, -2, "fromRadiansToVec2");
+    static const luaL_Reg funcs[] = {
+        {"new", newVec2},
+        {"add", addVec2},
+        {"sub", subVec2},
+        {"mul", mulVec2},
+        {"div", divVec2},
+        {"length", vec2Length},
+        {"set", setVec2},
+        {"addInPlace", addInPlaceVec2},
+        {"subInPlace", subInPlaceVec2},
+        {"mulInPlace", mulInPlaceVec2},
+        {"divInPlace", divInPlaceVec2},
+        {"fromVec2ToRadians", fromVec2ToRadians},
+        {"fromRadiansToVec2", fromRadiansToVec2},
+        {NULL, NULL},
+    };
+    static const luaL_Reg metamethods[] = {
+        {"__add", addVec2},
+        {"__sub", subVec2},
+        {"__mul", mulVec2},
+        {"__div", divVec2},
+        {"__unm", unmVec2},
+        {"__eq", eqVec2},
+        {"__index", indexVec2},
+        {"__newindex", newindexVec2},
+        {"__tostring", tostringVec2},
+        {NULL, NULL},
+    };
+    registerMathType(L, "Vec2", funcs, metamethods);
+}
+
+#define VEC_ARRAY_FUNCS                     \
+    {"get", getVecArray},                   \
+    {"set", setVecArray},                   \
+    {"add", addVecArray},                   \
+    {"sub", subVecArray},                   \
+    {"scale", scaleVecArray},               \
+    {"axpy", axpyVecArray},                 \
+    {"integrate", integrateVecArray},       \
+    {"normalize", normalizeVecArray},       \
+    {"lengths", lengthsVecArray},           \
+    {"dot", dotVecArray},                   \
+    {"min", minVecArray},                   \
+    {"max", maxVecArray},                   \
+    {"view", viewVecArray}
+
+void initVecArrays(lua_State* L) {
+    static const luaL_Reg funcs2[] = {
+        {"new", newVec2Array},
+        VEC_ARRAY_FUNCS,
+        {NULL, NULL},
+    };
+    static const luaL_Reg funcs3[] = {
+        {"new", newVec3Array},
+        VEC_ARRAY_FUNCS,
+        {NULL, NULL},
+    };
+    static const luaL_Reg metamethods[] = {
+        {"__index", indexClass},
+        {"__len", lenVecArray},
+        {"__tostring", tostringVecArray},
+        {NULL, NULL},
+    };
+    registerMathType(L, "Vec2Array", funcs2, metamethods);
+    registerMathType(L, "Vec3Array", funcs3, metamethods);
+}
+
+void initVec4(lua_State* L) {
+    static const luaL_Reg funcs[] = {
+        {"new", newVec4},
+        {"add", addVec4},
+        {"sub", subVec4},
+        {"mul", mulVec4},
+        {"div", divVec4},
+        {"dot", dotVec4},
+        {"length", lengthVec4},
+        {"normalize", normalizeVec4},
+        {"set", setVec4},
+        {"addInPlace", addInPlaceVec4},
+        {"subInPlace", subInPlaceVec4},
+        {"mulInPlace", mulInPlaceVec4},
+        {"divInPlace", divInPlaceVec4},
+        {NULL, NULL},
+    };
+    static const luaL_Reg metamethods[] = {
+        {"__add", addVec4},
+        {"__sub", subVec4},
+        {"__mul", mulVec4},
+        {"__div", divVec4},
+        {"__unm", unmVec4},
+        {"__eq", eqVec4},
+        {"__index", indexVec4},
+        {"__newindex", newindexVec4},
+        {"__tostring", tostringVec4},
+        {NULL, NULL},
+    };
+    registerMathType(L, "Vec4", funcs, metamethods);
+}
 
-    lua_setglobal(L, "Vec2");
+void initQuat(lua_State* L) {
+    static const luaL_Reg funcs[] = {
+        {"new", newQuat},
+        {"identity", identityQuat},
+        {"fromAxisAngle", fromAxisAngleQuat},
+        {"mul", mulQuat},
+        {"rotate", rotateQuat},
+        {"conjugate", conjugateQuat},
+        {"inverse", inverseQuat},
+        {"normalize", normalizeQuat},
+        {"length", lengthQuat},
+        {"dot", dotQuat},
+        {"slerp", slerpQuat},
+        {NULL, NULL},
+    };
+    static const luaL_Reg metamethods[] = {
+        {"__mul", mulQuat},
+        {"__eq", eqQuat},
+        {"__index", indexQuat},
+        {"__newindex", newindexQuat},
+        {"__tostring", tostringQuat},
+        {NULL, NULL},
+    };
+    registerMathType(L, "Quat", funcs, metamethods);
+}
+
+void initMat3(lua_State* L) {
+    static const luaL_Reg funcs[] = {
+        {"new", newMat3},
+        {"identity", identityMat3},
+        {"mul", mulMat3},
+        {"transpose", transposeMat3},
+        {"determinant", determinantMat3},
+        {"inverse", inverseMat3},
+        {"fromQuat", fromQuatMat3},
+        {"fromMat4", fromMat4Mat3},
+        {NULL, NULL},
+    };
+    static const luaL_Reg metamethods[] = {
+        {"__mul", mulMat3},
+        {"__eq", eqMat3},
+        {"__index", indexMat3},
+        {"__newindex", newindexMat3},
+        {"__tostring", tostringMat3},
+        {NULL, NULL},
+    };
+    registerMathType(L, "Mat3", funcs, metamethods);
+}
+
+void initMat4(lua_State* L) {
+    static const luaL_Reg funcs[] = {
+        {"new", newMat4},
+        {"identity", identityMat4},
+        {"mul", mulMat4},
+        {"transpose", transposeMat4},
+        {"determinant", determinantMat4},
+        {"inverse", inverseMat4},
+        {"translation", translationMat4},
+        {"scaling", scalingMat4},
+        {"fromQuat", fromQuatMat4},
+        {"lookAt", lookAtMat4},
+        {"perspective", perspectiveMat4},
+        {"ortho", orthoMat4},
+        {"transformPoint", transformPointMat4},
+        {"transformDirection", transformDirectionMat4},
+        {"transformPoints", transformPointsMat4},
+        {NULL, NULL},
+    };
+    static const luaL_Reg metamethods[] = {
+        {"__mul", mulMat4},
+        {"__eq", eqMat4},
+        {"__index", indexMat4},
+        {"__newindex", newindexMat4},
+        {"__tostring", tostringMat4},
+        {NULL, NULL},
+    };
+    registerMathType(L, "Mat4", funcs, metamethods);
 }
 
 void initFuncs(lua_State* L) {
     initVec2(L);
     initVec3(L);
+    initVec4(L);
+    initQuat(L);
+    initMat3(L);
+    initMat4(L);
+    initVecArrays(L);
+    initSpatial(L);
+}
+
+void initSpatial(lua_State* L) {
+    static const luaL_Reg gridFuncs[] = {
+        {"new", newSpatialGrid},
+        {"insert", insertSpatialGrid},
+        {"move", moveSpatialGrid},
+        {"remove", removeSpatialGrid},
+        {"build", buildSpatialGrid},
+        {"queryRadius", queryRadiusSpatialGrid},
+        {"queryBox", queryBoxSpatialGrid},
+        {"pairs", pairsSpatialGrid},
+        {"count", countSpatialGrid},
+        {"clear", clearSpatialGrid},
+        {NULL, NULL},
+    };
+    static const luaL_Reg gridMetamethods[] = {
+        {"__index", indexClass},
+        {"__gc", gcSpatialGrid},
+        {"__tostring", tostringSpatialGrid},
+        {NULL, NULL},
+    };
+    static const luaL_Reg treeFuncs[] = {
+        {"new", newAABBTree},
+        {"insert", insertAABBTree},
+        {"move", moveAABBTree},
+        {"remove", removeAABBTree},
+        {"queryBox", queryBoxAABBTree},
+        {"queryRadius", queryRadiusAABBTree},
+        {"pairs", pairsAABBTree},
+        {"count", countAABBTree},
+        {"clear", clearAABBTree},
+        {"height", heightAABBTree},
+        {NULL, NULL},
+    };
+    static const luaL_Reg treeMetamethods[] = {
+        {"__index", indexClass},
+        {"__gc", gcAABBTree},
+        {"__tostring", tostringAABBTree},
+        {NULL, NULL},
+    };
+    registerMathType(L, "SpatialGrid", gridFuncs, gridMetamethods);
+    registerMathType(L, "AABBTree", treeFuncs, treeMetamethods);
 }
@@ -1,6 +1,25 @@
 #pragma once
 #include <lua.hpp>
 
-void initFuncs(lua_State* L);   // Registers both Vec2 and Vec3
+// Vec2 / Vec3 values are full userdata holding these, with arithmetic
+// metamethods (+ - * / unary -, ==), .x/.y/.z access and tostring.
+// Vec2.add/sub/mul/div(a, b, out) and v:addInPlace(w) ... write into an
+// existing vector instead of allocating one
+struct Vec2 {
+    double x, y;
+};
+struct Vec3 {
+    double x, y, z;
+};
+
+// Vec4 and Quat hold x, y, z, w; Mat3 / Mat4 hold 9 / 16 doubles, column-major
+
+void initFuncs(lua_State* L);   // Registers all of the below
 void initVec2(lua_State* L);
 void initVec3(lua_State* L);
+void initVec4(lua_State* L);
+void initQuat(lua_State* L);
+void initMat3(lua_State* L);
+void initMat4(lua_State* L);
+void initVecArrays(lua_State* L); // Vec2Array / Vec3Array
+void initSpatial(lua_State* L);   // SpatialGrid / AABBTree broadphase indexes
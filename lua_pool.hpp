@@ -0,0 +1,265 @@
+#pragma once
+// Running Lua on every core: a lua_State is single-threaded, so instead of
+// sharing one, keep several identical states, built once by an init
+// callback (openlibs, initFuncs, register_* for LUA_CLASS types, loading
+// scripts), and hand them out.
+//
+//   LuaStatePool - N ready states, acquire()/release() (or a Lease) from
+//                  any thread; for code that already has its own threads
+//   LuaScheduler - one state per worker thread, per-worker task queues with
+//                  stealing; submit(fn) / call<R>("global", args...) return
+//                  std::futures
+//
+// Tasks run inside lua_pcall, so a Lua error (or a C++ exception from the
+// task) becomes an exception on the future instead of a panic. The stack is
+// cleared after every task; globals a task sets stay in that worker's state.
+// Link with -pthread.
+#include "lua_ffi.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using LuaInit = std::function<void(lua_State *)>;
+
+// a pooled-allocator state with the standard libraries and init applied
+inline lua_State *newInitState(const LuaInit &init, size_t mem_limit = 0) {
+  lua_State *L = newPooledLuaState(mem_limit);
+  if (!L)
+    PANIC("could not create a lua state");
+  luaL_openlibs(L);
+  if (init)
+    init(L);
+  lua_settop(L, 0);
+  return L;
+}
+
+// ---------------- Pool of ready states ----------------
+class LuaStatePool {
+public:
+  LuaStatePool(size_t n, LuaInit init, size_t mem_limit = 0) {
+    states_.reserve(n);
+    for (size_t i = 0; i < n; i++)
+      states_.push_back(newInitState(init, mem_limit));
+    free_ = states_;
+  }
+  ~LuaStatePool() {
+    for (lua_State *L : states_)
+      lua_close(L);
+  }
+  LuaStatePool(const LuaStatePool &) = delete;
+  LuaStatePool &operator=(const LuaStatePool &) = delete;
+
+  // waits until a state is free
+  lua_State *acquire() {
+    std::unique_lock<std::mutex> lk(mu_);
+    cv_.wait(lk, [&] { return !free_.empty(); });
+    lua_State *L = free_.back();
+    free_.pop_back();
+    return L;
+  }
+  void release(lua_State *L) {
+    lua_settop(L, 0);
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      free_.push_back(L);
+    }
+    cv_.notify_one();
+  }
+
+  // acquire() for the lifetime of the lease
+  struct Lease {
+    LuaStatePool *pool;
+    lua_State *L;
+    explicit Lease(LuaStatePool &p) : pool(&p), L(p.acquire()) {}
+    ~Lease() { pool->release(L); }
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+    operator lua_State *() const { return L; }
+  };
+  Lease lease() { return Lease(*this); }
+
+  size_t size() const { return states_.size(); }
+
+private:
+  std::vector<lua_State *> states_;
+  std::vector<lua_State *> free_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+};
+
+// ---------------- Worker scheduler ----------------
+struct LuaTask {
+  std::function<void(lua_State *)> run; // inside lua_pcall
+  std::function<void(std::exception_ptr)> fail;
+};
+
+// lua_pcall trampoline for the LuaTaskCall passed as light userdata; C++
+// exceptions are caught here instead of unwinding through Lua
+struct LuaTaskCall {
+  LuaTask *task;
+  std::exception_ptr error;
+};
+inline int luaRunTask(lua_State *L) {
+  auto *call = static_cast<LuaTaskCall *>(lua_touserdata(L, 1));
+  lua_remove(L, 1);
+  try {
+    call->task->run(L);
+  } catch (...) {
+    call->error = std::current_exception();
+  }
+  return 0;
+}
+
+class LuaScheduler {
+public:
+  explicit LuaScheduler(LuaInit init, unsigned threads = 0,
+                        size_t mem_limit = 0) {
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    // states are built up front so a broken init fails here, not later
+    for (unsigned i = 0; i < threads; i++) {
+      workers_.emplace_back(std::make_unique<Worker>());
+      workers_.back()->L = newInitState(init, mem_limit);
+    }
+    for (unsigned i = 0; i < threads; i++)
+      workers_[i]->thread = std::thread(&LuaScheduler::loop, this, i);
+  }
+  // runs what was submitted, then stops the workers and closes the states
+  ~LuaScheduler() {
+    {
+      std::lock_guard<std::mutex> lk(idle_mu_);
+      stop_ = true;
+    }
+    idle_cv_.notify_all();
+    for (auto &w : workers_) {
+      w->thread.join();
+      lua_close(w->L);
+    }
+  }
+  LuaScheduler(const LuaScheduler &) = delete;
+  LuaScheduler &operator=(const LuaScheduler &) = delete;
+
+  // runs fn(L) on some worker's state; fn's result comes back through the
+  // future, so it must not point into the Lua state
+  template <typename F>
+  auto submit(F &&fn) -> std::future<decltype(fn(std::declval<lua_State *>()))> {
+    using R = decltype(fn(std::declval<lua_State *>()));
+    auto prom = std::make_shared<std::promise<R>>();
+    auto fut = prom->get_future();
+    LuaTask task;
+    task.run = [prom, fn = std::forward<F>(fn)](lua_State *L) mutable {
+      if constexpr (std::is_void_v<R>) {
+        fn(L);
+        prom->set_value();
+      } else {
+        prom->set_value(fn(L));
+      }
+    };
+    task.fail = [prom](std::exception_ptr e) {
+      prom->set_exception(std::move(e));
+    };
+    push(std::move(task));
+    return fut;
+  }
+
+  // calls the global function name(args...) and converts its first result
+  // to R (as a lua_bind argument would be; strings as std::string)
+  template <typename R = void, typename... Args>
+  std::future<R> call(std::string name, Args... args) {
+    static_assert(!std::is_same_v<R, const char *> &&
+                      !std::is_same_v<R, std::string_view>,
+                  "results outlive the call: use std::string");
+    return submit([name = std::move(name), args...](lua_State *L) -> R {
+      lua_getglobal(L, name.c_str());
+      (luaPushResult(L, args), ...);
+      lua_call(L, static_cast<int>(sizeof...(Args)), std::is_void_v<R> ? 0 : 1);
+      if constexpr (!std::is_void_v<R>)
+        return std::decay_t<R>(luaGetArg<R>(L, -1));
+    });
+  }
+
+  size_t threads() const { return workers_.size(); }
+
+private:
+  struct Worker {
+    std::mutex mu;
+    std::deque<LuaTask> tasks;
+    lua_State *L = nullptr;
+    std::thread thread;
+  };
+
+  void push(LuaTask task) {
+    size_t i = next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    pending_.fetch_add(1); // before the push, so take() never goes below 0
+    {
+      std::lock_guard<std::mutex> lk(workers_[i]->mu);
+      workers_[i]->tasks.push_back(std::move(task));
+    }
+    { std::lock_guard<std::mutex> lk(idle_mu_); }
+    idle_cv_.notify_one();
+  }
+
+  // own queue from the front, others' from the back
+  bool take(size_t self, LuaTask &out) {
+    size_t n = workers_.size();
+    for (size_t k = 0; k < n; k++) {
+      Worker &w = *workers_[(self + k) % n];
+      std::lock_guard<std::mutex> lk(w.mu);
+      if (w.tasks.empty())
+        continue;
+      if (k == 0) {
+        out = std::move(w.tasks.front());
+        w.tasks.pop_front();
+      } else {
+        out = std::move(w.tasks.back());
+        w.tasks.pop_back();
+      }
+      pending_.fetch_sub(1);
+      return true;
+    }
+    return false;
+  }
+
+  void loop(size_t self) {
+    lua_State *L = workers_[self]->L;
+    LuaTask task;
+    for (;;) {
+      if (!take(self, task)) {
+        std::unique_lock<std::mutex> lk(idle_mu_);
+        idle_cv_.wait(lk, [&] { return stop_ || pending_.load() > 0; });
+        if (stop_ && pending_.load() == 0)
+          return;
+        continue;
+      }
+      LuaTaskCall call{&task, nullptr};
+      lua_pushcfunction(L, &luaRunTask);
+      lua_pushlightuserdata(L, &call);
+      if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+        const char *msg = lua_tostring(L, -1);
+        call.error = std::make_exception_ptr(
+            std::runtime_error(msg ? msg : "lua error"));
+      }
+      if (call.error)
+        task.fail(std::move(call.error));
+      lua_settop(L, 0);
+      task = LuaTask();
+    }
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_{0};
+  std::atomic<size_t> pending_{0};
+  std::mutex idle_mu_;
+  std::condition_variable idle_cv_;
+  bool stop_ = false;
+};
@@ -2,11 +2,17 @@
 
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <float.h>
+
+/* bump whenever some input lexes differently; invalidates token caches */
+#define TK_VERSION_NUM 1
 
 /* ─── Public Token API ───────────────────────────────────────────────────── */
 
@@ -22,15 +28,24 @@ typedef enum TokenType{
     TOK_ELLIPSIS,
     TOK_PUNCT,
     TOK_OP,
+    TOK_ERROR,   // text skipped by tk_tokenize_recover / tk_lexer_recover
     TOK_MAX // this is just so we know how big this enum is, not actualy used
 } TokenType;
 
+/* decoded value of a numeric literal */
+typedef union {
+    int64_t i;      /* TOK_INT */
+    double  f;      /* TOK_FLOAT */
+} TkNumber;
+
 typedef struct {
     TokenType type; /* exact type */
     char *value;    /* exact text */
     int   line;     /* 1‑based */
     int   column;   /* 0‑based */
     char *file;     /* duplicated filename */
+    size_t offset;  /* byte offset of the token's first character */
+    TkNumber num;   /* TOK_INT / TOK_FLOAT value, zero otherwise */
 } Token;
 
 /**
@@ -42,16 +57,286 @@ typedef struct {
  */
 Token *tk_tokenize(const char *source, const char *filename, size_t *out_count);
 
+/* a lexing problem recorded instead of exiting */
+typedef struct {
+    char  *file;          /* duplicated filename */
+    int    line;          /* 1‑based */
+    int    column;        /* 0‑based */
+    size_t offset;        /* start of the TOK_ERROR token it produced */
+    char   message[48];
+} TkDiagnostic;
+
+typedef struct {
+    TkDiagnostic *items;
+    size_t        count;
+    size_t        cap;
+} TkDiagnostics;
+
+/**
+ * Like tk_tokenize, but a lexing error does not exit: it is appended to
+ * *diags, the offending text becomes a TOK_ERROR token and lexing resumes
+ * after it (past the bad byte, the rest of a malformed number, or the end
+ * of the line of an unterminated literal).
+ * @param diags  zero-initialised or reused list; free with tk_free_diagnostics
+ */
+Token *tk_tokenize_recover(const char *source, const char *filename, size_t *out_count,
+                           TkDiagnostics *diags);
+void tk_free_diagnostics(TkDiagnostics *diags);
+
 /**
  * Free a Token array returned by tk_tokenize.
  */
 void tk_free_tokens(Token *tokens, size_t count);
 
+/* ─── Structure-of-arrays API ───────────────────────────────────────────── */
+
+/**
+ * Compact token output for parsers that mostly look at types: about 21
+ * bytes per token in six parallel arrays and no per-token allocation.
+ * Token text is not copied; it is read from `source`, which must outlive
+ * the arrays.  Inputs are limited to 4 GiB.
+ */
+typedef struct {
+    const char *source;
+    size_t      count;
+    uint8_t    *types;       /* TokenType */
+    uint32_t   *offsets;     /* start of the token in source */
+    uint32_t   *lengths;     /* source bytes, string quotes included */
+    uint32_t   *lines;       /* 1-based */
+    TkNumber   *nums;        /* TOK_INT / TOK_FLOAT value, zero otherwise */
+    uint32_t   *line_starts; /* column = offsets[i] - line_starts[lines[i]-1] */
+    size_t      nlines;
+} TkTokens;
+
+/**
+ * Tokenize into *out (free with tk_free_soa).
+ * @return false if the source is too large for 32-bit offsets
+ */
+bool tk_tokenize_soa(const char *source, const char *filename, TkTokens *out);
+void tk_free_soa(TkTokens *t);
+
+/* cursor for walking a TkTokens; peeking past the end gives TOK_MAX */
+typedef struct {
+    const TkTokens *toks;
+    size_t          pos;
+} TkCursor;
+
+static inline TkCursor tk_cursor(const TkTokens *t) { TkCursor c = { t, 0 }; return c; }
+static inline bool tk_at_end(const TkCursor *c) { return c->pos >= c->toks->count; }
+static inline TokenType tk_peek(const TkCursor *c, size_t ahead) {
+    size_t i = c->pos + ahead;
+    return i < c->toks->count ? (TokenType)c->toks->types[i] : TOK_MAX;
+}
+static inline void tk_advance(TkCursor *c) { if (c->pos < c->toks->count) c->pos++; }
+/* advance past the current token if it has the given type */
+static inline bool tk_accept(TkCursor *c, TokenType type) {
+    if (tk_peek(c, 0) != type) return false;
+    c->pos++;
+    return true;
+}
+/* the token's value, as Token.value would hold it (string quotes dropped);
+ * not NUL-terminated */
+static inline const char *tk_text(const TkCursor *c, size_t *len) {
+    const TkTokens *t = c->toks;
+    const char *p = t->source + t->offsets[c->pos];
+    *len = t->lengths[c->pos];
+    if (t->types[c->pos] == TOK_STR) { p++; *len -= 2; }
+    return p;
+}
+static inline bool tk_text_is(const TkCursor *c, const char *text) {
+    size_t len, n = strlen(text);
+    const char *p = tk_text(c, &len);
+    return len == n && memcmp(p, text, n) == 0;
+}
+/* decoded value of the current TOK_INT / TOK_FLOAT, zero for other tokens */
+static inline TkNumber tk_number(const TkCursor *c) { return c->toks->nums[c->pos]; }
+static inline int tk_line(const TkCursor *c) { return (int)c->toks->lines[c->pos]; }
+static inline int tk_column(const TkCursor *c) {
+    const TkTokens *t = c->toks;
+    return (int)(t->offsets[c->pos] - t->line_starts[t->lines[c->pos] - 1]);
+}
+
+/**
+ * An edit for tk_retokenize: `removed` bytes of the old text at `start` were
+ * replaced by the `inserted` bytes now at `start` in the new text.
+ */
+typedef struct {
+    size_t start;
+    size_t removed;
+    size_t inserted;
+} TkEdit;
+
+/**
+ * Bring a token array up to date after an edit, for editors that re-lex on
+ * every keystroke.  Lexing restarts at the last token the edit cannot have
+ * affected and stops as soon as it produces a token where an old one started
+ * (in edit-shifted terms); the remaining old tokens are reused with line,
+ * column and offset adjusted in place.
+ * @param tokens   array from tk_tokenize/tk_retokenize for the old text
+ * @param count    in: old token count, out: new token count
+ * @param source   NUL-terminated text after the edit; an edit that does not
+ *                 fit in it (start or start + inserted past its end) makes
+ *                 this a full re-lex that reuses nothing
+ * @return         the updated array (may have moved)
+ */
+Token *tk_retokenize(Token *tokens, size_t *count, const char *source, const char *filename,
+                     TkEdit edit);
+
+/**
+ * Like tk_retokenize, but recovers from lexing errors as tk_tokenize_recover
+ * does.  Only the errors in the re-lexed stretch are appended to *diags; a
+ * TOK_ERROR kept from the old array was reported by the call that produced
+ * it and has moved with the edit like any other token.
+ */
+Token *tk_retokenize_recover(Token *tokens, size_t *count, const char *source,
+                             const char *filename, TkEdit edit, TkDiagnostics *diags);
+
+/**
+ * Same result as tk_tokenize, lexed on nthreads threads (<= 0: one per
+ * online CPU).  The input is cut at newlines, each slice is lexed on the
+ * assumption that it starts outside any comment or literal, and a sequential
+ * pass fixes up the slices where that was wrong.  Needs pthreads; define
+ * TK_NO_THREADS to leave it out (it is left out off POSIX anyway).
+ */
+Token *tk_tokenize_parallel(const char *source, const char *filename, size_t *out_count,
+                            int nthreads);
+
+/**
+ * tk_tokenize backed by an on-disk cache in cache_dir (which must exist).
+ * Entries are keyed by a hash of the source and of the keyword/operator
+ * lists and TK_VERSION_NUM, so any of those changing is a miss.  A hit maps
+ * the entry and builds the tokens without lexing; a miss lexes and writes
+ * the entry (best effort: an unwritable cache only costs the write).
+ * Define TK_NO_CACHE to leave it out (POSIX only, like the parallel lexer).
+ */
+Token *tk_tokenize_cached(const char *source, const char *filename, size_t *out_count,
+                          const char *cache_dir);
+/* same cache, SoA output (see tk_tokenize_soa) */
+bool tk_tokenize_soa_cached(const char *source, const char *filename, TkTokens *out,
+                            const char *cache_dir);
+
+/* ─── Streaming API ─────────────────────────────────────────────────────── */
+
+/**
+ * Input callback for the streaming lexer: fill at most cap bytes of buf.
+ * @return bytes written, 0 at end of input, TK_READ_ERROR if reading failed
+ *         (with errno set)
+ */
+typedef size_t (*TkReadFn)(void *user, char *buf, size_t cap);
+#define TK_READ_ERROR ((size_t)-1)
+
+/**
+ * Pull-based lexer that reads its input in chunks, so the source never has to
+ * be in memory at once.  Memory stays around TK_STREAM_CHUNK bytes, growing
+ * only for a single token (or comment) larger than that.
+ */
+typedef struct TkLexer TkLexer;
+
+TkLexer *tk_lexer_new(TkReadFn read, void *user, const char *filename);
+/* the FILE* / fd is not closed by tk_lexer_free */
+TkLexer *tk_lexer_from_file(FILE *f, const char *filename);
+TkLexer *tk_lexer_from_fd(int fd, const char *filename);
+
+/**
+ * Lex the next token into *out.
+ * @return 1 when a token was produced (free it with tk_free_token), 0 at end,
+ *         -1 when the input could not be read (see tk_lexer_error); loop
+ *         with `tk_next(lx, &t) > 0`
+ */
+int  tk_next(TkLexer *lx, Token *out);
+/* the errno of the read that made tk_next return -1, else 0 */
+int  tk_lexer_error(const TkLexer *lx);
+/* from now on record errors in *diags and return TOK_ERROR tokens */
+void tk_lexer_recover(TkLexer *lx, TkDiagnostics *diags);
+void tk_free_token(Token *t);
+void tk_lexer_free(TkLexer *lx);
+
 
 /* ─── Implementation (only when CREATE_TOKENIZER is defined) ────────────────── */
 
 #ifdef CREATE_TOKENIZER
 
+/* allocator hooks: define all three to route every allocation (including the
+ * token values and filenames that tk_free_tokens releases) elsewhere */
+#ifndef TK_MALLOC
+#define TK_MALLOC(n)     malloc(n)
+#define TK_REALLOC(p, n) realloc(p, n)
+#define TK_FREE(p)       free(p)
+#endif
+
+/* POSIX pieces stay in here so that only the implementation needs them.
+ * Elsewhere (MSVC, freestanding) tk_tokenize_parallel and the token cache
+ * are left out as if TK_NO_THREADS / TK_NO_CACHE were defined, and
+ * tk_lexer_from_fd reads with _read on Windows and is left out otherwise. */
+#if defined(__unix__) || defined(__APPLE__)
+#define TK_POSIX 1
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <io.h>
+#include <limits.h>
+#endif
+#if !defined(TK_POSIX) && !defined(TK_NO_THREADS)
+#define TK_NO_THREADS
+#endif
+#if !defined(TK_POSIX) && !defined(TK_NO_CACHE)
+#define TK_NO_CACHE
+#endif
+#ifndef TK_NO_THREADS
+#include <pthread.h>
+#endif
+#ifndef TK_NO_CACHE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* SSE2 is the x86-64 baseline; AVX2 is picked at runtime when the CPU has
+ * it.  Define TK_NO_SIMD to force the scalar scanners. */
+#if !defined(TK_NO_SIMD) && defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define TK_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* the one-time table setup (a state word claimed and published) and the
+ * cache's temp-file counter: GCC / Clang builtins, Interlocked functions on
+ * MSVC, C11 atomics elsewhere; TK_CPU_RELAX eases the spin of threads
+ * waiting for the builder */
+#if defined(__GNUC__) || defined(__clang__)
+typedef int TkAtomicInt;
+#define TK_INIT_LOAD(p)  __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TK_INIT_CLAIM(p) __atomic_compare_exchange_n((p), &(int){0}, 1, 0, \
+                                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define TK_INIT_DONE(p)  __atomic_store_n((p), 2, __ATOMIC_RELEASE)
+#define TK_ATOMIC_INC(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#if defined(__x86_64__) || defined(__i386__)
+#define TK_CPU_RELAX()   __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define TK_CPU_RELAX()   __asm__ __volatile__("yield")
+#endif
+#elif defined(_MSC_VER)
+#include <intrin.h>
+typedef volatile long TkAtomicInt;
+#define TK_INIT_LOAD(p)  _InterlockedOr((p), 0)
+#define TK_INIT_CLAIM(p) (_InterlockedCompareExchange((p), 1, 0) == 0)
+#define TK_INIT_DONE(p)  _InterlockedExchange((p), 2)
+#define TK_ATOMIC_INC(p) (_InterlockedIncrement(p) - 1)
+#if defined(_M_IX86) || defined(_M_X64)
+#define TK_CPU_RELAX()   _mm_pause()
+#elif defined(_M_ARM64) || defined(_M_ARM)
+#define TK_CPU_RELAX()   __yield()
+#endif
+#else
+#include <stdatomic.h>
+typedef atomic_int TkAtomicInt;
+#define TK_INIT_LOAD(p)  atomic_load_explicit((p), memory_order_acquire)
+#define TK_INIT_CLAIM(p) atomic_compare_exchange_strong((p), &(int){0}, 1)
+#define TK_INIT_DONE(p)  atomic_store_explicit((p), 2, memory_order_release)
+#define TK_ATOMIC_INC(p) atomic_fetch_add_explicit((p), 1, memory_order_relaxed)
+#endif
+#ifndef TK_CPU_RELAX
+#define TK_CPU_RELAX()   ((void)0)
+#endif
+
 /* internal dynamic array for tokens */
 typedef struct {
     Token *data;
@@ -60,13 +345,13 @@ typedef struct {
 
 static void tokens_init(TokenArray *a) {
     a->count = 0; a->cap = 16;
-    a->data = malloc(a->cap * sizeof(Token));
+    a->data = TK_MALLOC(a->cap * sizeof(Token));
 }
 
 static void tokens_push(TokenArray *a, Token t) {
     if (a->count == a->cap) {
         a->cap *= 2;
-        a->data = realloc(a->data, a->cap * sizeof(Token));
+        a->data = TK_REALLOC(a->data, a->cap * sizeof(Token));
     }
     a->data[a->count++] = t;
 }
@@ -77,213 +362,1481 @@ static void tokens_cleanup(TokenArray *a) {
         printf("%s:%i:%i: ", a->data[i].file, a->data[i].line, a->data[i].column);
         printf("freeing %i | %s\n", a->data[i].type, a->data[i].value);
         #endif
-        free(a->data[i].value);
-        free(a->data[i].file);
+        TK_FREE(a->data[i].value);
+        TK_FREE(a->data[i].file);
     }
-    free(a->data);
+    TK_FREE(a->data);
 }
 #ifndef TK_KEYWORDS_LIST
 #error "TK_KEYWORDS_LIST must be defined"
 #endif
 
+/* operators, matched longest-first; override like TK_KEYWORDS_LIST.
+ * Operators may not start with whitespace, a quote, '@', '#', a digit or an
+ * identifier character; those belong to other token kinds. */
+#ifndef TK_OPERATORS_LIST
+#define TK_OPERATORS_LIST {\
+  "==","!=","<=",">=","+=","-=","*=","/=","&&","||",\
+  "=","!","<",">","+","-","*","/","&","%","|"\
+}
+#endif
+#ifndef TK_OP_MAX_NODES
+#define TK_OP_MAX_NODES 256
+#endif
 
-/* keyword list */
+
+/* keyword list
+ *
+ * TK_KEYWORDS_LIST is a braced list of string literals, which C cannot take
+ * apart at compile time, so the table below is filled once, on first use,
+ * with no allocation.  A seed is searched so that every keyword owns its home
+ * slot (a perfect hash); lookups then hash the length and at most eight
+ * bytes of the identifier, and do a single compare.  Very large lists that
+ * defeat the seed search fall back to linear probing.
+ */
 static const char *KEYWORDS[] = TK_KEYWORDS_LIST;
 static const size_t NKEYWORDS = sizeof(KEYWORDS)/sizeof(*KEYWORDS);
-static int is_keyword(const char *s) {
-    for (size_t i = 0; i < NKEYWORDS; i++)
-        if (strcmp(s, KEYWORDS[i]) == 0) return 1;
-    return 0;
+
+#define TK_KW_COUNT  (sizeof(KEYWORDS)/sizeof(*KEYWORDS))
+#define TK_KW_SLOTS  (TK_KW_COUNT <= 16 ? 256 : TK_KW_COUNT <= 64 ? 4096 : \
+                      TK_KW_COUNT <= 256 ? 16384 : 65536)
+#define TK_KW_SEED_TRIES 256
+
+typedef char tk_kw_list_too_long[TK_KW_COUNT < TK_KW_SLOTS / 2 ? 1 : -1];
+
+static unsigned short tk_kw_slot[TK_KW_SLOTS]; /* keyword index + 1, 0 = empty */
+static size_t         tk_kw_len[TK_KW_COUNT];
+static unsigned       tk_kw_seed;
+static int            tk_kw_probe;             /* 1 when the seed search failed */
+static TkAtomicInt     tk_tables_state;         /* 0 = empty, 1 = building, 2 = ready */
+
+/* character classes: the low nibble picks the lexer branch, the high bits
+ * answer the "is this part of a run" questions inside the branches */
+enum {
+    TK_CC_OTHER, TK_CC_SPACE, TK_CC_NEWLINE, TK_CC_AT, TK_CC_HASH, TK_CC_SLASH,
+    TK_CC_DOT, TK_CC_QUOTE, TK_CC_DQUOTE, TK_CC_MINUS, TK_CC_DIGIT,
+    TK_CC_IDENT, TK_CC_OP, TK_CC_PUNCT,
+    TK_CC_MASK  = 0x0f,
+    TK_CF_WS    = 0x10, /* ' ', '\t', '\n': ends an @attr */
+    TK_CF_IDENT = 0x20, /* [A-Za-z0-9_] */
+    TK_CF_DIGIT = 0x40, /* [0-9] */
+    TK_CF_PUNCT = 0x80  /* ().,{}:;[] */
+};
+static unsigned char tk_cclass[256];
+
+/* operator trie over the (at most 32) punctuation characters */
+static const char *OPERATORS[] = TK_OPERATORS_LIST;
+static const size_t NOPERATORS = sizeof(OPERATORS)/sizeof(*OPERATORS);
+typedef struct {
+    unsigned short child[32]; /* node index, 0 = none */
+    unsigned short op;        /* operator length, 0 = not terminal */
+} TkOpNode;
+static TkOpNode      tk_op_nodes[TK_OP_MAX_NODES];
+static unsigned      tk_op_count = 1; /* node 0 is the root */
+static unsigned char tk_op_sym[256];  /* symbol index + 1, 0 = not in any operator */
+static size_t        tk_lookahead = 3; /* bytes a decision may peek past a token: "...", longest operator */
+
+static unsigned kw_hash(const char *s, size_t len, unsigned seed) {
+    const unsigned char *p = (const unsigned char *)s;
+    unsigned h = seed ^ (unsigned)len * 0x9E3779B1u;
+    /* at most 8 bytes: the first four and the last four */
+    size_t head = len < 4 ? len : 4;
+    size_t tail = len - head < 4 ? len - head : 4;
+    for (size_t i = 0; i < head; i++) h = (h ^ p[i]) * 0x01000193u;
+    for (size_t i = len - tail; i < len; i++) h = (h ^ p[i]) * 0x01000193u;
+    h ^= h >> 15;
+    return h & (TK_KW_SLOTS - 1);
+}
+
+static int kw_place(unsigned seed, int probe) {
+    memset(tk_kw_slot, 0, sizeof tk_kw_slot);
+    for (size_t i = 0; i < NKEYWORDS; i++) {
+        unsigned h = kw_hash(KEYWORDS[i], tk_kw_len[i], seed);
+        while (tk_kw_slot[h]) {
+            if (!probe) return 0;
+            h = (h + 1) & (TK_KW_SLOTS - 1);
+        }
+        tk_kw_slot[h] = (unsigned short)(i + 1);
+    }
+    return 1;
+}
+
+static void build_cclass(void) {
+    for (int c = 'a'; c <= 'z'; c++) tk_cclass[c] = TK_CC_IDENT | TK_CF_IDENT;
+    for (int c = 'A'; c <= 'Z'; c++) tk_cclass[c] = TK_CC_IDENT | TK_CF_IDENT;
+    for (int c = '0'; c <= '9'; c++) tk_cclass[c] = TK_CC_DIGIT | TK_CF_IDENT | TK_CF_DIGIT;
+    tk_cclass['_']  = TK_CC_IDENT | TK_CF_IDENT;
+    tk_cclass[' ']  = TK_CC_SPACE | TK_CF_WS;
+    tk_cclass['\t'] = TK_CC_SPACE | TK_CF_WS;
+    tk_cclass['\n'] = TK_CC_NEWLINE | TK_CF_WS;
+    tk_cclass['@']  = TK_CC_AT;
+    tk_cclass['#']  = TK_CC_HASH;
+    tk_cclass['\''] = TK_CC_QUOTE;
+    tk_cclass['"']  = TK_CC_DQUOTE;
+    for (const char *p = "().,{}:;[]"; *p; p++)
+        tk_cclass[(unsigned char)*p] = TK_CC_PUNCT | TK_CF_PUNCT;
+    tk_cclass['.']  = TK_CC_DOT | TK_CF_PUNCT;
+    /* '/' and '-' are checked for comments and negative literals first and
+     * then fall back to the operator branch */
+    tk_cclass['/']  = TK_CC_SLASH;
+    tk_cclass['-']  = TK_CC_MINUS;
+}
+
+static void op_error(const char *op, const char *msg) {
+    fprintf(stderr, "TK_OPERATORS_LIST: operator \"%s\": %s\n", op, msg);
+    exit(1);
+}
+
+static void build_op_trie(void) {
+    unsigned nsyms = 0;
+    for (size_t i = 0; i < NOPERATORS; i++) {
+        const unsigned char *op = (const unsigned char *)OPERATORS[i];
+        if (!op[0]) op_error(OPERATORS[i], "empty operator");
+        unsigned cls = tk_cclass[op[0]] & TK_CC_MASK;
+        if (cls != TK_CC_OTHER && cls != TK_CC_OP && cls != TK_CC_PUNCT &&
+            cls != TK_CC_DOT && cls != TK_CC_SLASH && cls != TK_CC_MINUS)
+            op_error(OPERATORS[i], "cannot start with this character");
+        if (cls == TK_CC_OTHER || cls == TK_CC_PUNCT)
+            tk_cclass[op[0]] = (unsigned char)(TK_CC_OP | (tk_cclass[op[0]] & ~TK_CC_MASK));
+
+        unsigned node = 0;
+        for (size_t j = 0; op[j]; j++) {
+            if (!tk_op_sym[op[j]]) {
+                if (nsyms == 32) op_error(OPERATORS[i], "more than 32 distinct operator characters");
+                tk_op_sym[op[j]] = (unsigned char)++nsyms;
+            }
+            unsigned sym = tk_op_sym[op[j]] - 1;
+            if (!tk_op_nodes[node].child[sym]) {
+                if (tk_op_count == TK_OP_MAX_NODES) op_error(OPERATORS[i], "raise TK_OP_MAX_NODES");
+                tk_op_nodes[node].child[sym] = (unsigned short)tk_op_count++;
+            }
+            node = tk_op_nodes[node].child[sym];
+        }
+        tk_op_nodes[node].op = (unsigned short)strlen(OPERATORS[i]);
+        if (tk_op_nodes[node].op > tk_lookahead) tk_lookahead = tk_op_nodes[node].op;
+    }
+}
+
+/* length of the longest operator at s, 0 if none */
+static size_t match_op(const char *s, size_t avail) {
+    unsigned node = 0;
+    size_t best = 0;
+    for (size_t i = 0; i < avail; i++) {
+        unsigned sym = tk_op_sym[(unsigned char)s[i]];
+        if (!sym || !(node = tk_op_nodes[node].child[sym - 1])) break;
+        if (tk_op_nodes[node].op) best = tk_op_nodes[node].op;
+    }
+    return best;
+}
+
+/* bulk scanners
+ *
+ * Runs of blanks, comment and string bodies, @attr/#directive bodies and
+ * identifier tails are skipped with these instead of one byte per loop
+ * iteration.  Each returns the index of the first byte that stops the run,
+ * or len; callers add the distance to col themselves.  Nothing is read at or
+ * past len.
+ */
+static size_t find3_scalar(const char *s, size_t i, size_t len, char a, char b, char c) {
+    for (; i < len; i++) if (s[i]==a || s[i]==b || s[i]==c) return i;
+    return len;
+}
+static size_t skip_blank_scalar(const char *s, size_t i, size_t len) {
+    while (i < len && (s[i]==' ' || s[i]=='\t')) i++;
+    return i;
+}
+static size_t span_ident_scalar(const char *s, size_t i, size_t len) {
+    while (i < len && (tk_cclass[(unsigned char)s[i]] & TK_CF_IDENT)) i++;
+    return i;
+}
+
+#ifdef TK_SIMD
+static size_t find3_sse2(const char *s, size_t i, size_t len, char a, char b, char c) {
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                                 _mm_cmpeq_epi8(v, vc));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return find3_scalar(s, i, len, a, b, c);
+}
+static size_t skip_blank_sse2(const char *s, size_t i, size_t len) {
+    const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab));
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(m) & 0xffffu;
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return skip_blank_scalar(s, i, len);
+}
+/* [A-Za-z0-9_]: unsigned range checks done as signed compares after a
+ * 0x80 bias, since SSE2 has no unsigned byte compare */
+static size_t span_ident_sse2(const char *s, size_t i, size_t len) {
+    const __m128i bias = _mm_set1_epi8((char)0x80), lcase = _mm_set1_epi8(0x20);
+    const __m128i a = _mm_set1_epi8('a'), zero = _mm_set1_epi8('0'), us = _mm_set1_epi8('_');
+    const __m128i lim26 = _mm_set1_epi8(-128 + 26), lim10 = _mm_set1_epi8(-128 + 10);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i al = _mm_xor_si128(_mm_sub_epi8(_mm_or_si128(v, lcase), a), bias);
+        __m128i dg = _mm_xor_si128(_mm_sub_epi8(v, zero), bias);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(al, lim26), _mm_cmplt_epi8(dg, lim10)),
+                                 _mm_cmpeq_epi8(v, us));
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(m) & 0xffffu;
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return span_ident_scalar(s, i, len);
+}
+
+__attribute__((target("avx2")))
+static size_t find3_avx2(const char *s, size_t i, size_t len, char a, char b, char c) {
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), vc = _mm256_set1_epi8(c);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                                    _mm256_cmpeq_epi8(v, vc));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return find3_sse2(s, i, len, a, b, c);
+}
+__attribute__((target("avx2")))
+static size_t skip_blank_avx2(const char *s, size_t i, size_t len) {
+    const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(m);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return skip_blank_sse2(s, i, len);
+}
+__attribute__((target("avx2")))
+static size_t span_ident_avx2(const char *s, size_t i, size_t len) {
+    const __m256i bias = _mm256_set1_epi8((char)0x80), lcase = _mm256_set1_epi8(0x20);
+    const __m256i a = _mm256_set1_epi8('a'), zero = _mm256_set1_epi8('0'), us = _mm256_set1_epi8('_');
+    const __m256i lim26 = _mm256_set1_epi8(-128 + 26), lim10 = _mm256_set1_epi8(-128 + 10);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i al = _mm256_xor_si256(_mm256_sub_epi8(_mm256_or_si256(v, lcase), a), bias);
+        __m256i dg = _mm256_xor_si256(_mm256_sub_epi8(v, zero), bias);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi8(lim26, al), _mm256_cmpgt_epi8(lim10, dg)),
+                                    _mm256_cmpeq_epi8(v, us));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(m);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return span_ident_sse2(s, i, len);
+}
+#endif /* TK_SIMD */
+
+static size_t (*find3)(const char *, size_t, size_t, char, char, char) = find3_scalar;
+static size_t (*skip_blank)(const char *, size_t, size_t) = skip_blank_scalar;
+static size_t (*span_ident)(const char *, size_t, size_t) = span_ident_scalar;
+
+static void pick_scanners(void) {
+#ifdef TK_SIMD
+    find3 = find3_sse2; skip_blank = skip_blank_sse2; span_ident = span_ident_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find3 = find3_avx2; skip_blank = skip_blank_avx2; span_ident = span_ident_avx2;
+    }
+#endif
+}
+
+static void build_tables(void) {
+    for (size_t i = 0; i < NKEYWORDS; i++) {
+        tk_kw_len[i] = strlen(KEYWORDS[i]);
+        if (!tk_kw_len[i]) {
+            fprintf(stderr, "TK_KEYWORDS_LIST: empty keyword at index %zu\n", i);
+            exit(1);
+        }
+    }
+    build_cclass();
+    build_op_trie();
+    pick_scanners();
+    for (unsigned seed = 0; seed < TK_KW_SEED_TRIES; seed++)
+        if (kw_place(seed * 0x85EBCA6Bu, 0)) { tk_kw_seed = seed * 0x85EBCA6Bu; return; }
+    tk_kw_probe = 1;
+    tk_kw_seed = 0;
+    kw_place(0, 1);
+}
+
+/* one-time table setup, safe to race from several threads */
+static void init_tables(void) {
+    if (TK_INIT_LOAD(&tk_tables_state) == 2) return;
+    if (TK_INIT_CLAIM(&tk_tables_state)) {
+        build_tables();
+        TK_INIT_DONE(&tk_tables_state);
+        return;
+    }
+    while (TK_INIT_LOAD(&tk_tables_state) != 2) TK_CPU_RELAX();
+}
+
+/* s need not be NUL-terminated; tables must be initialised */
+static int is_keyword(const char *s, size_t len) {
+    unsigned h = kw_hash(s, len, tk_kw_seed);
+    for (;;) {
+        unsigned k = tk_kw_slot[h];
+        if (!k) return 0;
+        k--;
+        if (tk_kw_len[k] == len && memcmp(s, KEYWORDS[k], len) == 0) return 1;
+        if (!tk_kw_probe) return 0;
+        h = (h + 1) & (TK_KW_SLOTS - 1);
+    }
 }
 
 /* helpers */
 static char *dup_range(const char *p, size_t len) {
-    char *r = malloc(len+1);
+    char *r = TK_MALLOC(len+1);
     memcpy(r, p, len);
     r[len] = 0;
     return r;
 }
-static void lex_error(int line, int col, const char *line_text, const char *msg) {
+static char *tk_strdup(const char *s) {
+    return dup_range(s, strlen(s));
+}
+static void lex_error(int line, int col, const char *line_text, int line_len, const char *msg) {
     fprintf(stderr,
-        "Tokenization error at line %d, column %d:\n%s\n%*s^\n%s\n",
-        line, col, line_text, col, "", msg);
+        "Tokenization error at line %d, column %d:\n%.*s\n%*s^\n%s\n",
+        line, col, line_len, line_text, col, "", msg);
     exit(1);
 }
 
-/* the real workhorse */
-Token *tk_tokenize(const char *source, const char *filename, size_t *out_count) {
-    TokenArray toks; tokens_init(&toks);
+/* scanner state: a window onto the input.  tk_tokenize hands it the whole
+ * source with eof set; the streaming lexer slides it along its read buffer.
+ * Offsets named "absolute" count from the start of the input. */
+typedef struct {
+    const char *src;        /* window */
+    size_t      len;        /* bytes in the window */
+    size_t      idx;        /* cursor, relative to src */
+    size_t      base;       /* absolute offset of src[0] */
+    size_t      line_start; /* absolute offset of the current line */
+    size_t      stop;       /* report TK_LEX_END at the first item starting here or later */
+    size_t      tok_end;    /* absolute end of the last token returned */
+    bool        no_copy;    /* leave Token.value/file NULL (SoA output) */
+    TkDiagnostics *diags;   /* recover from errors into this, else fail */
+    int         line, col;
+    bool        eof;        /* nothing follows src[len-1] */
+    const char *filename;
+    /* filled in when lex_one returns TK_LEX_ERROR */
+    int         err_line, err_col;
+    size_t      err_line_start;
+    char        err_msg[48];
+} TkScan;
+
+enum { TK_LEX_END, TK_LEX_TOKEN, TK_LEX_MORE, TK_LEX_ERROR };
+
+static void scan_init(TkScan *s, const char *src, size_t len, const char *filename, bool eof) {
+    memset(s, 0, sizeof *s);
+    s->src = src; s->len = len;
+    s->stop = (size_t)-1;
+    s->line = 1;
+    s->eof = eof;
+    s->filename = filename;
+}
+
+/* prints the diagnostic for a TK_LEX_ERROR and exits */
+static void scan_fail(const TkScan *s) {
+    size_t ls = s->err_line_start > s->base ? s->err_line_start - s->base : 0;
+    const char *e = memchr(s->src + ls, '\n', s->len - ls);
+    size_t ll = e ? (size_t)(e - (s->src + ls)) : s->len - ls;
+    lex_error(s->err_line, s->err_col, s->src + ls, (int)ll, s->err_msg);
+}
+
+static void diag_push(TkDiagnostics *d, const TkScan *s, size_t offset) {
+    if (d->count == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 8;
+        d->items = TK_REALLOC(d->items, d->cap * sizeof *d->items);
+    }
+    TkDiagnostic *g = &d->items[d->count++];
+    g->file   = tk_strdup(s->filename);
+    g->line   = s->err_line;
+    g->column = s->err_col;
+    g->offset = offset;
+    memcpy(g->message, s->err_msg, sizeof g->message);
+}
+
+/* ─── Numeric literals ───────────────────────────────────────────────────── */
+
+enum { TK_NUM_OK, TK_NUM_NODIGITS, TK_NUM_SUFFIX, TK_NUM_INT_RANGE, TK_NUM_FLOAT_RANGE };
+
+static const char *const tk_num_errors[] = {
+    [TK_NUM_NODIGITS]    = "Missing digits in number",
+    [TK_NUM_SUFFIX]      = "Invalid suffix on number",
+    [TK_NUM_INT_RANGE]   = "Integer literal out of range",
+    [TK_NUM_FLOAT_RANGE] = "Float literal out of range",
+};
+
+/* powers of ten that are exact in a double */
+static const double tk_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int digit_value(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 99;
+}
+
+/* decode the literal in p[0..avail) (p is past any '-').  Forms are
+ * 0x1F, 0b101, 123, 1.5, 1e9, 1.5e-3; hex and binary take any 64-bit
+ * pattern, decimal integers must fit an int64_t.  *used is how far the
+ * literal reaches, or where a bad digit or suffix sits. */
+static int scan_number(const char *p, size_t avail, bool neg, size_t *used,
+                       TokenType *type, TkNumber *num) {
+    size_t i = 0;
+    uint64_t acc = 0;
+    *type = TOK_INT;
+
+    if (avail > 1 && p[0]=='0' && ((p[1]|0x20)=='x' || (p[1]|0x20)=='b')) {
+        const int shift = (p[1]|0x20)=='x' ? 4 : 1;
+        bool over = false;
+        int d;
+        for (i = 2; i < avail && (d = digit_value((unsigned char)p[i])) < (1<<shift); i++) {
+            if (acc >> (64-shift)) over = true;
+            acc = acc << shift | (uint64_t)d;
+        }
+        *used = i;
+        if (i == 2) return TK_NUM_NODIGITS;
+        if (i < avail && (tk_cclass[(unsigned char)p[i]] & TK_CF_IDENT)) return TK_NUM_SUFFIX;
+        if (over) return TK_NUM_INT_RANGE;
+        num->i = (int64_t)(neg ? 0-acc : acc);
+        return TK_NUM_OK;
+    }
+
+    /* decimal: keep up to 19 significant digits exactly, count the rest */
+    int sig = 0, exp10 = 0;
+    bool inexact = false;
+    for (; i < avail && (tk_cclass[(unsigned char)p[i]] & TK_CF_DIGIT); i++) {
+        if (sig < 19) { acc = acc*10 + (uint64_t)(p[i]-'0'); sig += acc != 0; }
+        else { exp10++; inexact |= p[i] != '0'; }
+    }
+    if (i+1 < avail && p[i]=='.' && (tk_cclass[(unsigned char)p[i+1]] & TK_CF_DIGIT)) {
+        *type = TOK_FLOAT;
+        for (i++; i < avail && (tk_cclass[(unsigned char)p[i]] & TK_CF_DIGIT); i++) {
+            if (sig < 19) { acc = acc*10 + (uint64_t)(p[i]-'0'); sig += acc != 0; exp10--; }
+            else inexact |= p[i] != '0';
+        }
+    }
+    if (i < avail && (p[i]|0x20)=='e') {
+        size_t j = i+1;
+        bool eneg = false;
+        if (j < avail && (p[j]=='+' || p[j]=='-')) eneg = p[j++]=='-';
+        if (j < avail && (tk_cclass[(unsigned char)p[j]] & TK_CF_DIGIT)) {
+            int e = 0;
+            for (; j < avail && (tk_cclass[(unsigned char)p[j]] & TK_CF_DIGIT); j++)
+                if (e < 100000) e = e*10 + (p[j]-'0');
+            exp10 += eneg ? -e : e;
+            *type = TOK_FLOAT;
+            i = j;
+        }
+    }
+    *used = i;
+    if (i < avail && (tk_cclass[(unsigned char)p[i]] & TK_CF_IDENT)) return TK_NUM_SUFFIX;
+
+    if (*type == TOK_INT) {
+        /* more than 19 significant digits never fits */
+        if (exp10 || acc > (uint64_t)INT64_MAX + neg) return TK_NUM_INT_RANGE;
+        num->i = (int64_t)(neg ? 0-acc : acc);
+        return TK_NUM_OK;
+    }
+
+    /* Clinger's fast path: both operands exact, so one rounding */
+    double d;
+    if (!inexact && acc <= (1ull<<53) && exp10 >= -22 && exp10 <= 22) {
+        d = exp10 < 0 ? (double)acc / tk_pow10[-exp10] : (double)acc * tk_pow10[exp10];
+    } else {
+        char small[64], *buf = i < sizeof small ? small : TK_MALLOC(i+1);
+        memcpy(buf, p, i);
+        buf[i] = 0;
+        d = strtod(buf, NULL);
+        if (buf != small) TK_FREE(buf);
+    }
+    if (d > DBL_MAX) return TK_NUM_FLOAT_RANGE;
+    num->f = neg ? -d : d;
+    return TK_NUM_OK;
+}
+
+#define LEX_FAIL(l, c, ls, ...) do { \
+        snprintf(s->err_msg, sizeof s->err_msg, __VA_ARGS__); \
+        s->err_line = (l); s->err_col = (c); s->err_line_start = (ls); \
+        goto error; \
+    } while (0)
 
-    size_t idx = 0, len = strlen(source);
-    int line = 1, col = 0;
-    const char *line_start = source;
+/* the real workhorse: lexes up to the next token.
+ *
+ * Whitespace and comments are consumed on the way.  When the window is not
+ * the end of the input, anything that ends within tk_lookahead bytes of the
+ * window's end is left alone and TK_LEX_MORE is returned, so a token is only
+ * ever produced from bytes that more input could not change.
+ */
+static int lex_one(TkScan *s, Token *out) {
+    const char *source = s->src;
+    const size_t len = s->len;
+    const size_t look = s->eof ? 0 : tk_lookahead;
+
+    for (;;) {
+        size_t idx = s->idx, line_start = s->line_start, n;
+        int line = s->line, col = s->col;
+        if (idx >= len) return s->eof ? TK_LEX_END : TK_LEX_MORE;
+        if (s->base + idx >= s->stop) return TK_LEX_END;
+        if (look && idx + look >= len) return TK_LEX_MORE;
 
-    while (idx < len) {
-        char c = source[idx];
-        int col0 = col;
+        unsigned char c = (unsigned char)source[idx];
+        const int line0 = line, col0 = col;
+        const size_t st = idx;
+        size_t vst = idx, vlen;
+        TokenType type;
+        TkNumber num = { 0 };
+        int err;
 
+        switch (tk_cclass[c] & TK_CC_MASK) {
         /* skip spaces/tabs */
-        if (c==' '||c=='\t') { idx++; col++; continue; }
+        case TK_CC_SPACE:
+            n = skip_blank(source, idx+1, len);
+            col += (int)(n-idx); idx = n;
+            goto skipped;
         /* newline */
-        if (c=='\n') { line++; col=0; idx++; line_start = source+idx; continue; }
+        case TK_CC_NEWLINE: line++; col=0; idx++; line_start = s->base+idx; goto skipped;
 
         /* ATTR: @foo */
-        if (c=='@') {
-            size_t st = idx++;
-            col++;
-            while (idx<len && !strchr(" \t\n", source[idx])) { idx++; col++; }
-            Token t = { TOK_ATTR, dup_range(source+st, idx-st), line, col0, strdup(filename) };
-            tokens_push(&toks, t);
-            continue;
-        }
+        case TK_CC_AT:
+            n = find3(source, idx+1, len, ' ', '\t', '\n');
+            col += (int)(n-idx); idx = n;
+            type = TOK_ATTR; vlen = idx-vst;
+            goto emit;
 
         /* PP_DIRECTIVE: #... */
-        if (c=='#') {
-            size_t st = idx;
-            while (idx<len && source[idx] != '\n') { idx++; col++; }
-            Token t = { TOK_PP, dup_range(source+st, idx-st), line, col0, strdup(filename) };
-            tokens_push(&toks, t);
-            continue;
-        }
+        case TK_CC_HASH:
+            n = find3(source, idx, len, '\n', '\n', '\n');
+            col += (int)(n-idx); idx = n;
+            type = TOK_PP; vlen = idx-vst;
+            goto emit;
 
         /* comments */
-        if (c=='/' && idx+1 < len) {
-            if (source[idx+1]=='/') {
-                while (idx<len && source[idx]!='\n') idx++;
-                continue;
+        case TK_CC_SLASH:
+            if (idx+1 < len && source[idx+1]=='/') {
+                idx = find3(source, idx+2, len, '\n', '\n', '\n');
+                goto skipped;
             }
-            if (source[idx+1]=='*') {
-                int sl=line, sc=col;
+            if (idx+1 < len && source[idx+1]=='*') {
+                size_t sls = line_start;
                 idx+=2; col+=2;
-                while (idx+1<len && !(source[idx]=='*'&&source[idx+1]=='/')) {
-                    if (source[idx]=='\n') { line++; col=0; }
-                    else col++;
-                    idx++;
-                }
-                if (idx+1>=len) {
-                    size_t lsize = strcspn(line_start, "\n");
-                    char *lt = dup_range(line_start, lsize);
-                    lex_error(sl, sc, lt, "unterminated multiline comment");
+                for (;;) {
+                    n = find3(source, idx, len, '*', '\n', '\n');
+                    col += (int)(n-idx); idx = n;
+                    if (idx+1 >= len) break;
+                    if (source[idx]=='\n') { line++; col=0; idx++; line_start = s->base+idx; continue; }
+                    if (source[idx+1]=='/') break;
+                    idx++; col++;
                 }
+                if (idx+1>=len)
+                    LEX_FAIL(line0, col0, sls, "unterminated multiline comment");
                 idx+=2; col+=2;
-                continue;
+                goto skipped;
             }
-        }
+            goto lex_op;
 
         /* ellipsis */
-        if (idx+2<len && source[idx]=='.'&&source[idx+1]=='.'&&source[idx+2]=='.') {
-            Token t = { TOK_ELLIPSIS, strdup("..."), line, col0, strdup(filename) };
-            tokens_push(&toks, t);
-            idx+=3; col+=3;
-            continue;
-        }
+        case TK_CC_DOT:
+            if (idx+2<len && source[idx+1]=='.'&&source[idx+2]=='.') {
+                idx+=3; col+=3;
+                type = TOK_ELLIPSIS; vlen = 3;
+                goto emit;
+            }
+            goto lex_op;
 
         /* char literal */
-        if (c=='\'') {
-            size_t st = idx++;
-            col++;
-            if (idx>=len) lex_error(line, col0, dup_range(line_start,strcspn(line_start,"\n")), "Unterminated character literal");
+        case TK_CC_QUOTE:
+            idx++; col++;
+            if (idx>=len) LEX_FAIL(line, col0, line_start, "Unterminated character literal");
             if (source[idx]=='\\' && idx+1<len) { idx+=2; col+=2; }
             else { idx++; col++; }
             if (idx>=len || source[idx]!='\'')
-                lex_error(line, col0, dup_range(line_start,strcspn(line_start,"\n")), "Unterminated character literal");
+                LEX_FAIL(line, col0, line_start, "Unterminated character literal");
             idx++; col++;
-            Token t = { TOK_CHAR, dup_range(source+st, idx-st), line, col0, strdup(filename) };
-            tokens_push(&toks, t);
-            continue;
-        }
+            type = TOK_CHAR; vlen = idx-vst;
+            goto emit;
 
         /* string literal */
-        if (c=='"') {
-            size_t st = idx++;
-            col++;
-            while (idx<len && source[idx]!='"') {
-                if (source[idx]=='\\' && idx+1<len) { idx+=2; col+=2; }
+        case TK_CC_DQUOTE:
+            idx++; col++;
+            for (;;) {
+                n = find3(source, idx, len, '"', '\\', '\\');
+                col += (int)(n-idx); idx = n;
+                if (idx>=len || source[idx]=='"') break;
+                if (idx+1<len) { idx+=2; col+=2; }
                 else { idx++; col++; }
             }
-            if (idx<len && source[idx]=='"') {
-                size_t sl = idx-(st+1);
-                idx++; col++;
-                Token t = { TOK_STR, dup_range(source+st+1, sl), line, col0, strdup(filename) };
-                tokens_push(&toks, t);
-            } else
-                lex_error(line, col0, dup_range(line_start,strcspn(line_start,"\n")), "Unterminated string literal");
-            continue;
-        }
+            if (idx>=len)
+                LEX_FAIL(line, col0, line_start, "Unterminated string literal");
+            vst++; vlen = idx-vst;
+            idx++; col++;
+            type = TOK_STR;
+            goto emit;
+
+        /* negative number / negative identifier, else an operator */
+        case TK_CC_MINUS:
+            if (idx+1<len) {
+                unsigned char nc = (unsigned char)source[idx+1];
+                if (tk_cclass[nc] & TK_CF_DIGIT) goto lex_number;
+                if ((tk_cclass[nc] & TK_CC_MASK) == TK_CC_IDENT) goto lex_ident;
+            }
+            goto lex_op;
 
         /* number (incl negative) */
-        if ((c=='-'&&idx+1<len&&isdigit(source[idx+1]))||isdigit(c)) {
-            bool isFloat = false;
-            size_t st = idx;
+        case TK_CC_DIGIT:
+        lex_number:
+            if (c=='-') { idx++; col++; }
+            err = scan_number(source+idx, len-idx, c=='-', &n, &type, &num);
+            idx += n; col += (int)n;
+            if (err == TK_NUM_INT_RANGE || err == TK_NUM_FLOAT_RANGE)
+                LEX_FAIL(line, col0, line_start, "%s", tk_num_errors[err]);
+            if (err)
+                LEX_FAIL(line, col, line_start, "%s", tk_num_errors[err]);
+            vlen = idx-vst;
+            goto emit;
+
+        /* identifier/keyword (or negative-id) */
+        case TK_CC_IDENT:
+        lex_ident:
             if (c=='-') { idx++; col++; }
-            while (idx<len && isdigit(source[idx])) { idx++; col++; }
-            if (idx<len && source[idx]=='.'&&idx+1<len&&isdigit(source[idx+1])) {
+            n = span_ident(source, idx, len);
+            col += (int)(n-idx); idx = n;
+            vlen = idx-vst;
+            type = is_keyword(source+vst, vlen) ? TOK_KEYWORD : TOK_ID;
+            goto emit;
+
+        /* operators (longest match), then punctuation */
+        case TK_CC_OP:
+        case TK_CC_PUNCT:
+        lex_op:
+            if ((n = match_op(source+idx, len-idx))) {
+                idx+=n; col+=(int)n;
+                type = TOK_OP; vlen = n;
+                goto emit;
+            }
+            if (tk_cclass[c] & TK_CF_PUNCT) {
                 idx++; col++;
-                isFloat = true;
-                while (idx<len && isdigit(source[idx])) { idx++; col++; }
+                type = TOK_PUNCT; vlen = 1;
+                goto emit;
             }
-            TokenType type = isFloat ?  TOK_FLOAT : TOK_INT;
-            Token t = { type, dup_range(source+st, idx-st), line, col0, strdup(filename) };
-            tokens_push(&toks, t);
-            continue;
+            /* fall through */
+
+        /* unknown */
+        default:
+            LEX_FAIL(line, col, line_start, "Unknown character '%c'", c);
         }
 
-        /* identifier/keyword (or negative-id) */
-        if (isalpha(c)||c=='_'||(c=='-'&&idx+1<len&&(isalpha(source[idx+1])||source[idx+1]=='_'))) {
-            size_t st = idx;
-            if (c=='-') { idx++; col++; }
-            while (idx<len&&(isalnum(source[idx])||source[idx]=='_')) { idx++; col++; }
-            size_t vl = idx-st;
-            char *v = dup_range(source+st, vl);
-            if (is_keyword(v)) {
-                Token t = { TOK_KEYWORD, v, line, col0, strdup(filename) };
-                tokens_push(&toks, t);
-            } else {
-                Token t = { TOK_ID, v, line, col0, strdup(filename) };
-                tokens_push(&toks, t);
+    skipped:
+        if (look && idx + look >= len) return TK_LEX_MORE;
+        s->idx = idx; s->line = line; s->col = col; s->line_start = line_start;
+        continue;
+
+    emit:
+        if (look && idx + look >= len) return TK_LEX_MORE;
+        out->type   = type;
+        out->line   = line0;
+        out->column = col0;
+        out->offset = s->base + st;
+        out->num    = num;
+        if (s->no_copy) {
+            out->value = NULL;
+            out->file  = NULL;
+        } else {
+            out->value = dup_range(source+vst, vlen);
+            out->file  = tk_strdup(s->filename);
+        }
+        s->tok_end = s->base + idx;
+        s->idx = idx; s->line = line; s->col = col; s->line_start = line_start;
+        return TK_LEX_TOKEN;
+
+    error:
+        /* a construct cut off by the end of the window may still complete */
+        if (look && idx + look >= len) return TK_LEX_MORE;
+        if (!s->diags) { s->idx = idx; return TK_LEX_ERROR; }
+
+        /* recovering: the bad text becomes a TOK_ERROR.  An open comment
+         * swallows the rest of the input, an unfinished literal the rest of
+         * its line, a bad number the rest of the word, anything else the
+         * one byte. */
+        if (c == '/' && st+1 < len && source[st+1] == '*') {
+            n = len;
+            col += (int)(n-idx);
+        } else {
+            if (c == '"' || c == '\'') n = find3(source, st+1, len, '\n', '\n', '\n');
+            else if (c == '-' || (tk_cclass[c] & TK_CF_DIGIT)) n = span_ident(source, idx, len);
+            else n = st;
+            if (n == st) n++;
+            if (look && n + look >= len) return TK_LEX_MORE;
+            col = col0 + (int)(n-st);
+        }
+        diag_push(s->diags, s, s->base + st);
+        idx = n;
+        type = TOK_ERROR; vst = st; vlen = n-st;
+        goto emit;
+    }
+}
+#undef LEX_FAIL
+
+static Token *tokenize(const char *source, const char *filename, size_t *out_count,
+                       TkDiagnostics *diags) {
+    TokenArray toks; tokens_init(&toks);
+    init_tables();
+
+    TkScan s;
+    scan_init(&s, source, strlen(source), filename, true);
+    s.diags = diags;
+    Token t;
+    int st;
+    while ((st = lex_one(&s, &t)) == TK_LEX_TOKEN) tokens_push(&toks, t);
+    if (st == TK_LEX_ERROR) scan_fail(&s);
+
+    *out_count = toks.count;
+    return toks.data;
+}
+
+Token *tk_tokenize(const char *source, const char *filename, size_t *out_count) {
+    return tokenize(source, filename, out_count, NULL);
+}
+
+Token *tk_tokenize_recover(const char *source, const char *filename, size_t *out_count,
+                           TkDiagnostics *diags) {
+    return tokenize(source, filename, out_count, diags);
+}
+
+void tk_free_diagnostics(TkDiagnostics *diags) {
+    for (size_t i = 0; i < diags->count; i++) TK_FREE(diags->items[i].file);
+    TK_FREE(diags->items);
+    memset(diags, 0, sizeof *diags);
+}
+
+/* ─── Structure-of-arrays output ────────────────────────────────────────── */
+
+bool tk_tokenize_soa(const char *source, const char *filename, TkTokens *out) {
+    memset(out, 0, sizeof *out);
+    size_t len = strlen(source);
+    if (len > UINT32_MAX) return false;
+    init_tables();
+
+    size_t cap = 64, lcap = 64;
+    out->source      = source;
+    out->types       = TK_MALLOC(cap);
+    out->offsets     = TK_MALLOC(cap * sizeof *out->offsets);
+    out->lengths     = TK_MALLOC(cap * sizeof *out->lengths);
+    out->lines       = TK_MALLOC(cap * sizeof *out->lines);
+    out->nums        = TK_MALLOC(cap * sizeof *out->nums);
+    out->line_starts = TK_MALLOC(lcap * sizeof *out->line_starts);
+
+    TkScan s;
+    scan_init(&s, source, len, filename, true);
+    s.no_copy = true;
+    Token t;
+    int st;
+    while ((st = lex_one(&s, &t)) == TK_LEX_TOKEN) {
+        size_t i = out->count++;
+        if (i == cap) {
+            cap *= 2;
+            out->types   = TK_REALLOC(out->types, cap);
+            out->offsets = TK_REALLOC(out->offsets, cap * sizeof *out->offsets);
+            out->lengths = TK_REALLOC(out->lengths, cap * sizeof *out->lengths);
+            out->lines   = TK_REALLOC(out->lines, cap * sizeof *out->lines);
+            out->nums    = TK_REALLOC(out->nums, cap * sizeof *out->nums);
+        }
+        out->types[i]   = (uint8_t)t.type;
+        out->offsets[i] = (uint32_t)t.offset;
+        out->lengths[i] = (uint32_t)(s.tok_end - t.offset);
+        out->lines[i]   = (uint32_t)t.line;
+        out->nums[i]    = t.num;
+        /* the column is the distance from where the lexer's line began;
+         * record that once per line, lines without tokens copy the last */
+        while (out->nlines < (size_t)t.line) {
+            if (out->nlines == lcap) {
+                lcap *= 2;
+                out->line_starts = TK_REALLOC(out->line_starts, lcap * sizeof *out->line_starts);
             }
-            continue;
+            out->line_starts[out->nlines] = out->nlines ? out->line_starts[out->nlines-1] : 0;
+            out->nlines++;
         }
+        out->line_starts[t.line-1] = (uint32_t)(t.offset - (size_t)t.column);
+    }
+    if (st == TK_LEX_ERROR) scan_fail(&s);
+    return true;
+}
+
+void tk_free_soa(TkTokens *t) {
+    TK_FREE(t->types);
+    TK_FREE(t->offsets);
+    TK_FREE(t->lengths);
+    TK_FREE(t->lines);
+    TK_FREE(t->nums);
+    TK_FREE(t->line_starts);
+    memset(t, 0, sizeof *t);
+}
+
+/* ─── Incremental re-lexing ─────────────────────────────────────────────── */
 
-        /* operators */
-        if (strchr("=!<>+-*/&%|", c)) {
-            char two[3] = {c, idx+1<len?source[idx+1]:0,0};
-            const char *ops2[] = {"==","!=","<=",">=","+=","-=","*=","/=","&&","||"};
-            int m=0;
-            for (int i=0;i<10;i++) if (!strcmp(two, ops2[i])) {
-                Token t = { TOK_OP, strdup(two), line, col0, strdup(filename) };
-                tokens_push(&toks, t);
-                idx+=2; col+=2; m=1; break;
+/* one past the token's last source byte; string values drop their quotes */
+static size_t token_end(const Token *t) {
+    return t->offset + strlen(t->value) + (t->type == TOK_STR ? 2 : 0);
+}
+
+static Token *retokenize(Token *tokens, size_t *count, const char *source,
+                         const char *filename, TkEdit edit, TkDiagnostics *diags) {
+    init_tables();
+    size_t n = *count;
+    const size_t len = strlen(source);
+    /* an edit that cannot describe this text: lex it all, reuse nothing */
+    const bool fits = edit.start <= len && edit.inserted <= len - edit.start &&
+                      edit.removed <= SIZE_MAX - edit.start;
+    if (!fits) edit.start = edit.removed = edit.inserted = 0;
+    const size_t old_tail = edit.start + edit.removed;  /* first untouched old byte */
+    const size_t new_tail = edit.start + edit.inserted; /* the same byte, new text */
+
+    /* keep every token whose lexing, lookahead included, ended before the
+     * edit; lexing resumes right after the last one */
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tokens[mid].offset < edit.start) lo = mid + 1; else hi = mid;
+    }
+    size_t r = lo;
+    while (r > 0 && token_end(&tokens[r-1]) + tk_lookahead > edit.start) r--;
+    /* recovering, an unterminated string (a TOK_ERROR) searched the rest of
+     * the text for its quote, so any quote after the edit may end it now:
+     * resume at the first one.  A pass over the types, far cheaper than
+     * the lexing it saves */
+    if (diags && memchr(source + edit.start, '"', len - edit.start)) {
+        for (size_t i = 0; i < r; i++)
+            if (tokens[i].type == TOK_ERROR && tokens[i].value[0] == '"') { r = i; break; }
+    }
+
+    TkScan s;
+    scan_init(&s, source, len, filename, true);
+    s.diags = diags;
+    if (r > 0) {
+        const Token *last = &tokens[r-1];
+        s.idx  = token_end(last);
+        s.line = last->line;
+        s.col  = last->column + (int)(s.idx - last->offset);
+    }
+    s.line_start = s.idx;
+    while (s.line_start && source[s.line_start-1] != '\n') s.line_start--;
+
+    TokenArray fresh; tokens_init(&fresh);
+    size_t j = r; /* first old token that may still be reused */
+    int dline = 0, dcol = 0, colline = -1;
+    bool synced = false;
+    Token t;
+    int st;
+    while ((st = lex_one(&s, &t)) == TK_LEX_TOKEN) {
+        if (fits && t.offset >= new_tail) {
+            size_t old = t.offset - new_tail + old_tail;
+            while (j < n && tokens[j].offset < old) j++;
+            if (j < n && tokens[j].offset == old) {
+                dline   = t.line - tokens[j].line;
+                dcol    = t.column - tokens[j].column;
+                colline = tokens[j].line;
+                synced  = true;
+                tk_free_token(&t);
+                break;
             }
-            if (m) continue;
-            char s[2]={c,0};
-            Token t = { TOK_OP, strdup(s), line, col0, strdup(filename) };
-            tokens_push(&toks, t);
-            idx++; col++;
-            continue;
         }
+        tokens_push(&fresh, t);
+    }
+    if (st == TK_LEX_ERROR) scan_fail(&s);
+    if (!synced) j = n;
 
-        /* punctuation */
-        if (strchr("().,{}:;[]", c)) {
-            char s[2]={c,0};
-            Token t = { TOK_PUNCT, strdup(s), line, col0, strdup(filename) };
-            tokens_push(&toks, t);
-            idx++; col++;
-            continue;
+    /* old tokens [r, j) are replaced by fresh ones, [j, n) are shifted */
+    for (size_t i = r; i < j; i++) tk_free_token(&tokens[i]);
+    size_t tail = n - j, total = r + fresh.count + tail;
+    if (total > n) tokens = TK_REALLOC(tokens, (total ? total : 1) * sizeof *tokens);
+    memmove(tokens + r + fresh.count, tokens + j, tail * sizeof *tokens);
+    memcpy(tokens + r, fresh.data, fresh.count * sizeof *tokens);
+    TK_FREE(fresh.data);
+    for (size_t i = r + fresh.count; i < total; i++) {
+        Token *p = &tokens[i];
+        if (p->line == colline) p->column += dcol;
+        p->line   += dline;
+        p->offset  = p->offset - old_tail + new_tail;
+    }
+    *count = total;
+    return tokens;
+}
+
+Token *tk_retokenize(Token *tokens, size_t *count, const char *source, const char *filename,
+                     TkEdit edit) {
+    return retokenize(tokens, count, source, filename, edit, NULL);
+}
+
+Token *tk_retokenize_recover(Token *tokens, size_t *count, const char *source,
+                             const char *filename, TkEdit edit, TkDiagnostics *diags) {
+    return retokenize(tokens, count, source, filename, edit, diags);
+}
+
+/* ─── Parallel lexer ─────────────────────────────────────────────────────── */
+
+#ifndef TK_NO_THREADS
+
+#ifndef TK_PARALLEL_MIN
+#define TK_PARALLEL_MIN (1024 * 1024)   /* smaller inputs use tk_tokenize */
+#endif
+
+/* One slice of the input, cut right after a newline.  Workers lex every
+ * slice speculatively, as if it started outside any comment or literal; the
+ * stitch pass then checks that guess against the real lexer state. */
+typedef struct {
+    size_t     start, end;
+    TokenArray toks;
+    TkScan     scan;    /* state where the worker stopped */
+    int        status;  /* TK_LEX_END or TK_LEX_ERROR */
+} TkSegment;
+
+typedef struct {
+    const char *source;
+    size_t      len;
+    const char *filename;
+    TkSegment  *segs;
+    size_t      nsegs;
+    size_t      next;   /* next segment to take, shared by the workers */
+} TkParallelJob;
+
+static void lex_segment(const TkParallelJob *job, TkSegment *seg) {
+    tokens_init(&seg->toks);
+    TkScan *s = &seg->scan;
+    scan_init(s, job->source, job->len, job->filename, true);
+    s->idx = s->line_start = seg->start;
+    s->stop = seg->end;
+    Token t;
+    while ((seg->status = lex_one(s, &t)) == TK_LEX_TOKEN)
+        tokens_push(&seg->toks, t);
+}
+
+static void *parallel_worker(void *arg) {
+    TkParallelJob *job = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nsegs)
+        lex_segment(job, &job->segs[i]);
+    return NULL;
+}
+
+/* Append seg's tokens to out, continuing from the true lexer state in *truth.
+ *
+ * If the previous segment stopped exactly at seg->start the guess was right.
+ * Otherwise a token or comment ran over the cut, so the true lexer carries on
+ * until it produces a token at an offset where the worker also started one:
+ * from there both lexers are at a token boundary and the worker's output is
+ * exact, except for line/column, which are rebased.  A segment that never
+ * lines up is simply lexed by the true lexer. */
+static void stitch_segment(TkScan *truth, TkSegment *seg, TokenArray *out) {
+    size_t k = 0, n = seg->toks.count;
+    int dline, dcol = 0, colline = -1;
+    Token t;
+
+    if (truth->idx == seg->start) {
+        dline = truth->line - 1;
+    } else {
+        truth->stop = seg->end;
+        for (;;) {
+            int st = lex_one(truth, &t);
+            if (st == TK_LEX_ERROR) scan_fail(truth);
+            if (st == TK_LEX_END) {
+                for (size_t i = 0; i < n; i++) tk_free_token(&seg->toks.data[i]);
+                return;
+            }
+            while (k < n && seg->toks.data[k].offset < t.offset) k++;
+            if (k < n && seg->toks.data[k].offset == t.offset) break;
+            tokens_push(out, t);
         }
+        dline   = t.line - seg->toks.data[k].line;
+        dcol    = t.column - seg->toks.data[k].column;
+        colline = seg->toks.data[k].line;
+        tk_free_token(&t);
+    }
 
-        /* unknown */
-        {
-            size_t lsize = strcspn(line_start,"\n");
-            char *lt = dup_range(line_start, lsize);
-            char msg[32];
-            snprintf(msg,32,"Unknown character '%c'", c);
-            lex_error(line, col, lt, msg);
+    for (size_t i = 0; i < k; i++) tk_free_token(&seg->toks.data[i]);
+    for (size_t i = k; i < n; i++) {
+        Token *p = &seg->toks.data[i];
+        if (p->line == colline) p->column += dcol;
+        p->line += dline;
+        tokens_push(out, *p);
+    }
+
+    const TkScan *w = &seg->scan;
+    truth->idx = w->idx;
+    truth->line_start = w->line_start;
+    truth->col = w->col + (w->line == colline ? dcol : 0);
+    truth->line = w->line + dline;
+    if (seg->status == TK_LEX_ERROR) {
+        truth->err_line = w->err_line + dline;
+        truth->err_col = w->err_col + (w->err_line == colline ? dcol : 0);
+        truth->err_line_start = w->err_line_start;
+        memcpy(truth->err_msg, w->err_msg, sizeof truth->err_msg);
+        scan_fail(truth);
+    }
+}
+
+Token *tk_tokenize_parallel(const char *source, const char *filename, size_t *out_count,
+                            int nthreads) {
+    size_t len = strlen(source);
+    if (nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 1 || len < TK_PARALLEL_MIN)
+        return tk_tokenize(source, filename, out_count);
+    init_tables();
+
+    /* a few segments per thread so uneven ones balance out */
+    size_t want = (size_t)nthreads * 4, nsegs = 0;
+    TkSegment *segs = TK_MALLOC(want * sizeof *segs);
+    memset(segs, 0, want * sizeof *segs);
+    size_t at = 0;
+    for (size_t i = 1; i <= want && at < len; i++) {
+        size_t cut = len * i / want;
+        if (cut < at) cut = at;
+        const char *nl = i == want ? NULL : memchr(source + cut, '\n', len - cut);
+        size_t end = nl ? (size_t)(nl - source) + 1 : len;
+        segs[nsegs].start = at;
+        segs[nsegs].end = end;
+        nsegs++;
+        at = end;
+    }
+
+    TkParallelJob job = { source, len, filename, segs, nsegs, 0 };
+    pthread_t *threads = TK_MALLOC((size_t)nthreads * sizeof *threads);
+    int started = 0;
+    for (int i = 0; i < nthreads - 1; i++)
+        if (pthread_create(&threads[started], NULL, parallel_worker, &job) == 0) started++;
+    parallel_worker(&job);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    TK_FREE(threads);
+
+    size_t total = 0;
+    for (size_t i = 0; i < nsegs; i++) total += segs[i].toks.count;
+    TokenArray out = { TK_MALLOC((total ? total : 1) * sizeof(Token)), 0, total ? total : 1 };
+
+    TkScan truth;
+    scan_init(&truth, source, len, filename, true);
+    for (size_t i = 0; i < nsegs; i++) {
+        stitch_segment(&truth, &segs[i], &out);
+        TK_FREE(segs[i].toks.data);
+    }
+    TK_FREE(segs);
+
+    *out_count = out.count;
+    return out.data;
+}
+
+#endif /* TK_NO_THREADS */
+
+/* ─── Token cache ───────────────────────────────────────────────────────── */
+
+#ifndef TK_NO_CACHE
+
+#define TK_CACHE_MAGIC 0x314b4354u /* "TCK1", also catches byte order */
+
+/* entry layout: header, then offsets, lengths, lines and columns (uint32
+ * each), the values of numeric tokens in order, and the types (uint8).
+ * Offsets/lengths are source spans as in TkTokens. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;
+    uint64_t source_hash;
+    uint64_t source_len;
+    uint64_t count;
+    uint64_t nnums;
+    uint64_t payload_hash;  /* of everything after the header */
+} TkCacheHeader;
+
+typedef struct {
+    uint32_t *offsets, *lengths, *lines, *columns;
+    TkNumber *nums;
+    uint8_t  *types;
+} TkCacheView;
+
+static size_t cache_size(uint64_t count, uint64_t nnums) {
+    return sizeof(TkCacheHeader) + count * 17 + nnums * sizeof(TkNumber);
+}
+
+static void cache_view(char *entry, uint64_t count, uint64_t nnums, TkCacheView *v) {
+    v->offsets = (uint32_t *)(entry + sizeof(TkCacheHeader));
+    v->lengths = v->offsets + count;
+    v->lines   = v->lengths + count;
+    v->columns = v->lines + count;
+    v->nums    = (TkNumber *)(v->columns + count);
+    v->types   = (uint8_t *)(v->nums + nnums);
+}
+
+static uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+/* 8 bytes per step multiply-rotate hash; not cryptographic */
+static uint64_t tk_hash64(const void *data, size_t n, uint64_t seed) {
+    const unsigned char *p = data;
+    uint64_t h = seed ^ (n * 0x9e3779b97f4a7c15ull), k;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&k, p, 8);
+        k *= 0x87c37b91114253d5ull; k = k << 31 | k >> 33; k *= 0x4cf5ad432745937full;
+        h ^= k; h = (h << 27 | h >> 37) * 5 + 0x52dce729;
+    }
+    k = 0;
+    memcpy(&k, p, n);
+    return hash_mix(h ^ k * 0x87c37b91114253d5ull);
+}
+
+static uint64_t cache_fingerprint(void) {
+    uint64_t h = hash_mix(TK_VERSION_NUM);
+    for (size_t i = 0; i < NKEYWORDS; i++)
+        h = tk_hash64(KEYWORDS[i], strlen(KEYWORDS[i]) + 1, h);
+    for (size_t i = 0; i < NOPERATORS; i++)
+        h = tk_hash64(OPERATORS[i], strlen(OPERATORS[i]) + 1, h);
+    return h;
+}
+
+/* header describing the source; count/nnums/payload_hash are filled later */
+static char *cache_begin(const char *source, const char *dir, TkCacheHeader *h) {
+    init_tables();
+    memset(h, 0, sizeof *h);
+    h->magic       = TK_CACHE_MAGIC;
+    h->version     = TK_VERSION_NUM;
+    h->fingerprint = cache_fingerprint();
+    h->source_len  = strlen(source);
+    h->source_hash = tk_hash64(source, h->source_len, 0);
+
+    size_t n = strlen(dir) + 32;
+    char *path = TK_MALLOC(n);
+    snprintf(path, n, "%s/%016llx.tkc", dir,
+             (unsigned long long)(h->source_hash ^ h->fingerprint));
+    return path;
+}
+
+/* maps the entry at path and checks it against *want; true with *map and *size
+ * set (munmap when done) if it is a match */
+static bool cache_open(const char *path, const TkCacheHeader *want, char **map, size_t *size,
+                       TkCacheView *v) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *m = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TkCacheHeader))
+        m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return false;
+
+    TkCacheHeader h;
+    memcpy(&h, m, sizeof h);
+    *size = (size_t)st.st_size;
+    if (h.magic != TK_CACHE_MAGIC || h.version != TK_VERSION_NUM ||
+        h.fingerprint != want->fingerprint || h.source_hash != want->source_hash ||
+        h.source_len != want->source_len || h.count > *size || h.nnums > h.count ||
+        *size != cache_size(h.count, h.nnums) ||
+        h.payload_hash != tk_hash64((char *)m + sizeof h, *size - sizeof h, 0)) {
+        munmap(m, *size);
+        return false;
+    }
+    *map = m;
+    cache_view(m, h.count, h.nnums, v);
+    return true;
+}
+
+/* h->count and h->nnums set, the view filled in by the caller; written to
+ * a temporary name and renamed, so readers never see half an entry */
+static void cache_commit(const char *path, TkCacheHeader *h, char *entry) {
+    size_t size = cache_size(h->count, h->nnums);
+    h->payload_hash = tk_hash64(entry + sizeof *h, size - sizeof *h, 0);
+    memcpy(entry, h, sizeof *h);
+
+    /* a name of its own per call (threads of one process may be caching
+     * the same source); O_EXCL rather than reuse a stale leftover */
+    static TkAtomicInt seq;
+    size_t n = strlen(path) + 48;
+    char *tmp = TK_MALLOC(n);
+    snprintf(tmp, n, "%s.%ld.%u.tmp", path, (long)getpid(), (unsigned)TK_ATOMIC_INC(&seq));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t w = write(fd, entry + done, size - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) break;
+            done += (size_t)w;
         }
+        if (close(fd) == 0 && done == size && rename(tmp, path) == 0) fd = -1;
+        if (fd >= 0) unlink(tmp);
     }
+    TK_FREE(tmp);
+}
 
-    *out_count = toks.count;
-    return toks.data;
+static bool cache_valid_span(const TkCacheView *v, size_t i, uint64_t source_len) {
+    return v->types[i] < TOK_MAX && v->lines[i] >= 1 &&
+           (uint64_t)v->offsets[i] + v->lengths[i] <= source_len &&
+           v->columns[i] <= v->offsets[i] &&
+           (v->types[i] != TOK_STR || v->lengths[i] >= 2);
+}
+
+Token *tk_tokenize_cached(const char *source, const char *filename, size_t *out_count,
+                          const char *cache_dir) {
+    TkCacheHeader h;
+    char *path = cache_begin(source, cache_dir, &h), *map;
+    size_t size;
+    TkCacheView v;
+
+    if (cache_open(path, &h, &map, &size, &v)) {
+        TkCacheHeader e;
+        memcpy(&e, map, sizeof e);
+        Token *toks = TK_MALLOC((e.count ? e.count : 1) * sizeof *toks);
+        size_t i, k = 0;
+        for (i = 0; i < e.count; i++) {
+            bool num = v.types[i] == TOK_INT || v.types[i] == TOK_FLOAT;
+            if (!cache_valid_span(&v, i, e.source_len) || (num && k == e.nnums)) break;
+            bool str = v.types[i] == TOK_STR;
+            Token *t = &toks[i];
+            t->type   = (TokenType)v.types[i];
+            t->value  = dup_range(source + v.offsets[i] + str, v.lengths[i] - 2*str);
+            t->line   = (int)v.lines[i];
+            t->column = (int)v.columns[i];
+            t->file   = tk_strdup(filename);
+            t->offset = v.offsets[i];
+            t->num.i  = 0;
+            if (num) t->num = v.nums[k++];
+        }
+        munmap(map, size);
+        if (i == e.count && k == e.nnums) {
+            TK_FREE(path);
+            *out_count = e.count;
+            return toks;
+        }
+        tk_free_tokens(toks, i);
+    }
+
+    Token *toks = tk_tokenize(source, filename, out_count);
+    if (h.source_len <= UINT32_MAX) {
+        h.count = *out_count;
+        for (size_t i = 0; i < h.count; i++)
+            h.nnums += toks[i].type == TOK_INT || toks[i].type == TOK_FLOAT;
+        char *entry = TK_MALLOC(cache_size(h.count, h.nnums));
+        cache_view(entry, h.count, h.nnums, &v);
+        for (size_t i = 0, k = 0; i < h.count; i++) {
+            v.offsets[i] = (uint32_t)toks[i].offset;
+            v.lengths[i] = (uint32_t)(token_end(&toks[i]) - toks[i].offset);
+            v.lines[i]   = (uint32_t)toks[i].line;
+            v.columns[i] = (uint32_t)toks[i].column;
+            v.types[i]   = (uint8_t)toks[i].type;
+            if (toks[i].type == TOK_INT || toks[i].type == TOK_FLOAT) v.nums[k++] = toks[i].num;
+        }
+        cache_commit(path, &h, entry);
+        TK_FREE(entry);
+    }
+    TK_FREE(path);
+    return toks;
+}
+
+bool tk_tokenize_soa_cached(const char *source, const char *filename, TkTokens *out,
+                            const char *cache_dir) {
+    TkCacheHeader h;
+    char *path = cache_begin(source, cache_dir, &h), *map;
+    size_t size;
+    TkCacheView v;
+
+    if (cache_open(path, &h, &map, &size, &v)) {
+        TkCacheHeader e;
+        memcpy(&e, map, sizeof e);
+        size_t n = e.count, i, k = 0;
+        memset(out, 0, sizeof *out);
+        out->source      = source;
+        out->count       = n;
+        out->types       = TK_MALLOC(n ? n : 1);
+        out->offsets     = TK_MALLOC((n ? n : 1) * sizeof *out->offsets);
+        out->lengths     = TK_MALLOC((n ? n : 1) * sizeof *out->lengths);
+        out->lines       = TK_MALLOC((n ? n : 1) * sizeof *out->lines);
+        out->nums        = TK_MALLOC((n ? n : 1) * sizeof *out->nums);
+        out->nlines      = n ? v.lines[n-1] : 0;
+        out->line_starts = TK_MALLOC((out->nlines ? out->nlines : 1) * sizeof *out->line_starts);
+        memcpy(out->types, v.types, n);
+        memcpy(out->offsets, v.offsets, n * sizeof *out->offsets);
+        memcpy(out->lengths, v.lengths, n * sizeof *out->lengths);
+        memcpy(out->lines, v.lines, n * sizeof *out->lines);
+        /* line_starts as tk_tokenize_soa builds them */
+        size_t filled = 0;
+        for (i = 0; i < n; i++) {
+            bool num = v.types[i] == TOK_INT || v.types[i] == TOK_FLOAT;
+            if (!cache_valid_span(&v, i, e.source_len) || v.lines[i] > out->nlines ||
+                v.lines[i] < filled || (num && k == e.nnums))
+                break;
+            out->nums[i].i = 0;
+            if (num) out->nums[i] = v.nums[k++];
+            for (; filled < v.lines[i]; filled++)
+                out->line_starts[filled] = filled ? out->line_starts[filled-1] : 0;
+            out->line_starts[v.lines[i]-1] = v.offsets[i] - v.columns[i];
+        }
+        munmap(map, size);
+        if (i == n && k == e.nnums) {
+            TK_FREE(path);
+            return true;
+        }
+        tk_free_soa(out);
+    }
+
+    if (!tk_tokenize_soa(source, filename, out)) {
+        TK_FREE(path);
+        return false;
+    }
+    TkCursor c = tk_cursor(out);
+    h.count = out->count;
+    for (size_t i = 0; i < h.count; i++)
+        h.nnums += out->types[i] == TOK_INT || out->types[i] == TOK_FLOAT;
+    char *entry = TK_MALLOC(cache_size(h.count, h.nnums));
+    cache_view(entry, h.count, h.nnums, &v);
+    memcpy(v.offsets, out->offsets, h.count * sizeof *v.offsets);
+    memcpy(v.lengths, out->lengths, h.count * sizeof *v.lengths);
+    memcpy(v.lines, out->lines, h.count * sizeof *v.lines);
+    memcpy(v.types, out->types, h.count);
+    for (size_t k = 0; !tk_at_end(&c); tk_advance(&c)) {
+        v.columns[c.pos] = (uint32_t)tk_column(&c);
+        if (tk_peek(&c, 0) == TOK_INT || tk_peek(&c, 0) == TOK_FLOAT) v.nums[k++] = out->nums[c.pos];
+    }
+    cache_commit(path, &h, entry);
+    TK_FREE(entry);
+    TK_FREE(path);
+    return true;
+}
+
+#endif /* TK_NO_CACHE */
+
+/* ─── Streaming lexer ───────────────────────────────────────────────────── */
+
+#ifndef TK_STREAM_CHUNK
+#define TK_STREAM_CHUNK (64 * 1024)
+#endif
+
+struct TkLexer {
+    TkReadFn read;
+    void    *user;
+    FILE    *file;
+    int      fd;
+    char    *buf;
+    size_t   cap;
+    char    *filename;
+    int      read_error; /* errno of a failed read, the stream stops there */
+    TkScan   scan;
+};
+
+static size_t read_file_cb(void *user, char *buf, size_t cap) {
+    TkLexer *lx = user;
+    size_t got = fread(buf, 1, cap, lx->file);
+    return !got && ferror(lx->file) ? TK_READ_ERROR : got;
+}
+
+#if defined(TK_POSIX) || defined(_WIN32)
+static size_t read_fd_cb(void *user, char *buf, size_t cap) {
+    TkLexer *lx = user;
+    for (;;) {
+#ifdef TK_POSIX
+        ssize_t got = read(lx->fd, buf, cap);
+#else
+        int got = _read(lx->fd, buf, cap > INT_MAX ? INT_MAX : (unsigned)cap);
+#endif
+        if (got >= 0) return (size_t)got;
+        if (errno != EINTR) return TK_READ_ERROR;
+    }
+}
+#endif
+
+TkLexer *tk_lexer_new(TkReadFn read_fn, void *user, const char *filename) {
+    init_tables();
+    TkLexer *lx = TK_MALLOC(sizeof *lx);
+    lx->read = read_fn;
+    lx->user = user;
+    lx->file = NULL;
+    lx->fd = -1;
+    lx->cap = TK_STREAM_CHUNK;
+    lx->buf = TK_MALLOC(lx->cap);
+    lx->filename = tk_strdup(filename);
+    lx->read_error = 0;
+    scan_init(&lx->scan, lx->buf, 0, lx->filename, false);
+    return lx;
+}
+
+TkLexer *tk_lexer_from_file(FILE *f, const char *filename) {
+    TkLexer *lx = tk_lexer_new(read_file_cb, NULL, filename);
+    lx->user = lx;
+    lx->file = f;
+    return lx;
+}
+
+#if defined(TK_POSIX) || defined(_WIN32)
+TkLexer *tk_lexer_from_fd(int fd, const char *filename) {
+    TkLexer *lx = tk_lexer_new(read_fd_cb, NULL, filename);
+    lx->user = lx;
+    lx->fd = fd;
+    return lx;
+}
+#endif
+
+/* slide the window: drop consumed bytes (keeping a short current line for
+ * diagnostics), grow only if one construct outgrew the buffer, then read;
+ * false if the read failed */
+static bool lexer_refill(TkLexer *lx) {
+    TkScan *s = &lx->scan;
+    size_t keep = s->idx;
+    if (s->line_start >= s->base && s->base + s->idx - s->line_start <= TK_STREAM_CHUNK / 4)
+        keep = s->line_start - s->base;
+    if (keep) {
+        memmove(lx->buf, lx->buf + keep, s->len - keep);
+        s->len -= keep; s->idx -= keep; s->base += keep;
+    }
+    if (lx->cap - s->len < TK_STREAM_CHUNK / 2) {
+        lx->cap *= 2;
+        lx->buf = TK_REALLOC(lx->buf, lx->cap);
+    }
+    s->src = lx->buf;
+    errno = 0;
+    size_t got = lx->read(lx->user, lx->buf + s->len, lx->cap - s->len);
+    if (got == TK_READ_ERROR) {
+        lx->read_error = errno ? errno : EIO;
+        return false;
+    }
+    if (!got) s->eof = true;
+    s->len += got;
+    return true;
+}
+
+int tk_next(TkLexer *lx, Token *out) {
+    if (lx->read_error) return -1;
+    for (;;) {
+        switch (lex_one(&lx->scan, out)) {
+        case TK_LEX_TOKEN: return 1;
+        case TK_LEX_END:   return 0;
+        case TK_LEX_MORE:  if (!lexer_refill(lx)) return -1; break;
+        default:           scan_fail(&lx->scan); return 0;
+        }
+    }
+}
+
+int tk_lexer_error(const TkLexer *lx) {
+    return lx->read_error;
+}
+
+void tk_lexer_recover(TkLexer *lx, TkDiagnostics *diags) {
+    lx->scan.diags = diags;
+}
+
+void tk_lexer_free(TkLexer *lx) {
+    if (!lx) return;
+    TK_FREE(lx->buf);
+    TK_FREE(lx->filename);
+    TK_FREE(lx);
+}
+
+void tk_free_token(Token *t) {
+    TK_FREE(t->value);
+    TK_FREE(t->file);
 }
 
 /* free helper */